@@ -10,13 +10,15 @@
 #define PRINTF_MODULE   "[audio   ] "
 
 #define DEFAULT_VOLUME  80
-#define NUM_CHANNELS    2
-#define SAMPLE_RATE     44100
+#define NUM_CHANNELS    AUDIO_NUM_CHANNELS
+#define SAMPLE_RATE     AUDIO_SAMPLE_RATE
 #define BUFFER_SIZE_US  5e4
 
 static snd_pcm_t *handle;
 static int volume = 0;
 static unsigned long buf_frames = 0;
+// times the device ran out of audio to play
+static unsigned int xruns = 0;
 
 static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
 
@@ -80,6 +82,9 @@ unsigned int audio_playAudio(short *buf, unsigned int size)
             state != SND_PCM_STATE_RUNNING) {
                 int err;
 
+                if (state == SND_PCM_STATE_XRUN)
+                        ++xruns;
+
                 err = snd_pcm_prepare(handle);
                 state = snd_pcm_state(handle);
 
@@ -98,11 +103,15 @@ unsigned int audio_playAudio(short *buf, unsigned int size)
                 printf(PRINTF_MODULE "Warning: snd_pcm_writei returned %li\n", frames);
                 (void)fflush(stdout);
 
+                if (frames == -EPIPE)
+                        ++xruns;
+
                 frames = snd_pcm_recover(handle, frames, 1);
                 if (frames < 0) {
+                        pthread_mutex_unlock(&mtx);
                         printf(PRINTF_MODULE "Error: failed to write audio data with snd_pcm_writei\n");
                         (void)fflush(stdout);
-                        return frames;
+                        return 0;
                 }
         }
 
@@ -111,6 +120,26 @@ unsigned int audio_playAudio(short *buf, unsigned int size)
         return frames * NUM_CHANNELS;
 }
 
+long long audio_getDelayUs(void)
+{
+        snd_pcm_sframes_t delay = 0;
+        int err;
+
+        pthread_mutex_lock(&mtx);
+        err = snd_pcm_delay(handle, &delay);
+        pthread_mutex_unlock(&mtx);
+
+        if (err || delay < 0)
+                return 0;
+
+        return (long long)delay * 1000000LL / SAMPLE_RATE;
+}
+
+unsigned int audio_getXruns(void)
+{
+        return xruns;
+}
+
 void audio_stopAudio(void)
 {
         snd_pcm_drain(handle);
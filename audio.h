@@ -4,6 +4,9 @@
 #define AUDIO_VOLUME_MIN        0
 #define AUDIO_VOLUME_MAX        100
 
+#define AUDIO_NUM_CHANNELS      2
+#define AUDIO_SAMPLE_RATE       44100
+
 /**
  * Initializes this module
  * @return 0 if successful, otherwise error
@@ -23,6 +26,18 @@ void audio_cleanup(void);
  */
 unsigned int audio_playAudio(short *buf, unsigned int size);
 
+/**
+ * Get how long until the next queued sample is heard
+ * @return Playback delay in microseconds; 0, if the device is not running
+ */
+long long audio_getDelayUs(void);
+
+/**
+ * Get how many times playback ran out of audio data
+ * @return Number of underruns since the module was initialized
+ */
+unsigned int audio_getXruns(void);
+
 /**
  * Flushes audio data buffer
  */
@@ -0,0 +1,139 @@
+/*
+ * codec_bench.c
+ *
+ * Micro-benchmark of the stream codecs: encodes and decodes a minute of a
+ * two-tone signal with every codec and reports the time per packet, the
+ * share of one CPU core it takes to keep up with real time, and the
+ * signal-to-noise ratio of the decoded audio.
+ *
+ * Build with "make bench" for the board, or "make bench-desktop".
+ * Exits with 1 if a codec uses more than CPU_BUDGET_PERCENT of a core.
+ */
+
+#include "codec.h"
+#include "audio.h"
+#include "network.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SECONDS           60
+#define BENCH_FRAMES            (BENCH_SECONDS * AUDIO_SAMPLE_RATE)
+#define MIN_PACKET_FRAMES       64
+#define MAX_PACKETS             (BENCH_FRAMES / MIN_PACKET_FRAMES)
+
+// the master encodes and a slave decodes the stream next to playback,
+// downloads and the network loop, so each may use a small share of the
+// Bone's single 1 GHz core
+#define CPU_BUDGET_PERCENT      5.0
+
+static short *signal_buf;
+static short *decoded_buf;
+static char (*packets)[NETWORK_MAX_AUDIO_PAYLOAD];
+static int packet_len[MAX_PACKETS];
+
+static double getTimeS(void)
+{
+        struct timespec ts;
+
+        (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Two tones a little apart on each channel, with some noise
+static void makeSignal(void)
+{
+        int i;
+
+        srand(1);
+        for (i = 0; i < BENCH_FRAMES; ++i) {
+                double t = (double)i / AUDIO_SAMPLE_RATE;
+
+                signal_buf[2 * i] = (short)(8000 * sin(2 * M_PI * 440 * t) +
+                        4000 * sin(2 * M_PI * 3520 * t) + rand() % 256 - 128);
+                signal_buf[2 * i + 1] = (short)(8000 * sin(2 * M_PI * 660 * t) +
+                        4000 * sin(2 * M_PI * 5280 * t) + rand() % 256 - 128);
+        }
+}
+
+static double getSnr(int samples)
+{
+        double sig = 0, err = 0, d;
+        int i;
+
+        for (i = 0; i < samples; ++i) {
+                d = decoded_buf[i] - signal_buf[i];
+                sig += (double)signal_buf[i] * signal_buf[i];
+                err += d * d;
+        }
+
+        return err > 0 ? 10 * log10(sig / err) : INFINITY;
+}
+
+// @return Nonzero, if the codec is over its budget
+static int benchCodec(enum codec_type codec)
+{
+        int frames = codec_getPacketFrames(codec);
+        int num = BENCH_FRAMES / frames;
+        double start, enc_s, dec_s, enc_pct, dec_pct;
+        long long bytes = 0;
+        int i, n;
+
+        start = getTimeS();
+        for (i = 0; i < num; ++i) {
+                packet_len[i] = codec_encode(codec, signal_buf + i * frames * AUDIO_NUM_CHANNELS,
+                        frames, packets[i]);
+                bytes += packet_len[i];
+        }
+        enc_s = getTimeS() - start;
+
+        start = getTimeS();
+        for (i = 0; i < num; ++i) {
+                n = codec_decode(codec, packets[i], packet_len[i],
+                        decoded_buf + i * frames * AUDIO_NUM_CHANNELS);
+                if (n != frames) {
+                        printf("%-6s decode of packet %d failed (%d)\n", codec_getName(codec), i, n);
+                        return 1;
+                }
+        }
+        dec_s = getTimeS() - start;
+
+        enc_pct = 100 * enc_s / BENCH_SECONDS;
+        dec_pct = 100 * dec_s / BENCH_SECONDS;
+
+        printf("%-6s %5d packets %7.0f kbit/s  encode %6.2f us/packet %5.2f%%  "
+                "decode %6.2f us/packet %5.2f%%  SNR %5.1f dB\n",
+                codec_getName(codec), num, bytes * 8.0 / BENCH_SECONDS / 1000,
+                enc_s * 1e6 / num, enc_pct, dec_s * 1e6 / num, dec_pct,
+                getSnr(num * frames * AUDIO_NUM_CHANNELS));
+
+        return enc_pct > CPU_BUDGET_PERCENT || dec_pct > CPU_BUDGET_PERCENT;
+}
+
+int main(void)
+{
+        int over = 0;
+
+        signal_buf = malloc(BENCH_FRAMES * AUDIO_NUM_CHANNELS * sizeof(short));
+        decoded_buf = calloc(BENCH_FRAMES * AUDIO_NUM_CHANNELS, sizeof(short));
+        packets = malloc(MAX_PACKETS * sizeof(*packets));
+        if (!signal_buf || !decoded_buf || !packets) {
+                printf("Unable to allocate the signal\n");
+                return 1;
+        }
+
+        makeSignal();
+
+        printf("%d s of %d Hz stereo, CPU shares are of one core for real time (budget %.0f%%)\n",
+                BENCH_SECONDS, AUDIO_SAMPLE_RATE, CPU_BUDGET_PERCENT);
+        over |= benchCodec(CODEC_PCM);
+        over |= benchCodec(CODEC_ADPCM);
+
+        free(signal_buf);
+        free(decoded_buf);
+        free(packets);
+
+        return over;
+}
@@ -0,0 +1,352 @@
+#include "cache.h"
+
+#include "control.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define PRINTF_MODULE   "[cache   ] "
+
+#define INDEX_FILE      CACHE_DIR "index"
+#define INDEX_TMP_FILE  CACHE_DIR "index.tmp"
+
+struct cache_entry {
+        int active;
+        char vid[CONTROL_MAXLEN_VID];
+        int stored;                     // the file is complete and counted in usage
+        long long bytes;
+        unsigned long long last_used;   // larger is more recent
+        int pins;
+};
+
+static struct cache_entry entries[CACHE_MAX_ENTRIES];
+static unsigned long long use_counter = 0;
+static long long usage = 0;
+static long long budget = CACHE_DEFAULT_BUDGET;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Helper functions
+ */
+
+// NOTE: mtx must be held for the entry helpers
+static struct cache_entry *findEntry(const char *vid)
+{
+        int i;
+
+        for (i = 0; i < CACHE_MAX_ENTRIES; ++i) {
+                if (entries[i].active && !strcmp(entries[i].vid, vid))
+                        return &entries[i];
+        }
+
+        return NULL;
+}
+
+static void removeEntry(struct cache_entry *e)
+{
+        char path[CONTROL_MAXLEN_FN];
+
+        if (e->stored) {
+                cache_getFilePath(e->vid, path);
+                if (unlink(path) && errno != ENOENT) {
+                        printf(PRINTF_MODULE "Warning: unable to delete %s\n", path);
+                        (void)fflush(stdout);
+                }
+                usage -= e->bytes;
+        }
+
+        e->active = 0;
+}
+
+static struct cache_entry *addEntry(const char *vid)
+{
+        struct cache_entry *e = NULL;
+        int i;
+
+        for (i = 0; i < CACHE_MAX_ENTRIES && !e; ++i) {
+                if (!entries[i].active)
+                        e = &entries[i];
+        }
+
+        // the index is full, make room by evicting the least recently used song
+        if (!e) {
+                for (i = 0; i < CACHE_MAX_ENTRIES; ++i) {
+                        if (!entries[i].pins && (!e || entries[i].last_used < e->last_used))
+                                e = &entries[i];
+                }
+
+                // everything is queued
+                if (!e)
+                        return NULL;
+
+                printf(PRINTF_MODULE "Info: evicting %s (%lld bytes) to make room in the index\n",
+                        e->vid, e->bytes);
+                (void)fflush(stdout);
+                removeEntry(e);
+        }
+
+        memset(e, 0, sizeof(*e));
+        e->active = 1;
+        (void)snprintf(e->vid, sizeof(e->vid), "%s", vid);
+        return e;
+}
+
+// Written to a temporary file first, so a crash never leaves half an index
+static void saveIndex(void)
+{
+        FILE *file;
+        int i;
+
+        file = fopen(INDEX_TMP_FILE, "w");
+        if (!file) {
+                printf(PRINTF_MODULE "Warning: unable to write %s\n", INDEX_TMP_FILE);
+                (void)fflush(stdout);
+                return;
+        }
+
+        for (i = 0; i < CACHE_MAX_ENTRIES; ++i) {
+                if (entries[i].active && entries[i].stored)
+                        fprintf(file, "%s %s %lld %llu\n", entries[i].vid, CACHE_FORMAT,
+                                entries[i].bytes, entries[i].last_used);
+        }
+
+        if (fclose(file) || rename(INDEX_TMP_FILE, INDEX_FILE)) {
+                printf(PRINTF_MODULE "Warning: unable to save %s\n", INDEX_FILE);
+                (void)fflush(stdout);
+        }
+}
+
+static void loadIndex(void)
+{
+        char vid[CONTROL_MAXLEN_VID];
+        char format[16];
+        char path[CONTROL_MAXLEN_FN];
+        long long bytes;
+        unsigned long long last_used;
+        struct cache_entry *e;
+        struct stat st;
+        FILE *file;
+
+        file = fopen(INDEX_FILE, "r");
+        if (!file)
+                return;
+
+        // the width of the ID is CONTROL_MAXLEN_VID - 1
+        while (fscanf(file, "%31s %15s %lld %llu", vid, format, &bytes, &last_used) == 4) {
+                // songs cached in another format or lost since are forgotten
+                cache_getFilePath(vid, path);
+                if (strcmp(format, CACHE_FORMAT) || stat(path, &st) || st.st_size != bytes)
+                        continue;
+
+                if (findEntry(vid) || !(e = addEntry(vid)))
+                        continue;
+
+                e->stored = 1;
+                e->bytes = bytes;
+                e->last_used = last_used;
+                usage += bytes;
+                if (last_used > use_counter)
+                        use_counter = last_used;
+        }
+
+        fclose(file);
+}
+
+// Deletes what is not in the index, e.g. downloads cut short by a restart
+static void deleteStrayFiles(void)
+{
+        char path[sizeof(CACHE_DIR) + sizeof(((struct dirent *)0)->d_name)];
+        char vid[CONTROL_MAXLEN_VID];
+        struct cache_entry *e;
+        struct dirent *ent;
+        DIR *dir;
+        char *ext;
+
+        dir = opendir(CACHE_DIR);
+        if (!dir)
+                return;
+
+        while ((ent = readdir(dir))) {
+                if (ent->d_name[0] == '.' || !strcmp(ent->d_name, "index"))
+                        continue;
+
+                // song IDs can contain a '.' too
+                ext = strrchr(ent->d_name, '.');
+                if (ext && ext - ent->d_name < CONTROL_MAXLEN_VID) {
+                        (void)snprintf(vid, ext - ent->d_name + 1, "%s", ent->d_name);
+                        e = findEntry(vid);
+                        if (e && !strcmp(ext + 1, CACHE_FORMAT))
+                                continue;
+                }
+
+                (void)snprintf(path, sizeof(path), "%s%s", CACHE_DIR, ent->d_name);
+                (void)unlink(path);
+        }
+
+        closedir(dir);
+}
+
+// Evicts the least recently used songs until the cache is within budget
+// NOTE: mtx must be held
+static void evict(void)
+{
+        struct cache_entry *lru;
+        int i;
+
+        while (usage > budget) {
+                lru = NULL;
+                for (i = 0; i < CACHE_MAX_ENTRIES; ++i) {
+                        if (entries[i].active && entries[i].stored && !entries[i].pins &&
+                            (!lru || entries[i].last_used < lru->last_used))
+                                lru = &entries[i];
+                }
+
+                // everything left is queued
+                if (!lru)
+                        break;
+
+                printf(PRINTF_MODULE "Info: evicting %s (%lld bytes)\n", lru->vid, lru->bytes);
+                (void)fflush(stdout);
+                removeEntry(lru);
+        }
+}
+
+/*
+ * Public functions
+ */
+int cache_init(void)
+{
+        pthread_mutex_lock(&mtx);
+        memset(entries, 0, sizeof(entries));
+        usage = 0;
+        use_counter = 0;
+
+        (void)mkdir(CACHE_DIR, 0755);
+        loadIndex();
+        deleteStrayFiles();
+        evict();
+        saveIndex();
+        pthread_mutex_unlock(&mtx);
+
+        printf(PRINTF_MODULE "Notice: %lld bytes of songs cached\n", usage);
+        (void)fflush(stdout);
+
+        return 0;
+}
+
+void cache_cleanup(void)
+{
+        pthread_mutex_lock(&mtx);
+        saveIndex();
+        pthread_mutex_unlock(&mtx);
+}
+
+void cache_getFilePath(const char *vid, char *path)
+{
+        (void)snprintf(path, CONTROL_MAXLEN_FN, "%s%s.%s", CACHE_DIR, vid, CACHE_FORMAT);
+}
+
+void cache_pin(const char *vid)
+{
+        struct cache_entry *e;
+
+        pthread_mutex_lock(&mtx);
+        e = findEntry(vid);
+        if (!e)
+                e = addEntry(vid);
+        if (e)
+                ++e->pins;
+        pthread_mutex_unlock(&mtx);
+}
+
+void cache_unpin(const char *vid)
+{
+        struct cache_entry *e;
+
+        pthread_mutex_lock(&mtx);
+        e = findEntry(vid);
+        if (e && e->pins > 0 && !--e->pins) {
+                // never downloaded, nothing to keep
+                if (!e->stored)
+                        e->active = 0;
+                else
+                        evict();
+        }
+        pthread_mutex_unlock(&mtx);
+}
+
+int cache_store(const char *vid)
+{
+        char path[CONTROL_MAXLEN_FN];
+        struct cache_entry *e;
+        struct stat st;
+
+        cache_getFilePath(vid, path);
+        if (stat(path, &st))
+                return ENOENT;
+
+        pthread_mutex_lock(&mtx);
+        e = findEntry(vid);
+        if (!e)
+                e = addEntry(vid);
+        if (!e) {
+                pthread_mutex_unlock(&mtx);
+                printf(PRINTF_MODULE "Warning: cache index is full, %s is not kept\n", vid);
+                (void)fflush(stdout);
+                return ENOSPC;
+        }
+
+        if (e->stored)
+                usage -= e->bytes;
+        e->stored = 1;
+        e->bytes = st.st_size;
+        e->last_used = ++use_counter;
+        usage += e->bytes;
+
+        evict();
+        saveIndex();
+        pthread_mutex_unlock(&mtx);
+
+        return 0;
+}
+
+void cache_touch(const char *vid)
+{
+        struct cache_entry *e;
+
+        pthread_mutex_lock(&mtx);
+        e = findEntry(vid);
+        if (e)
+                e->last_used = ++use_counter;
+        pthread_mutex_unlock(&mtx);
+}
+
+int cache_setBudget(long long bytes)
+{
+        if (bytes < 0)
+                return EINVAL;
+
+        pthread_mutex_lock(&mtx);
+        budget = bytes;
+        evict();
+        saveIndex();
+        pthread_mutex_unlock(&mtx);
+
+        return 0;
+}
+
+long long cache_getBudget(void)
+{
+        return budget;
+}
+
+long long cache_getUsage(void)
+{
+        return usage;
+}
@@ -0,0 +1,89 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+/**
+ * Cache module - Keeps downloaded songs on disk across restarts. Songs are
+ * kept by video ID and format in CACHE_DIR, listed in an index file. When
+ * the cache grows past its budget, the least recently used songs that are
+ * not pinned by the song queue are deleted.
+ */
+
+#ifdef MP_DESKTOP
+#define CACHE_DIR               "/home/chris/cache/"
+#else
+#define CACHE_DIR               "/root/cache/"
+#endif
+
+// Songs are cached losslessly compressed, see lac.h. Songs cached in
+// another format are dropped when the cache is initialized.
+#define CACHE_FORMAT            "lac"
+
+#define CACHE_MAX_ENTRIES       512
+#define CACHE_DEFAULT_BUDGET    (1024LL * 1024 * 1024)
+
+/**
+ * Initializes this module, loading the index and deleting files not in it
+ * @return 0 if successful, otherwise error
+ */
+int cache_init(void);
+
+/**
+ * Cleans up this module, saving the index
+ */
+void cache_cleanup(void);
+
+/**
+ * Get the path a song is cached at
+ * @param vid YouTube video ID of the song
+ * @param path Buffer of CONTROL_MAXLEN_FN bytes to store the path
+ */
+void cache_getFilePath(const char *vid, char *path);
+
+/**
+ * Keep a song from being evicted, e.g. while it is in the song queue.
+ * Pins are counted, so a song queued twice needs to be unpinned twice.
+ * @param vid YouTube video ID of the song
+ */
+void cache_pin(const char *vid);
+
+/**
+ * Undo cache_pin(). The song stays cached until it is evicted.
+ * @param vid YouTube video ID of the song
+ */
+void cache_unpin(const char *vid);
+
+/**
+ * Record a song whose file has been written to its cache path, making it
+ * the most recently used, and evict songs if the cache is over its budget
+ * @param vid YouTube video ID of the song
+ * @return 0 if successful; ENOENT, if there is no file; ENOSPC, if the index
+ *         is full of queued songs
+ */
+int cache_store(const char *vid);
+
+/**
+ * Mark a cached song as the most recently used
+ * @param vid YouTube video ID of the song
+ */
+void cache_touch(const char *vid);
+
+/**
+ * Set how many bytes the cache may use, evicting songs if necessary
+ * @param bytes Budget in bytes
+ * @return 0 if successful; EINVAL, if the budget is negative
+ */
+int cache_setBudget(long long bytes);
+
+/**
+ * Get how many bytes the cache may use
+ * @return Budget in bytes
+ */
+long long cache_getBudget(void);
+
+/**
+ * Get how many bytes the cached songs use
+ * @return Size of the cached songs in bytes
+ */
+long long cache_getUsage(void);
+
+#endif
@@ -0,0 +1,218 @@
+#include "codec.h"
+
+#include "audio.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#define PCM_PACKET_FRAMES       CODEC_MIN_PACKET_FRAMES  // 256 bytes
+#define ADPCM_PACKET_FRAMES     CODEC_MAX_PACKET_FRAMES  // 8 + 256 bytes in stereo
+
+// per channel block header: predictor (2 bytes), step index (1 byte), padding
+#define ADPCM_CH_HDR_SIZE       4
+#define ADPCM_HDR_SIZE          (ADPCM_CH_HDR_SIZE * AUDIO_NUM_CHANNELS)
+#define ADPCM_MAX_INDEX         88
+
+static const short step_table[ADPCM_MAX_INDEX + 1] = {
+        7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31,
+        34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143,
+        157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+        724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024,
+        3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+        15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const signed char index_table[16] = {
+        -1, -1, -1, -1, 2, 4, 6, 8,
+        -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+struct adpcm_state {
+        int predictor;
+        int index;
+};
+
+// encoder state carries over between packets for better quality, but is
+// also written to every packet so each one can be decoded on its own
+static struct adpcm_state enc_state[AUDIO_NUM_CHANNELS];
+
+/*
+ * Helper functions
+ */
+static int clampSample(int val)
+{
+        if (val > 32767)
+                return 32767;
+        if (val < -32768)
+                return -32768;
+        return val;
+}
+
+static int clampIndex(int idx)
+{
+        if (idx < 0)
+                return 0;
+        if (idx > ADPCM_MAX_INDEX)
+                return ADPCM_MAX_INDEX;
+        return idx;
+}
+
+// Applies a 4-bit code to the state, shared by the encoder and decoder
+static void adpcmStep(struct adpcm_state *st, int code)
+{
+        int step = step_table[st->index];
+        int diff = step >> 3;
+
+        if (code & 4)
+                diff += step;
+        if (code & 2)
+                diff += step >> 1;
+        if (code & 1)
+                diff += step >> 2;
+
+        st->predictor = clampSample(code & 8 ? st->predictor - diff : st->predictor + diff);
+        st->index = clampIndex(st->index + index_table[code]);
+}
+
+static int adpcmEncodeSample(struct adpcm_state *st, int sample)
+{
+        int step = step_table[st->index];
+        int diff = sample - st->predictor;
+        int code = 0;
+
+        if (diff < 0) {
+                code = 8;
+                diff = -diff;
+        }
+
+        if (diff >= step) {
+                code |= 4;
+                diff -= step;
+        }
+        step >>= 1;
+        if (diff >= step) {
+                code |= 2;
+                diff -= step;
+        }
+        step >>= 1;
+        if (diff >= step)
+                code |= 1;
+
+        adpcmStep(st, code);
+
+        return code;
+}
+
+static int adpcmEncode(const short *in, int frames, char *out)
+{
+        unsigned char *nibbles = (unsigned char *)out + ADPCM_HDR_SIZE;
+        short predictor;
+        int ch, n, code;
+
+        for (ch = 0; ch < AUDIO_NUM_CHANNELS; ++ch) {
+                predictor = htons(enc_state[ch].predictor);
+                (void)memcpy(out + ch * ADPCM_CH_HDR_SIZE, &predictor, sizeof(predictor));
+                out[ch * ADPCM_CH_HDR_SIZE + 2] = enc_state[ch].index;
+                out[ch * ADPCM_CH_HDR_SIZE + 3] = 0;
+        }
+
+        // samples are coded in their interleaved order, two per byte
+        for (n = 0; n < frames * AUDIO_NUM_CHANNELS; ++n) {
+                code = adpcmEncodeSample(&enc_state[n % AUDIO_NUM_CHANNELS], in[n]);
+
+                if (n & 1)
+                        nibbles[n >> 1] |= code << 4;
+                else
+                        nibbles[n >> 1] = code;
+        }
+
+        return ADPCM_HDR_SIZE + (frames * AUDIO_NUM_CHANNELS + 1) / 2;
+}
+
+static int adpcmDecode(const char *in, int len, short *out)
+{
+        const unsigned char *nibbles = (const unsigned char *)in + ADPCM_HDR_SIZE;
+        struct adpcm_state st[AUDIO_NUM_CHANNELS];
+        short predictor;
+        int ch, n, frames, code;
+
+        if (len < ADPCM_HDR_SIZE)
+                return -1;
+
+        frames = (len - ADPCM_HDR_SIZE) * 2 / AUDIO_NUM_CHANNELS;
+        if (frames > ADPCM_PACKET_FRAMES)
+                return -1;
+
+        for (ch = 0; ch < AUDIO_NUM_CHANNELS; ++ch) {
+                (void)memcpy(&predictor, in + ch * ADPCM_CH_HDR_SIZE, sizeof(predictor));
+                st[ch].predictor = (short)ntohs(predictor);
+                st[ch].index = clampIndex((unsigned char)in[ch * ADPCM_CH_HDR_SIZE + 2]);
+        }
+
+        for (n = 0; n < frames * AUDIO_NUM_CHANNELS; ++n) {
+                code = n & 1 ? nibbles[n >> 1] >> 4 : nibbles[n >> 1] & 0x0F;
+
+                adpcmStep(&st[n % AUDIO_NUM_CHANNELS], code);
+                out[n] = st[n % AUDIO_NUM_CHANNELS].predictor;
+        }
+
+        return frames;
+}
+
+/*
+ * Public functions
+ */
+enum codec_type codec_fromName(const char *name)
+{
+        if (!strcmp(name, "pcm"))
+                return CODEC_PCM;
+        if (!strcmp(name, "adpcm"))
+                return CODEC_ADPCM;
+
+        return CODEC_UNKNOWN;
+}
+
+const char *codec_getName(enum codec_type codec)
+{
+        switch (codec) {
+        case CODEC_PCM:
+                return "pcm";
+        case CODEC_ADPCM:
+                return "adpcm";
+        default:
+                return "unknown";
+        }
+}
+
+int codec_getPacketFrames(enum codec_type codec)
+{
+        return codec == CODEC_ADPCM ? ADPCM_PACKET_FRAMES : PCM_PACKET_FRAMES;
+}
+
+int codec_encode(enum codec_type codec, const short *in, int frames, char *out)
+{
+        if (codec == CODEC_ADPCM)
+                return adpcmEncode(in, frames, out);
+
+        (void)memcpy(out, in, frames * AUDIO_NUM_CHANNELS * sizeof(*in));
+        return frames * AUDIO_NUM_CHANNELS * sizeof(*in);
+}
+
+int codec_decode(enum codec_type codec, const char *in, int len, short *out)
+{
+        int frames;
+
+        switch (codec) {
+        case CODEC_PCM:
+                frames = len / (AUDIO_NUM_CHANNELS * sizeof(*out));
+                if (frames > PCM_PACKET_FRAMES)
+                        return -1;
+
+                (void)memcpy(out, in, frames * AUDIO_NUM_CHANNELS * sizeof(*out));
+                return frames;
+        case CODEC_ADPCM:
+                return adpcmDecode(in, len, out);
+        default:
+                return -1;
+        }
+}
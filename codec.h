@@ -0,0 +1,61 @@
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+/**
+ * Codec module - Compresses interleaved S16 audio for the multicast stream.
+ * Every packet is encoded independently, so a lost packet does not affect
+ * the ones after it.
+ */
+
+#define CODEC_MAXLEN_NAME       16
+#define CODEC_MAX_PACKET_FRAMES 256
+#define CODEC_MIN_PACKET_FRAMES 64
+
+enum codec_type {
+        CODEC_UNKNOWN = -1,
+        CODEC_PCM     = 0,              // raw S16, 1:1
+        CODEC_ADPCM   = 1               // IMA ADPCM, 4:1
+};
+
+/**
+ * Look up a codec by name
+ * @param name Name of the codec ("pcm" or "adpcm")
+ * @return Codec; CODEC_UNKNOWN, if there is no such codec
+ */
+enum codec_type codec_fromName(const char *name);
+
+/**
+ * Get the name of a codec
+ * @param codec Codec
+ * @return Name of the codec
+ */
+const char *codec_getName(enum codec_type codec);
+
+/**
+ * Get how many frames of audio a codec puts in each packet
+ * @param codec Codec
+ * @return Number of frames per packet
+ */
+int codec_getPacketFrames(enum codec_type codec);
+
+/**
+ * Encode one packet of audio
+ * @param codec Codec
+ * @param in Input samples
+ * @param frames Number of frames in the input, at most codec_getPacketFrames()
+ * @param out Output buffer of NETWORK_MAX_AUDIO_PAYLOAD bytes
+ * @return Number of bytes written to out
+ */
+int codec_encode(enum codec_type codec, const short *in, int frames, char *out);
+
+/**
+ * Decode one packet of audio
+ * @param codec Codec
+ * @param in Encoded packet
+ * @param len Size of the encoded packet in bytes
+ * @param out Output buffer of CODEC_MAX_PACKET_FRAMES frames
+ * @return Number of frames written to out; <0, if the packet is malformed
+ */
+int codec_decode(enum codec_type codec, const char *in, int len, short *out);
+
+#endif
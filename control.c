@@ -3,8 +3,15 @@
 #include "network.h"
 #include "audio.h"
 #include "downloader.h"
+#include "cache.h"
+#include "lac.h"
+#include "prefetch.h"
+#include "library.h"
 #include "main.h"
 #include "disp.h"
+#include "timesync.h"
+#include "resample.h"
+#include "plc.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -13,32 +20,114 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
 
 #define PRINTF_MODULE           "[control ] "
 
-#define DATA_OFFSET_INTO_WAVE   44
 #define SAMPLE_SIZE             (sizeof(short))
 
+#define FRAME_SIZE              (AUDIO_NUM_CHANNELS * SAMPLE_SIZE)
+
 #define SLAVE_BUF_SIZE          30000
-#define SLAVE_AUDIO_WAIT_US     1e4
+#define SLAVE_AUDIO_WAIT_US     2e3
 #define SLAVE_PLAY_DELAY_US     1
-
-#define NUM_SONGS_TO_DOWNLOAD 3
-
-#ifdef MP_DESKTOP
-static const char *CACHE_DIR = "/home/chris/cache/";
-#else
-static const char* CACHE_DIR = "/root/cache/";
-#endif
-static const char* WAV_EXT = ".wav";
+#define SLAVE_WRITE_FRAMES      441             // 10 ms per write, so playout is re-checked often
+#define SLAVE_MAX_GAP_FRAMES    (AUDIO_SAMPLE_RATE / 2)
+#define SLAVE_DEVICE_BUFFER_US  20000
+
+#define MASTER_CHUNK_SAMPLES    (441 * AUDIO_NUM_CHANNELS)
+
+// songs are decoded from their file as they play, a second ahead of
+// playout, and songs still being downloaded as their file grows
+#define DEFAULT_PREBUFFER_US    2000000
+#define STREAM_READ_SAMPLES     (AUDIO_SAMPLE_RATE * AUDIO_NUM_CHANNELS)
+#define STREAM_INITIAL_SAMPLES  (30 * STREAM_READ_SAMPLES)
+
+// the transmitter sends the master's audio at the rate it is played, a lead
+// ahead of the master's own playout, so slaves neither see the bursts of the
+// ALSA write loop nor run dry when the master's writes stall
+#define TX_INTERVAL_NS          5000000
+#define TX_DEFAULT_LEAD_US      100000
+// it catches up at up to 4 times the real-time rate, e.g. after a new song
+#define TX_MAX_SAMPLES          (4 * AUDIO_SAMPLE_RATE / (1000000000 / TX_INTERVAL_NS) * AUDIO_NUM_CHANNELS)
+// the timeline the audio is stamped with only follows the master's playout
+// once they differ by more than this, to smooth out jitter in the ALSA delay
+#define TX_RESYNC_US            1000
+
+// slaves jump to the presentation time stamped by the master once their
+// playout is further than this from it, and resample to close smaller errors
+#define SYNC_TOLERANCE_US       5000
+// drift controller: 1 ms of playout error asks for 200 ppm (proportional)
+// and accumulates 10 ppm per second (integral)
+#define SYNC_KP_DIV             5
+#define SYNC_KI_DIV             100000000LL
+#define SYNC_ERR_SMOOTHING      8
+// buffered audio slaves aim for while they have no estimate of the master's clock
+#define SLAVE_TARGET_BUFFER_US  40000
+// a presentation time further than this from the one predicted by the
+// stream position starts a new timeline, e.g. after the master paused
+#define SYNC_ANCHOR_TOLERANCE_US 5000
+
+// the songs to fetch are planned again this often while playing, as
+// playback gets closer to the ones not fetched yet
+#define PREFETCH_INTERVAL_US    5000000
 
 static enum control_mode mode = CONTROL_MODE_MASTER;
 
 static song_t *song_queue = NULL;
+// files of the songs in song_queue, and of removed songs still downloading
+static song_file_t *song_files = NULL;
+// incremented whenever songs are added to or removed from song_queue
+static unsigned int queue_version = 0;
 
 static short *au_buf = NULL;            // ring buffer when in slave mode, otherwise entire music file
 static int au_buf_start = 0;            // represents current index of audio data
 static int au_buf_end = 0;              // represents index after valid audio data
+static unsigned int au_buf_gen = 0;     // incremented when au_buf is replaced under audioLoop
+
+// master only: the current song's file until all of it is decoded,
+// used by audioLoop alone
+static struct lac_reader au_file;
+static unsigned int au_file_gen = 0;    // au_buf_gen the file belongs to
+static int au_buf_cap = 0;              // samples allocated for au_buf
+static int au_song_samples = 0;         // length of the song, if known
+static long long stream_prebuffer_us = DEFAULT_PREBUFFER_US;
+
+// master only: the first song of the queue, while playback waits for it to
+// download, and whether the queue ran empty since the last song played
+static const song_t *starved_song = NULL;
+static long long starved_since_us = 0;
+static bool playback_idle = true;
+static long long prefetch_planned_us = 0;
+
+// slave only: maps the ring buffer onto the master's timeline
+static unsigned int au_buf_pos = 0;     // stream position (in frames) of au_buf_start
+static unsigned int anchor_pos = 0;     // stream position of the last timeline anchor
+static long long anchor_pts = 0;        // master time (us) anchor_pos is heard
+static int anchored = 0;
+static unsigned int seg_start_pos = 0;  // stream position the current stretch of audio started at
+static unsigned int concealed_frames = 0;
+
+// master only: transmitter state, au_buf indices like au_buf_start
+static int tx_idx = 0;                  // next sample to send
+static long long tx_start_pts = 0;      // master time (us) au_buf_start is heard, 0 if unknown
+static int tx_anchor_idx = 0;           // sample of the last timeline anchor
+static long long tx_anchor_pts = 0;     // master time (us) tx_anchor_idx is heard
+static int tx_anchored = 0;
+static unsigned int tx_flush_frames = 0;        // sent frames that will not be played
+static long long tx_lead_us = TX_DEFAULT_LEAD_US;
+
+static short chunk[MASTER_CHUNK_SAMPLES];
+static short stream_buf[STREAM_READ_SAMPLES];
+static short silence[SLAVE_WRITE_FRAMES * AUDIO_NUM_CHANNELS];
+static short resampled[SLAVE_WRITE_FRAMES * AUDIO_NUM_CHANNELS];
+static short plc_hist[PLC_HISTORY_FRAMES * AUDIO_NUM_CHANNELS];
+static short plc_buf[PLC_FADE_FRAMES * AUDIO_NUM_CHANNELS];
+
+// slave only: drift controller state
+static long long drift_err_us = 0;      // smoothed playout error
+static long long drift_integral = 0;    // integral term in ppm * SYNC_KI_DIV
+static long long drift_updated_us = 0;
 
 // playback control on master device
 static int repeat_status = 0;
@@ -47,39 +136,156 @@ static pthread_mutex_t mtx_play  = PTHREAD_MUTEX_INITIALIZER;
 
 static int loop = 0;
 static pthread_t th_aud;
+static pthread_t th_tx;
 static pthread_t th_ping;
 static pthread_mutex_t mtx_audio = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t mtx_queue = PTHREAD_MUTEX_INITIALIZER;
 
-static struct timespec slave_wait = { .tv_nsec = SLAVE_AUDIO_WAIT_US };
+static struct timespec slave_wait = { .tv_nsec = SLAVE_AUDIO_WAIT_US * 1000 };
 
 /*
  * Helper functions
  */
 
+static long long bytesToUs(long long bytes)
+{
+        return bytes * 1000000 / (AUDIO_SAMPLE_RATE * FRAME_SIZE);
+}
+
+static void resetDownload(struct control_download *download)
+{
+        download->phase = CONTROL_DOWNLOAD_WAITING;
+        download->percent = -1;
+        download->fetched_bytes = -1;
+        download->total_bytes = -1;
+        download->speed = -1;
+        download->eta_s = -1;
+}
+
+// Finds the file of a song in the queue, or creates it, and takes a
+// reference to it
+// NOTE: mtx_queue must be held
+static song_file_t *acquireFile(const char *vid)
+{
+        song_file_t *file;
+
+        for (file = song_files; file; file = file->next) {
+                if (!strcmp(file->vid, vid)) {
+                        // the download may have been cancelled already, then
+                        // it starts over, see control_onDownloadComplete()
+                        if (file->status == CONTROL_SONG_STATUS_REMOVED)
+                                file->status = CONTROL_SONG_STATUS_LOADING;
+                        ++file->refs;
+                        return file;
+                }
+        }
+
+        file = malloc(sizeof(song_file_t));
+        if (!file)
+                return NULL;
+
+        strcpy(file->vid, vid);
+
+        // Update song with its cached filepath, and keep the file while queued
+        cache_getFilePath(file->vid, file->filepath);
+        cache_pin(file->vid);
+
+        file->status = CONTROL_SONG_STATUS_QUEUED;
+        file->refs = 1;
+        file->downloading = 0;
+        file->loaded_bytes = 0;
+        resetDownload(&file->download);
+
+        file->prev = NULL;
+        file->next = song_files;
+        if (song_files)
+                song_files->prev = file;
+        song_files = file;
+
+        return file;
+}
+
+// NOTE: mtx_queue must be held
+static void freeFile(song_file_t *file)
+{
+        if (file->prev)
+                file->prev->next = file->next;
+        else
+                song_files = file->next;
+        if (file->next)
+                file->next->prev = file->prev;
+
+        // the file stays cached for the next time the song is
+        // queued, until it is evicted
+        cache_unpin(file->vid);
+        free(file);
+}
+
+// Drops a reference to a file. The last one frees it, unless it is still
+// downloading; then the download is cancelled and the file is freed by
+// control_onDownloadComplete().
+// NOTE: mtx_queue must be held
+static void releaseFile(song_file_t *file)
+{
+        if (--file->refs > 0)
+                return;
+
+        if (file->downloading)
+                file->status = CONTROL_SONG_STATUS_REMOVED;
+        else
+                freeFile(file);
+}
+
 // Checks if any songs need to be downloaded and processed
-// Downloads them in a new background thread
+// Downloads them in the downloader's worker threads, as far ahead of
+// playback as the prefetch planner asks for
 static void updateDownloadedSongs(void)
 {
-        // Go through first N songs and download them if not already downloaded
-        song_t* current_song = song_queue;
-        for (int i = 0; i < NUM_SONGS_TO_DOWNLOAD; i++) {
-                if (!current_song) {
-                        break;
-                } 
-
-                if (current_song->status == CONTROL_SONG_STATUS_QUEUED) {
-                        // Download the song in new thread
-                        downloader_queueDownloadSong(current_song);
-                }
-                else if (current_song->status == CONTROL_SONG_STATUS_REMOVED) {
-                        // Tried to remove song while downloading
-                        // Remove it here now
-                        control_removeSong(current_song->vid, CONTROL_RMSONG_FIRST);
-                }
+        struct prefetch_song songs[PREFETCH_MAX_DEPTH];
+        song_file_t *files[PREFETCH_MAX_DEPTH];
+        long long played_us = 0;
+        song_t *s;
+        int depth;
+        int num = 0;
+        int i;
 
-                current_song = current_song->next;
+        pthread_mutex_lock(&mtx_audio);
+        if (au_buf)
+                played_us = bytesToUs((long long)au_buf_start * SAMPLE_SIZE);
+        pthread_mutex_unlock(&mtx_audio);
+
+        // songs still downloading, or not yet, have no known length; their
+        // files are referenced until they are queued for download, in case
+        // the songs are removed meanwhile
+        pthread_mutex_lock(&mtx_queue);
+        for (s = song_queue; s && num < PREFETCH_MAX_DEPTH; s = s->next, ++num) {
+                files[num] = s->file;
+                ++files[num]->refs;
+                songs[num].downloaded_us = bytesToUs(s->file->loaded_bytes);
+                songs[num].duration_us = s->file->downloading || s->file->status == CONTROL_SONG_STATUS_QUEUED ?
+                        -1 : songs[num].downloaded_us;
+        }
+        if (!song_queue || !song_queue->playing)
+                played_us = 0;
+        prefetch_planned_us = timesync_getTimeUs();
+        pthread_mutex_unlock(&mtx_queue);
+
+        depth = prefetch_plan(played_us, songs, num, downloader_getWorkers(), cache_getBudget());
+
+        // Go through the planned songs and download them if not already
+        // downloaded, a song queued twice is downloaded for the first
+        for (i = 0; i < depth; i++) {
+                if (files[i]->status == CONTROL_SONG_STATUS_QUEUED) {
+                        // if the downloader is busy, the song stays queued
+                        // and is offered again after the next download
+                        (void)downloader_queueDownloadSong(files[i]);
+                }
         }
+
+        pthread_mutex_lock(&mtx_queue);
+        for (i = 0; i < num; i++)
+                releaseFile(files[i]);
+        pthread_mutex_unlock(&mtx_queue);
 }
 
 static void debugPrintSong(song_t* song) {
@@ -89,7 +295,7 @@ static void debugPrintSong(song_t* song) {
         }
         else {
                 char statusStr[10];
-                switch (song->status) {
+                switch (control_getSongStatus(song)) {
                         case CONTROL_SONG_STATUS_UNKNOWN:
                                 strcpy(statusStr, "UNKNOWN");
                                 break;
@@ -109,7 +315,7 @@ static void debugPrintSong(song_t* song) {
                                 strcpy(statusStr, "PLAYING");
                                 break;
                 }
-                printf("id=[%s], status=[%s], file=[%s]\n", song->vid, statusStr, song->filepath);
+                printf("id=[%s], status=[%s], file=[%s]\n", song->file->vid, statusStr, song->file->filepath);
         }
 }
 
@@ -147,97 +353,79 @@ void control_deleteAndFreeSong(song_t* song) {
 
         if (!song) return;
 
-        bool shouldRemoveFromQueue = false;
-        bool shouldDeleteFile = false;
-        bool shouldFree = false;
-
-        if (song->status == CONTROL_SONG_STATUS_QUEUED) {
-                shouldRemoveFromQueue = true;
-                shouldFree = true;
-        }
-        else if (song->status == CONTROL_SONG_STATUS_LOADING) {
-                // Dangerous to delete while downloading
-                // Set status to delete later by the Downloader
-                control_setSongStatus(song, CONTROL_SONG_STATUS_REMOVED);
-                shouldRemoveFromQueue = true;
-        }
-        else if (song->status == CONTROL_SONG_STATUS_LOADED
-                || song->status == CONTROL_SONG_STATUS_PLAYING) {
-
-                shouldRemoveFromQueue = true;
-                shouldDeleteFile = true;
-                shouldFree = true;
-        }
-        else if (song->status == CONTROL_SONG_STATUS_REMOVED) {
-                shouldDeleteFile = true;
-                shouldFree = true;
+        pthread_mutex_lock(&mtx_queue);
+        // If deleting the first song, update the song_queue
+        if (song == song_queue) {
+                song_queue = song->next;
         }
-
-        if (shouldDeleteFile) {
-
-                // Delete wav file on disk
-                // only delete if the song does not appear again in the queue
-                bool isSongDuplicated = false;
-                song_t* curr_song = song_queue;
-                while (curr_song) {
-                        if (strcmp(curr_song->vid, song->vid) == 0 && curr_song != song) {
-                                isSongDuplicated = true;
-                                break;
-                        }
-                        curr_song = curr_song->next;
+        else {
+                // Otherwise find predecessor and make it point to the next song
+                song_t* prev_song = song_queue;
+                while(prev_song && prev_song->next != song) {
+                        prev_song = prev_song->next;
                 }
 
-                if (!isSongDuplicated) {
-                        downloader_deleteSongFile(song);
+                // Already deleted
+                if (!prev_song) {
+                        pthread_mutex_unlock(&mtx_queue);
+                        return;
                 }
+
+                prev_song->next = song->next;
         }
+        ++queue_version;
 
-        if (shouldRemoveFromQueue) {
-                pthread_mutex_lock(&mtx_queue);
-                // If deleting the first song, update the song_queue
-                if (song == song_queue) {
-                        song_queue = song->next;
-                }
-                else {      
-                        // Otherwise find predecessor and make it point to the next song  
-                        song_t* prev_song = song_queue;
-                        while(prev_song && prev_song->next != song) {
-                                prev_song = prev_song->next;
-                        }
+        // The file is only deleted or cancelled with the last song using it
+        releaseFile(song->file);
+        pthread_mutex_unlock(&mtx_queue);
+        network_notifyStatusChanged();
 
-                        if (prev_song) {
-                                prev_song->next = song->next;
-                        }
-                }
-                pthread_mutex_unlock(&mtx_queue);
+        free(song);
 
-                updateDownloadedSongs();
-        }
+        updateDownloadedSongs();
+}
 
-        if (shouldFree) {
-                free(song);
-        }
+// Continues transmitting from sample idx, because playout is about to jump
+// there. Audio already sent past the playout position is flushed from slaves.
+// NOTE: mtx_audio must be held
+static void restartTransmitter(int idx)
+{
+        if (tx_idx > au_buf_start)
+                tx_flush_frames += (tx_idx - au_buf_start) / AUDIO_NUM_CHANNELS;
+
+        tx_idx = idx;
+        tx_anchored = 0;
+        tx_start_pts = 0;
+}
+
+// Checks if enough of a song is downloaded for it to start playing
+static bool isPrebuffered(long long loaded_bytes)
+{
+        return loaded_bytes > 0 &&
+                loaded_bytes >= stream_prebuffer_us * AUDIO_SAMPLE_RATE / 1000000 * FRAME_SIZE;
 }
 
 // Called when a song is done playing
 // Or after a song is skipped
 static int loadNewSong(void)
 {
-        FILE *file;
-        int sizeInBytes;
-        int samplesRead;
-        int bufEnd;
+        long long frames;
+        int samples;
+        int cap;
         short *buf;
         song_t* song_curr;
 
+        long long wait_us = -1;
+
         // get new song from queue
         pthread_mutex_lock(&mtx_queue);
         if (!song_queue) {
+                playback_idle = true;
                 pthread_mutex_unlock(&mtx_queue);
                 return ENODATA;
         }
 
-        if (song_queue->status == CONTROL_SONG_STATUS_PLAYING) {
+        if (song_queue->playing) {
                 // Delete first song, and move next song into queue
                 song_t* song_prev = song_queue;
                 pthread_mutex_unlock(&mtx_queue);
@@ -249,71 +437,374 @@ static int loadNewSong(void)
         }
 
         if (!song_queue) {
+                playback_idle = true;
                 pthread_mutex_unlock(&mtx_queue);
                 return ENODATA;
-        } else  if (song_queue->status != CONTROL_SONG_STATUS_LOADED) {
-                // check if the audio file has been downloaded
+        } else  if (song_queue->file->status != CONTROL_SONG_STATUS_LOADED &&
+                    (song_queue->file->status != CONTROL_SONG_STATUS_LOADING ||
+                     !isPrebuffered(song_queue->file->loaded_bytes))) {
+                // check if enough of the audio file has been downloaded,
+                // playback waits for it unless the queue had run empty
+                if (!playback_idle && starved_song != song_queue) {
+                        starved_song = song_queue;
+                        starved_since_us = timesync_getTimeUs();
+                }
                 pthread_mutex_unlock(&mtx_queue);
                 return ENODATA;
         } else {
                 // no song playing previously, load the first song
                 song_curr = song_queue;
         }
+
+        // the song was due before it was completely downloaded
+        if (!playback_idle && song_curr->file->status != CONTROL_SONG_STATUS_LOADED)
+                wait_us = starved_song == song_curr ? timesync_getTimeUs() - starved_since_us : 0;
+        starved_song = NULL;
         pthread_mutex_unlock(&mtx_queue);
 
+        if (wait_us >= 0)
+                prefetch_recordStarvation(song_curr->file->vid, wait_us);
+
         printf(PRINTF_MODULE "Info: Playing next song ");
         debugPrintSong(song_curr);
 
+        // the previous song may have been skipped before it was all decoded
+        lac_close(&au_file);
+
         // Open file
-        file = fopen(song_curr->filepath, "r");
-        if (file == NULL) {
-                printf(PRINTF_MODULE "Warning: Unable to open file %s.\n", song_curr->filepath);
+        if (lac_open(&au_file, song_curr->file->filepath)) {
+                printf(PRINTF_MODULE "Warning: Unable to open file %s.\n", song_curr->file->filepath);
                 (void)fflush(stdout);
                 return EIO;
         }
 
-        // Get file size
-        fseek(file, 0, SEEK_END);
-        sizeInBytes = ftell(file) - DATA_OFFSET_INTO_WAVE;
-        fseek(file, DATA_OFFSET_INTO_WAVE, SEEK_SET);
-        bufEnd = sizeInBytes / SAMPLE_SIZE;
-
-        // Allocate Space
-        buf = malloc(sizeInBytes);
+        // Allocate Space, with room to grow if the song is still downloading
+        frames = lac_getFrames(&au_file);
+        cap = frames >= 0 ? (int)frames * AUDIO_NUM_CHANNELS : STREAM_INITIAL_SAMPLES;
+        if (cap < STREAM_READ_SAMPLES)
+                cap = STREAM_READ_SAMPLES;
+        buf = malloc(cap * SAMPLE_SIZE);
         if (buf == NULL) {
                 printf(PRINTF_MODULE "Warning: Unable to allocate %d bytes for file %s.\n",
-                        sizeInBytes, song_curr->filepath);
+                        (int)(cap * SAMPLE_SIZE), song_curr->file->filepath);
                 (void)fflush(stdout);
-                fclose(file);
+                lac_close(&au_file);
                 return ENOMEM;
         }
 
-        // Read data:
-        samplesRead = fread(buf, SAMPLE_SIZE, bufEnd, file);
-        if (samplesRead != bufEnd) {
-                printf(PRINTF_MODULE "Warning: Unable to read %d samples from file %s (read %d).\n",
-                        bufEnd, song_curr->filepath, samplesRead);
-                fclose(file);
+        // Read data, the rest is decoded by streamAudio as the song plays
+        samples = lac_read(&au_file, buf, STREAM_READ_SAMPLES);
+        if (samples < 0) {
+                printf(PRINTF_MODULE "Warning: Unable to decode file %s.\n", song_curr->file->filepath);
+                (void)fflush(stdout);
+                lac_close(&au_file);
                 free(buf);
                 return EIO;
         }
 
-        fclose(file);
+        if (lac_isEnd(&au_file))
+                lac_close(&au_file);
 
-        control_setSongStatus(song_curr, CONTROL_SONG_STATUS_PLAYING);        
+        pthread_mutex_lock(&mtx_queue);
+        if (song_curr == song_queue)
+                song_curr->playing = 1;
+        pthread_mutex_unlock(&mtx_queue);
+        network_notifyStatusChanged();
+        cache_touch(song_curr->file->vid);
+        playback_idle = false;
 
         // copy data to au_buf
         pthread_mutex_lock(&mtx_audio);
         if (au_buf)
                 free(au_buf);
+        restartTransmitter(0);
         au_buf = buf;
         au_buf_start = 0;
-        au_buf_end = bufEnd;
+        au_buf_end = samples;
+        au_buf_cap = cap;
+        au_song_samples = frames >= 0 ? (int)frames * AUDIO_NUM_CHANNELS : 0;
+        au_file_gen = au_buf_gen;
         pthread_mutex_unlock(&mtx_audio);
 
         return 0;
 }
 
+// Decodes more of the current song as playback gets close to the end of
+// what is decoded, including what has been downloaded of it meanwhile
+static void streamAudio(void)
+{
+        long long frames;
+        int samples, cap;
+        bool done = false;
+        short *buf;
+
+        // only audioLoop extends au_buf, so its end can be read unlocked
+        if (au_file.fd < 0 || au_buf_end - au_buf_start > STREAM_READ_SAMPLES)
+                return;
+
+        samples = lac_read(&au_file, stream_buf, STREAM_READ_SAMPLES);
+        if (samples < 0) {
+                printf(PRINTF_MODULE "Warning: Unable to decode the rest of the song\n");
+                (void)fflush(stdout);
+                samples = 0;
+                done = true;
+        }
+        frames = lac_getFrames(&au_file);
+
+        pthread_mutex_lock(&mtx_audio);
+        if (au_file_gen != au_buf_gen) {
+                // the song was skipped
+                done = true;
+        } else if (samples > 0) {
+                cap = au_buf_cap;
+                while (au_buf_end + samples > cap)
+                        cap *= 2;
+
+                buf = cap == au_buf_cap ? au_buf : realloc(au_buf, cap * SAMPLE_SIZE);
+                if (buf) {
+                        au_buf = buf;
+                        au_buf_cap = cap;
+                        (void)memcpy(au_buf + au_buf_end, stream_buf, samples * SAMPLE_SIZE);
+                        au_buf_end += samples;
+                } else {
+                        printf(PRINTF_MODULE "Warning: Unable to allocate memory to play the rest of the song\n");
+                        (void)fflush(stdout);
+                        done = true;
+                }
+        }
+        if (!done && frames >= 0)
+                au_song_samples = (int)frames * AUDIO_NUM_CHANNELS;
+        pthread_mutex_unlock(&mtx_audio);
+
+        if (done || lac_isEnd(&au_file))
+                lac_close(&au_file);
+}
+
+// NOTE: mtx_audio must be held for the slave ring buffer helpers
+static int slaveBufFill(void)
+{
+        if (au_buf_end >= au_buf_start)
+                return au_buf_end - au_buf_start;
+
+        return SLAVE_BUF_SIZE - au_buf_start + au_buf_end;
+}
+
+static int slaveBufSpace(void)
+{
+        // one frame is kept free to tell a full buffer from an empty one
+        return SLAVE_BUF_SIZE - slaveBufFill() - AUDIO_NUM_CHANNELS;
+}
+
+// Copies samples to the end of the ring buffer, or silence if buf is NULL
+static void slaveBufWrite(const short *buf, int samples)
+{
+        int len;
+
+        while (samples > 0) {
+                len = SLAVE_BUF_SIZE - au_buf_end;
+                if (len > samples)
+                        len = samples;
+
+                if (buf) {
+                        (void)memcpy(au_buf + au_buf_end, buf, len * SAMPLE_SIZE);
+                        buf += len;
+                } else {
+                        (void)memset(au_buf + au_buf_end, 0, len * SAMPLE_SIZE);
+                }
+
+                au_buf_end = (au_buf_end + len) % SLAVE_BUF_SIZE;
+                samples -= len;
+        }
+}
+
+// Replaces samples already in the ring buffer
+// @param offset Index of the first sample to replace, relative to au_buf_start
+static void slaveBufOverwrite(const short *buf, int offset, int samples)
+{
+        int idx, len;
+
+        idx = (au_buf_start + offset) % SLAVE_BUF_SIZE;
+
+        while (samples > 0) {
+                len = SLAVE_BUF_SIZE - idx;
+                if (len > samples)
+                        len = samples;
+
+                (void)memcpy(au_buf + idx, buf, len * SAMPLE_SIZE);
+                buf += len;
+                idx = (idx + len) % SLAVE_BUF_SIZE;
+                samples -= len;
+        }
+}
+
+static void slaveBufAdvance(int samples)
+{
+        au_buf_start = (au_buf_start + samples) % SLAVE_BUF_SIZE;
+        au_buf_pos += samples / AUDIO_NUM_CHANNELS;
+}
+
+// Copies the frames right before the end of the ring buffer to plc_hist,
+// including ones that were already played
+// @return Number of frames copied
+static int slaveBufHistory(unsigned int end_pos)
+{
+        int frames, idx, i;
+
+        frames = (int)(end_pos - seg_start_pos);
+        if (frames > PLC_HISTORY_FRAMES)
+                frames = PLC_HISTORY_FRAMES;
+
+        idx = au_buf_end - frames * AUDIO_NUM_CHANNELS;
+        if (idx < 0)
+                idx += SLAVE_BUF_SIZE;
+
+        for (i = 0; i < frames * AUDIO_NUM_CHANNELS; ++i) {
+                plc_hist[i] = au_buf[idx];
+                idx = (idx + 1) % SLAVE_BUF_SIZE;
+        }
+
+        return frames;
+}
+
+// Fills a gap at the end of the ring buffer with concealment
+static void slaveBufConceal(int hist_frames, int gap)
+{
+        int offset, len;
+
+        for (offset = 0; offset < gap; offset += len) {
+                len = gap - offset;
+                if (len > PLC_FADE_FRAMES)
+                        len = PLC_FADE_FRAMES;
+
+                // past the fade, concealment is plain silence
+                if (offset >= PLC_FADE_FRAMES) {
+                        slaveBufWrite(NULL, len * AUDIO_NUM_CHANNELS);
+                        continue;
+                }
+
+                plc_conceal(plc_hist, hist_frames, offset, plc_buf, len);
+                slaveBufWrite(plc_buf, len * AUDIO_NUM_CHANNELS);
+        }
+
+        concealed_frames += gap;
+}
+
+// Master time (us) the frame at the given stream position should be heard
+static long long slavePtsAt(unsigned int pos)
+{
+        return anchor_pts + (long long)(int)(pos - anchor_pos) * 1000000LL / AUDIO_SAMPLE_RATE;
+}
+
+static void resetDrift(void)
+{
+        drift_err_us = 0;
+        drift_integral = 0;
+        drift_updated_us = 0;
+        resample_reset();
+        resample_setRatio(0);
+}
+
+// Steer the resampler with a PI controller, so the slave's sound card
+// follows the master's clock instead of its own crystal
+// @param err_us Playout error; >0, when audio is consumed too slowly
+static void updateDrift(long long err_us)
+{
+        long long now = timesync_getTimeUs();
+        long long max_integral = (long long)RESAMPLE_MAX_PPM * SYNC_KI_DIV;
+
+        drift_err_us += (err_us - drift_err_us) / SYNC_ERR_SMOOTHING;
+
+        if (drift_updated_us) {
+                drift_integral += drift_err_us * (now - drift_updated_us);
+
+                if (drift_integral > max_integral)
+                        drift_integral = max_integral;
+                else if (drift_integral < -max_integral)
+                        drift_integral = -max_integral;
+        }
+        drift_updated_us = now;
+
+        resample_setRatio(drift_err_us / SYNC_KP_DIV + drift_integral / SYNC_KI_DIV);
+}
+
+// Plays the next chunk of the slave's ring buffer at the time the master
+// stamped on it, so that every room is heard at the same time
+static void playSlaveAudio(void)
+{
+        int samples, consumed;
+        long long diff, delay_us;
+
+        pthread_mutex_lock(&mtx_audio);
+
+        if (!au_buf || slaveBufFill() == 0) {
+                // audio data can come from master at any time, the device
+                // keeps playing what it already has in the meantime
+                pthread_mutex_unlock(&mtx_audio);
+                nanosleep(&slave_wait, NULL);
+                return;
+        }
+
+        delay_us = audio_getDelayUs();
+
+        // keep most of the buffered audio in the ring rather than the device,
+        // where late and rebuilt packets can still be filled in
+        if (delay_us > SLAVE_DEVICE_BUFFER_US) {
+                pthread_mutex_unlock(&mtx_audio);
+                nanosleep(&slave_wait, NULL);
+                return;
+        }
+
+        if (timesync_isSynced()) {
+                // compare when the head of the buffer is due with when it
+                // would be heard if it was written to the device now
+                diff = slavePtsAt(au_buf_pos) -
+                        timesync_toMasterTime(timesync_getTimeUs() + delay_us);
+
+                if (diff > SYNC_TOLERANCE_US) {
+                        // early, pad the device with silence until the audio is due
+                        samples = diff * AUDIO_SAMPLE_RATE / 1000000LL;
+                        if (samples > SLAVE_WRITE_FRAMES)
+                                samples = SLAVE_WRITE_FRAMES;
+
+                        resetDrift();
+                        pthread_mutex_unlock(&mtx_audio);
+                        (void)audio_playAudio(silence, samples * AUDIO_NUM_CHANNELS);
+                        return;
+                } else if (diff < -SYNC_TOLERANCE_US) {
+                        // late, skip the audio that should already have been heard
+                        samples = -diff * AUDIO_SAMPLE_RATE / 1000000LL * AUDIO_NUM_CHANNELS;
+                        if (samples > slaveBufFill())
+                                samples = slaveBufFill();
+
+                        slaveBufAdvance(samples);
+                        resetDrift();
+                        pthread_mutex_unlock(&mtx_audio);
+                        return;
+                }
+
+                updateDrift(-diff);
+        } else {
+                // without a clock estimate, hold the amount of buffered audio steady
+                updateDrift((long long)slaveBufFill() / AUDIO_NUM_CHANNELS * 1000000LL /
+                        AUDIO_SAMPLE_RATE + delay_us - SLAVE_TARGET_BUFFER_US);
+        }
+
+        // play up to the end of the valid data or the end of the ring
+        if (au_buf_start < au_buf_end)
+                samples = au_buf_end - au_buf_start;
+        else
+                samples = SLAVE_BUF_SIZE - au_buf_start;
+
+        samples = resample_process(au_buf + au_buf_start, samples / AUDIO_NUM_CHANNELS,
+                resampled, SLAVE_WRITE_FRAMES, &consumed);
+        slaveBufAdvance(consumed * AUDIO_NUM_CHANNELS);
+
+        if (samples > 0)
+                (void)audio_playAudio(resampled, samples * AUDIO_NUM_CHANNELS);
+
+        pthread_mutex_unlock(&mtx_audio);
+}
+
 static void clearSongQueue(void)
 {
         song_t *s;
@@ -322,15 +813,19 @@ static void clearSongQueue(void)
         while (song_queue) {
                 s = song_queue;
                 song_queue = s->next;
+                releaseFile(s->file);
                 free(s);
         }
+        ++queue_version;
         pthread_mutex_unlock(&mtx_queue);
+        network_notifyStatusChanged();
 }
 
 static void *audioLoop(void *arg)
 {
         unsigned int num_played;
-        short *buf;
+        unsigned int samples;
+        unsigned int gen;
 
         // prepare thread to be locked when first initialized (not playing)
         // only applies to master, slave should always play
@@ -338,29 +833,44 @@ static void *audioLoop(void *arg)
                 pthread_mutex_lock(&mtx_play);
 
         while (loop) {
+                // nothing is being written now, so slaves can be stopped
+                // exactly where the master stopped rather than a lead later
+                if (mode == CONTROL_MODE_MASTER && !play_status) {
+                        pthread_mutex_lock(&mtx_audio);
+                        restartTransmitter(au_buf_start);
+                        pthread_mutex_unlock(&mtx_audio);
+                }
+
                 // sleep thread if not in playing status
                 pthread_mutex_lock(&mtx_play);
                 pthread_mutex_unlock(&mtx_play);
 
+                if (mode == CONTROL_MODE_SLAVE) {
+                        playSlaveAudio();
+                        continue;
+                }
+
+                streamAudio();
+
+                if (timesync_getTimeUs() - prefetch_planned_us >= PREFETCH_INTERVAL_US)
+                        updateDownloadedSongs();
+
                 pthread_mutex_lock(&mtx_audio);
 
                 // take new song from the top of the queue if:
                 // - au_buf (audio data from file) is NULL
                 // - end of the current song is reached
-                if (!au_buf ||
-                    (mode == CONTROL_MODE_MASTER && au_buf_end-1 <= au_buf_start) ||
-                    au_buf_end-1 == au_buf_start) {
-                        // busy waiting during slave mode
-                        // audio data can come from master at any time
-                        if (mode == CONTROL_MODE_SLAVE) {
-                                audio_stopAudio();
+                if (!au_buf || au_buf_end-1 <= au_buf_start) {
+                        // the download has yet to catch up with playback
+                        if (au_buf && au_file.fd >= 0) {
                                 pthread_mutex_unlock(&mtx_audio);
-                                nanosleep(&slave_wait, NULL);
+                                (void)nanosleep(&slave_wait, NULL);
                                 continue;
                         }
 
                         // repeat song if set
                         if (au_buf && repeat_status && song_queue) {
+                                restartTransmitter(0);
                                 au_buf_start = 0;
                         } else {
                                 // unlock the audio mutex, as loadNewSong will need it
@@ -380,37 +890,106 @@ static void *audioLoop(void *arg)
                         continue;
                 }
 
-                // handle circular buffer for slave
-                if (mode == CONTROL_MODE_SLAVE && au_buf_start > au_buf_end) {
-                        buf = au_buf + au_buf_start;
-                        num_played = audio_playAudio(buf, SLAVE_BUF_SIZE - au_buf_start);
-
-                        if (num_played > 0)
-                                au_buf_start = (au_buf_start + num_played) % SLAVE_BUF_SIZE;
-
-                        pthread_mutex_unlock(&mtx_audio);
-                        continue;
-                } else if (mode == CONTROL_MODE_UNKNOWN) {
+                if (mode == CONTROL_MODE_UNKNOWN) {
                         pthread_mutex_unlock(&mtx_audio);
                         control_pauseAudio();
                         continue;
                 }
 
-                buf = au_buf + au_buf_start;
-                num_played = audio_playAudio(buf, au_buf_end - au_buf_start);
+                samples = au_buf_end - au_buf_start;
+                if (samples > MASTER_CHUNK_SAMPLES)
+                        samples = MASTER_CHUNK_SAMPLES;
 
-                if (num_played < 0) {
-                        pthread_mutex_unlock(&mtx_audio);
-                        continue;
+                // the chunk is played from a copy, so the transmitter is not
+                // held up while the device blocks
+                (void)memcpy(chunk, au_buf + au_buf_start, samples * sizeof(*chunk));
+                gen = au_buf_gen;
+                pthread_mutex_unlock(&mtx_audio);
+
+                // slaves are sent the audio by the transmitter thread
+                num_played = audio_playAudio(chunk, samples);
+
+                // the song may have been skipped while the chunk was playing
+                pthread_mutex_lock(&mtx_audio);
+                if (gen == au_buf_gen && num_played) {
+                        au_buf_start += num_played;
+
+                        // measured here, as the delay is only exact between writes
+                        tx_start_pts = timesync_getTimeUs() + audio_getDelayUs();
                 }
+                pthread_mutex_unlock(&mtx_audio);
+        }
 
-                // send audio to slave devices
-                if (mode == CONTROL_MODE_MASTER)
-                        network_sendAudio((char *)buf, num_played * sizeof(short) / sizeof(char));
+        return NULL;
+}
+
+// Sends the audio that is heard within the lead from now
+static void transmit(void)
+{
+        long long now, playout_pts, expected, pts;
+        unsigned int flush;
+        int target;
 
-                au_buf_start += num_played;
+        pthread_mutex_lock(&mtx_audio);
+
+        flush = tx_flush_frames;
+        tx_flush_frames = 0;
+        if (flush)
+                network_sendFlush(flush);
 
+        // wait for the first write to the device to place the timeline
+        if (mode != CONTROL_MODE_MASTER || !play_status || !au_buf || !tx_start_pts) {
                 pthread_mutex_unlock(&mtx_audio);
+                return;
+        }
+
+        now = timesync_getTimeUs();
+        playout_pts = tx_start_pts;
+
+        expected = tx_anchor_pts + (long long)(au_buf_start - tx_anchor_idx) /
+                AUDIO_NUM_CHANNELS * 1000000LL / AUDIO_SAMPLE_RATE;
+        if (!tx_anchored || llabs(playout_pts - expected) > TX_RESYNC_US) {
+                tx_anchor_idx = au_buf_start;
+                tx_anchor_pts = playout_pts;
+                tx_anchored = 1;
+        }
+
+        // never hold back what the device already plays, even with a short lead
+        target = au_buf_start + (int)((now + tx_lead_us - playout_pts) *
+                AUDIO_SAMPLE_RATE / 1000000LL) * AUDIO_NUM_CHANNELS;
+        if (target < au_buf_start)
+                target = au_buf_start;
+        if (target > au_buf_end)
+                target = au_buf_end;
+        if (target > tx_idx + TX_MAX_SAMPLES)
+                target = tx_idx + TX_MAX_SAMPLES;
+
+        if (target > tx_idx) {
+                pts = tx_anchor_pts + (long long)(tx_idx - tx_anchor_idx) /
+                        AUDIO_NUM_CHANNELS * 1000000LL / AUDIO_SAMPLE_RATE;
+                network_sendAudio((char *)(au_buf + tx_idx), (target - tx_idx) * SAMPLE_SIZE, pts);
+                tx_idx = target;
+        }
+
+        pthread_mutex_unlock(&mtx_audio);
+}
+
+static void *transmitLoop(void *arg)
+{
+        struct timespec next;
+
+        (void)clock_gettime(CLOCK_MONOTONIC, &next);
+
+        // wake up on a fixed schedule, however long each round took
+        while (loop) {
+                next.tv_nsec += TX_INTERVAL_NS;
+                if (next.tv_nsec >= 1000000000) {
+                        next.tv_nsec -= 1000000000;
+                        ++next.tv_sec;
+                }
+                (void)clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+                transmit();
         }
 
         return NULL;
@@ -424,11 +1003,17 @@ int control_init(void)
         int err = 0;
 
         loop = 1;
+        au_file.fd = -1;
 
         downloader_init();
 
-        if ((err = pthread_create(&th_aud, NULL, audioLoop, NULL)))
+        if ((err = pthread_create(&th_aud, NULL, audioLoop, NULL))) {
                 printf(PRINTF_MODULE "Error: unable to create thread for audio\n");
+                return err;
+        }
+
+        if ((err = pthread_create(&th_tx, NULL, transmitLoop, NULL)))
+                printf(PRINTF_MODULE "Error: unable to create thread for the transmitter\n");
 
         return err;
 }
@@ -438,6 +1023,7 @@ void control_cleanup(void)
         loop = 0;
 
         (void)pthread_join(th_aud, NULL);
+        (void)pthread_join(th_tx, NULL);
         (void)pthread_join(th_ping, NULL);
 
         downloader_cleanup();
@@ -452,6 +1038,8 @@ void control_cleanup(void)
                 au_buf = NULL;
         }
         pthread_mutex_unlock(&mtx_audio);
+
+        lac_close(&au_file);
 }
 
 void control_setMode(enum control_mode m)
@@ -472,12 +1060,16 @@ void control_setMode(enum control_mode m)
                 }
 
                 au_buf_start = 0;
-                au_buf_end = 1;
+                au_buf_end = 0;
+                au_buf_pos = 0;
+                ++au_buf_gen;
+                anchored = 0;
+                concealed_frames = 0;
                 pthread_mutex_unlock(&mtx_audio);
 
                 // set static buf for slave device
                 pthread_mutex_lock(&mtx_audio);
-                au_buf = malloc(SLAVE_BUF_SIZE * sizeof(*au_buf));
+                au_buf = calloc(SLAVE_BUF_SIZE, sizeof(*au_buf));
                 if (!au_buf) {
                         printf(PRINTF_MODULE "Error: unable to allocate memory for audio buffer while setting slave mode\n");
                         main_triggerShutdown();
@@ -494,9 +1086,11 @@ enum control_mode control_getMode(void)
         return mode;
 }
 
-void control_queueAudio(char *buf, unsigned int length)
+void control_queueAudio(char *buf, unsigned int length, unsigned int pos, long long pts)
 {
-        int available, available_bytes;
+        int frames, space, gap, skip, overlap;
+        int hist_frames = 0, xfade;
+        unsigned int end_pos;
 
         if (mode != CONTROL_MODE_SLAVE)
                 return;
@@ -507,25 +1101,83 @@ void control_queueAudio(char *buf, unsigned int length)
                 return;
         }
 
+        frames = length / FRAME_SIZE;
+
         pthread_mutex_lock(&mtx_audio);
         if (!au_buf) {
                 pthread_mutex_unlock(&mtx_audio);
                 return;
         }
 
+        end_pos = au_buf_pos + slaveBufFill() / AUDIO_NUM_CHANNELS;
+        gap = (int)(pos - end_pos);
+
+        if (!anchored || gap > SLAVE_MAX_GAP_FRAMES || gap < -SLAVE_MAX_GAP_FRAMES) {
+                // start buffering a new stretch of the stream at this packet
+                au_buf_start = 0;
+                au_buf_end = 0;
+                au_buf_pos = pos;
+                anchor_pos = pos;
+                anchor_pts = pts;
+                anchored = 1;
+                seg_start_pos = pos;
+                gap = 0;
+                resetDrift();
+        } else if (gap < 0) {
+                // packet starts in audio that is already buffered, e.g. it
+                // arrived late or was rebuilt from parity
+                skip = (int)(au_buf_pos - pos);
+                if (skip < 0)
+                        skip = 0;
+
+                // replace the part that has not been played yet
+                overlap = -gap - skip;
+                if (overlap > frames - skip)
+                        overlap = frames - skip;
+                if (overlap > 0) {
+                        slaveBufOverwrite((short *)(buf + skip * FRAME_SIZE),
+                                (pos + skip - au_buf_pos) * AUDIO_NUM_CHANNELS,
+                                overlap * AUDIO_NUM_CHANNELS);
+                        skip += overlap;
+                }
+
+                if (skip >= frames) {
+                        pthread_mutex_unlock(&mtx_audio);
+                        return;
+                }
+
+                buf += skip * FRAME_SIZE;
+                frames -= skip;
+                pts += (long long)skip * 1000000LL / AUDIO_SAMPLE_RATE;
+                pos += skip;
+                gap = 0;
+        }
+
+        // follow jumps in the master's timeline
+        if (llabs(pts - slavePtsAt(pos)) > SYNC_ANCHOR_TOLERANCE_US) {
+                anchor_pos = pos;
+                anchor_pts = pts;
+        }
+
+        space = slaveBufSpace() / AUDIO_NUM_CHANNELS;
+
+        // keep the stream aligned when packets were lost on the way, and
+        // cover the hole with concealment rather than a click
+        if (gap > 0) {
+                if (gap > space)
+                        gap = space;
+
+                hist_frames = slaveBufHistory(end_pos);
+                slaveBufConceal(hist_frames, gap);
+                space -= gap;
+        }
+
         // check if the entirety of the received buffer will fit in the audio buffer
         // otherwise we can only store some of the received audio
-        if (au_buf_start < au_buf_end)
-                available = SLAVE_BUF_SIZE - (au_buf_end - au_buf_start) - 1;
-        else
-                available = au_buf_start - au_buf_end - 1;
-
-	available_bytes = available * sizeof(short);
-	
-        if (length > available_bytes) {
-                length = available_bytes;
+        if (frames > space) {
+                frames = space;
 
-                if (length == 0) {
+                if (frames == 0) {
                         pthread_mutex_unlock(&mtx_audio);
                         printf(PRINTF_MODULE "Warning: tried to enqueue audio when buffer is full\n");
                         (void)fflush(stdout);
@@ -537,18 +1189,82 @@ void control_queueAudio(char *buf, unsigned int length)
         }
 
         // copy received audio data
-        if (au_buf_end + length/sizeof(short) >= SLAVE_BUF_SIZE) {
-                (void)memcpy(au_buf + au_buf_end, buf, (SLAVE_BUF_SIZE - au_buf_end) * sizeof(short));
-                length = length - (SLAVE_BUF_SIZE - au_buf_end) * sizeof(short);
-                au_buf_end = 0;
+        if (gap > 0) {
+                xfade = frames < PLC_XFADE_FRAMES ? frames : PLC_XFADE_FRAMES;
+
+                (void)memcpy(plc_buf, buf, xfade * FRAME_SIZE);
+                plc_crossfade(plc_hist, hist_frames, gap, plc_buf, xfade);
+                slaveBufWrite(plc_buf, xfade * AUDIO_NUM_CHANNELS);
+
+                buf += xfade * FRAME_SIZE;
+                frames -= xfade;
+        }
+
+        slaveBufWrite((short *)buf, frames * AUDIO_NUM_CHANNELS);
+
+        pthread_mutex_unlock(&mtx_audio);
+}
+
+unsigned int control_getConcealedFrames(void)
+{
+        return concealed_frames;
+}
+
+long long control_getBufferedUs(void)
+{
+        int fill = 0;
+
+        pthread_mutex_lock(&mtx_audio);
+        if (mode == CONTROL_MODE_SLAVE && au_buf)
+                fill = slaveBufFill();
+        pthread_mutex_unlock(&mtx_audio);
+
+        return (long long)fill / AUDIO_NUM_CHANNELS * 1000000LL / AUDIO_SAMPLE_RATE;
+}
+
+void control_flushAudio(unsigned int pos)
+{
+        int keep;
+
+        pthread_mutex_lock(&mtx_audio);
+        if (mode != CONTROL_MODE_SLAVE || !au_buf || !anchored) {
+                pthread_mutex_unlock(&mtx_audio);
+                return;
         }
 
-        (void)memcpy(au_buf + au_buf_end, buf, length);
-        au_buf_end += length / sizeof(short);
+        keep = (int)(pos - au_buf_pos);
+        if (keep < 0)
+                keep = 0;
+
+        if (keep * AUDIO_NUM_CHANNELS < slaveBufFill())
+                au_buf_end = (au_buf_start + keep * AUDIO_NUM_CHANNELS) % SLAVE_BUF_SIZE;
 
         pthread_mutex_unlock(&mtx_audio);
 }
 
+int control_setLead(long long lead_us)
+{
+        if (lead_us < 0 || lead_us > CONTROL_MAX_LEAD_US)
+                return EINVAL;
+
+        tx_lead_us = lead_us;
+        return 0;
+}
+
+long long control_getLead(void)
+{
+        return tx_lead_us;
+}
+
+int control_setPrebuffer(long long prebuffer_us)
+{
+        if (prebuffer_us < 0 || prebuffer_us > CONTROL_MAX_PREBUFFER_US)
+                return EINVAL;
+
+        stream_prebuffer_us = prebuffer_us;
+        return 0;
+}
+
 void control_playAudio(void)
 {
         // check if it is already playing
@@ -558,6 +1274,7 @@ void control_playAudio(void)
         // NOTE: play_status change must occur after changing the mutex
         pthread_mutex_unlock(&mtx_play);
         play_status = 1;
+        network_notifyStatusChanged();
 
         // if buffer is empty, next song should be enqueued by audioLoop
 }
@@ -571,6 +1288,7 @@ void control_pauseAudio(void)
 
                 pthread_mutex_lock(&mtx_play);
                 play_status = 0;
+                network_notifyStatusChanged();
         }
 }
 
@@ -598,10 +1316,12 @@ void control_skipSong(void)
 
                 // Delete the current buf, so we're forced to load a new one
                 pthread_mutex_lock(&mtx_audio);
+                restartTransmitter(0);
                 if (au_buf)
                         free(au_buf);
-                        au_buf = NULL;
+                au_buf = NULL;
                 au_buf_start = 0;
+                ++au_buf_gen;
                 pthread_mutex_unlock(&mtx_audio);
 
                 // resume audio if it was playing before
@@ -621,22 +1341,35 @@ int control_getRepeatStatus(void)
         return repeat_status;
 }
 
-void control_addSong(char *url)
+int control_addSong(char *url)
 {
-        song_t* new_song = malloc(sizeof(song_t));
+        char path[CONTROL_MAXLEN_FN];
+        unsigned int id;
+        song_t* new_song;
+
+        if (strlen(url) >= CONTROL_MAXLEN_VID)
+                return EINVAL;
 
-        strcpy(new_song->vid, url);
+        // tracks of the library are checked now, other songs once they download
+        if (!library_parseId(url, &id) && library_getPath(id, path))
+                return ENOENT;
 
-        // Update song with .wav filepath
-        strcpy(new_song->filepath, CACHE_DIR);
-        strcat(new_song->filepath, new_song->vid);
-        strcat(new_song->filepath, WAV_EXT);
+        new_song = malloc(sizeof(song_t));
+        if (!new_song)
+                return ENOMEM;
 
+        new_song->playing = 0;
         new_song->next = NULL;
-        new_song->status = CONTROL_SONG_STATUS_QUEUED;
 
-        // Add to end of list
+        // Add to end of list, sharing the file of the song if it is queued already
         pthread_mutex_lock(&mtx_queue);
+        new_song->file = acquireFile(url);
+        if (!new_song->file) {
+                pthread_mutex_unlock(&mtx_queue);
+                free(new_song);
+                return ENOMEM;
+        }
+
         if (!song_queue) {
                 song_queue = new_song;
         } else {
@@ -647,8 +1380,10 @@ void control_addSong(char *url)
 
                 current_song->next = new_song;
         }
+        ++queue_version;
 
         pthread_mutex_unlock(&mtx_queue);
+        network_notifyStatusChanged();
 
         // Download songs if needed
         updateDownloadedSongs();
@@ -658,6 +1393,8 @@ void control_addSong(char *url)
 #endif
 
         debugPrintSongList();
+
+        return 0;
 }
 
 int control_removeSong(char *url, int index)
@@ -683,32 +1420,52 @@ int control_removeSong(char *url, int index)
         return 0;
 }
 
-enum control_song_status control_setSongStatus(song_t *song, enum control_song_status status)
+enum control_song_status control_setSongStatus(song_file_t *file, enum control_song_status status)
 {
-        song_t *s;
+        long long frames = -1;
 
         // prevent changing status to unknown state
         if (status == CONTROL_SONG_STATUS_UNKNOWN)
                 return status;
 
+        // a song found in the cache was not downloaded, its length is read
+        // from the file for the prefetch planner
+        if (status == CONTROL_SONG_STATUS_LOADED && !file->downloading)
+                frames = lac_probeFrames(file->filepath);
+
         pthread_mutex_lock(&mtx_queue);
 
-        // verify that the song is in the queue
-        s = song_queue;
-        while (s != song && s != NULL)
-                s = s->next;
-        if (!s) {
+        // if no song uses the file anymore, we return that instead
+        if (file->status == CONTROL_SONG_STATUS_REMOVED) {
                 pthread_mutex_unlock(&mtx_queue);
-                return CONTROL_SONG_STATUS_UNKNOWN;
+                return CONTROL_SONG_STATUS_REMOVED;
         }
 
-        // if the song is set to be removed, we return that instead
-        if (s->status == CONTROL_SONG_STATUS_REMOVED) {
-                pthread_mutex_unlock(&mtx_queue);
-                return CONTROL_SONG_STATUS_REMOVED;
+        if (status == CONTROL_SONG_STATUS_LOADING) {
+                file->downloading = 1;
+                resetDownload(&file->download);
+        } else if (frames > 0 && !file->loaded_bytes) {
+                file->loaded_bytes = frames * FRAME_SIZE;
         }
+        file->status = status;
+        pthread_mutex_unlock(&mtx_queue);
+        network_notifyStatusChanged();
+
+        return status;
+}
 
-        s->status = status;
+enum control_song_status control_getSongStatus(const song_t *song)
+{
+        return song->playing ? CONTROL_SONG_STATUS_PLAYING : song->file->status;
+}
+
+enum control_song_status control_getCurrentStatus(void)
+{
+        enum control_song_status status = CONTROL_SONG_STATUS_UNKNOWN;
+
+        pthread_mutex_lock(&mtx_queue);
+        if (song_queue)
+                status = control_getSongStatus(song_queue);
         pthread_mutex_unlock(&mtx_queue);
 
         return status;
@@ -717,7 +1474,7 @@ enum control_song_status control_setSongStatus(song_t *song, enum control_song_s
 void control_getSongProgress(int *curr, int *end)
 {
         *curr = au_buf_start;
-        *end = au_buf_end;
+        *end = au_song_samples > au_buf_end ? au_song_samples : au_buf_end;
 }
 
 const song_t *control_getQueue(void)
@@ -725,12 +1482,125 @@ const song_t *control_getQueue(void)
         return song_queue;
 }
 
-void control_onDownloadComplete(song_t* song) 
+int control_getSongIndex(const song_file_t *file)
+{
+        const song_t *s;
+        int index = 0;
+
+        pthread_mutex_lock(&mtx_queue);
+        for (s = song_queue; s && s->file != file; s = s->next)
+                ++index;
+        pthread_mutex_unlock(&mtx_queue);
+
+        return s ? index : -1;
+}
+
+unsigned int control_getQueueVersion(void)
+{
+        return queue_version;
+}
+
+int control_getQueueIds(char (**ids)[CONTROL_MAXLEN_VID], int *len, unsigned int *version)
 {
-        if (song->status == CONTROL_SONG_STATUS_REMOVED) {
-                control_deleteAndFreeSong(song);
+        const song_t *s;
+        void *p;
+        int num = 0;
+
+        pthread_mutex_lock(&mtx_queue);
+        for (s = song_queue; s; s = s->next)
+                ++num;
+
+        // keep one entry, so an empty queue still has an array
+        p = realloc(*ids, (num + 1) * sizeof(**ids));
+        if (!p) {
+                pthread_mutex_unlock(&mtx_queue);
+                return ENOMEM;
+        }
+        *ids = p;
+
+        num = 0;
+        for (s = song_queue; s; s = s->next)
+                (void)strcpy((*ids)[num++], s->file->vid);
+
+        *len = num;
+        *version = queue_version;
+        pthread_mutex_unlock(&mtx_queue);
+
+        return 0;
+}
+
+int control_getDownloads(struct control_download_status *list, int max)
+{
+        const song_t *s;
+        int index = 0;
+        int num = 0;
+        int i;
+
+        pthread_mutex_lock(&mtx_queue);
+        for (s = song_queue; s && num < max; s = s->next, ++index) {
+                if (!s->file->downloading || s->file->download.phase == CONTROL_DOWNLOAD_WAITING)
+                        continue;
+
+                // a song queued twice is listed where it is first
+                for (i = 0; i < num && strcmp(list[i].vid, s->file->vid); ++i)
+                        ;
+                if (i < num)
+                        continue;
+
+                list[num].index = index;
+                (void)strcpy(list[num].vid, s->file->vid);
+                list[num].audio_ms = bytesToUs(s->file->loaded_bytes) / 1000;
+                list[num].download = s->file->download;
+                ++num;
+        }
+        pthread_mutex_unlock(&mtx_queue);
+
+        return num;
+}
+
+void control_onDownloadProgress(song_file_t *file, long long bytes, const struct control_download *download)
+{
+        bool ready;
+
+        pthread_mutex_lock(&mtx_queue);
+        ready = song_queue && song_queue->file == file &&
+                !isPrebuffered(file->loaded_bytes) && isPrebuffered(bytes);
+        file->loaded_bytes = bytes;
+        file->download = *download;
+        pthread_mutex_unlock(&mtx_queue);
+
+        // the next song can start before its download completes
+        if (ready)
+                control_playAudio();
+}
+
+void control_onDownloadComplete(song_file_t *file, int err)
+{
+        bool removed = false;
+
+        pthread_mutex_lock(&mtx_queue);
+        file->downloading = 0;
+        if (!file->refs) {
+                freeFile(file);
+                removed = true;
+        }
+        else if (err == ECANCELED) {
+                // queued again while the download was being cancelled
+                file->status = CONTROL_SONG_STATUS_QUEUED;
+                file->loaded_bytes = 0;
+                resetDownload(&file->download);
         }
         else {
+                // playback stops at the song if the download left no file
+                file->status = CONTROL_SONG_STATUS_LOADED;
+        }
+        pthread_mutex_unlock(&mtx_queue);
+
+        if (!removed) {
+                network_notifyStatusChanged();
                 control_playAudio();
         }
+
+        // the downloader has room again for songs it had to turn away
+        updateDownloadedSongs();
 }
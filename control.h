@@ -4,10 +4,15 @@
 #include <netinet/in.h>
 
 #define CONTROL_MAXLEN_FN       256
-#define CONTROL_MAXLEN_VID      16
+#define CONTROL_MAXLEN_VID      32
 
 #define CONTROL_RMSONG_FIRST    -1
 
+// slaves must be able to buffer the lead, see SLAVE_BUF_SIZE
+#define CONTROL_MAX_LEAD_US     200000
+
+#define CONTROL_MAX_PREBUFFER_US 30000000
+
 enum control_mode {
         CONTROL_MODE_UNKNOWN = -1,
         CONTROL_MODE_MASTER  = 0,
@@ -23,10 +28,49 @@ enum control_song_status {
         CONTROL_SONG_STATUS_PLAYING     = 4
 };
 
+// Stages of a download, as far as the download tools report them
+enum control_download_phase {
+        CONTROL_DOWNLOAD_WAITING        = 0,            // waiting for a worker
+        CONTROL_DOWNLOAD_STARTING       = 1,            // tools started, nothing fetched yet
+        CONTROL_DOWNLOAD_FETCHING       = 2,
+        CONTROL_DOWNLOAD_TRANSCODING    = 3             // fetched, the rest is being converted
+};
+
+// Progress of a download; values the tools did not report are -1
+struct control_download {
+        enum control_download_phase phase;
+        int percent;                            // of the fetch
+        long long fetched_bytes;
+        long long total_bytes;
+        long long speed;                        // fetched bytes per second
+        int eta_s;                              // seconds until fetched
+};
+
+// Progress of a song in the queue, see control_getDownloads()
+struct control_download_status {
+        int index;                              // position in the queue
+        char vid[CONTROL_MAXLEN_VID];
+        long long audio_ms;                     // audio written to the file so far
+        struct control_download download;
+};
+
+// The cached audio of a song, shared by all items of the song queue with the
+// same ID, so a song queued twice is downloaded once
+typedef struct song_file {
+        char filepath[CONTROL_MAXLEN_FN];       // filepath to cached audio
+        char vid[CONTROL_MAXLEN_VID];           // YouTube video ID, or the ID of a song of another backend
+        enum control_song_status status;        // REMOVED, once no item uses it while downloading
+        int refs;                               // items of the song queue using the file
+        int downloading;                        // the downloader frees the file if it is removed
+        long long loaded_bytes;                 // audio data in filepath so far
+        struct control_download download;       // while downloading
+        struct song_file *prev;                 // Files of the song queue
+        struct song_file *next;
+} song_file_t;
+
 typedef struct song {
-        char filepath[CONTROL_MAXLEN_FN];       // filepath to wav data
-        char vid[CONTROL_MAXLEN_VID];           // YouTube video ID
-        enum control_song_status status;
+        song_file_t *file;
+        int playing;
         struct song *next;                      // Next song in the queue
 } song_t;
 
@@ -56,8 +100,48 @@ enum control_mode control_getMode(void);
  * Queue audio data to be played
  * @param buf Buffer containing audio data
  * @param length Length of buffer
+ * @param pos Stream position (in frames) of the first frame in the buffer
+ * @param pts Master time (us) the first frame should be heard
+ */
+void control_queueAudio(char *buf, unsigned int length, unsigned int pos, long long pts);
+
+/**
+ * Get how much lost audio was concealed while in slave mode
+ * @return Number of concealed frames
+ */
+unsigned int control_getConcealedFrames(void);
+
+/**
+ * Get how much received audio is waiting to be played while in slave mode
+ * @return Buffered audio in microseconds
+ */
+long long control_getBufferedUs(void);
+
+/**
+ * Drop received audio that will not be played while in slave mode
+ * @param pos Stream position (in frames) of the first frame to drop
+ */
+void control_flushAudio(unsigned int pos);
+
+/**
+ * Set how far ahead of its own playout the master sends audio to slaves
+ * @param lead_us Lead in microseconds, up to CONTROL_MAX_LEAD_US
+ * @return 0 if successful, otherwise error
+ */
+int control_setLead(long long lead_us);
+
+/**
+ * Get how far ahead of its own playout the master sends audio to slaves
+ * @return Lead in microseconds
  */
-void control_queueAudio(char *buf, unsigned int length);
+long long control_getLead(void);
+
+/**
+ * Set how much of a song must be downloaded before it starts playing
+ * @param prebuffer_us Playing time in microseconds, up to CONTROL_MAX_PREBUFFER_US
+ * @return 0 if successful, otherwise error
+ */
+int control_setPrebuffer(long long prebuffer_us);
 
 /**
  * Resume playing audio
@@ -92,10 +176,13 @@ void control_setRepeatStatus(int repeat);
 int control_getRepeatStatus(void);
 
 /**
- * Add a song from YouTube to the queue
- * @param url YouTube URL of song
+ * Add a song to the queue
+ * @param url YouTube video ID of the song, or the ID of a song of another
+ *            backend, e.g. "lib.<track ID>" of a track in the library
+ * @return 0, if successful; EINVAL, if the ID is too long; ENOENT, if
+ *         there is no such track in the library; ENOMEM, if out of memory
  */
-void control_addSong(char *url);
+int control_addSong(char *url);
 
 /**
  * Remove a song from the queue
@@ -106,13 +193,27 @@ void control_addSong(char *url);
 int control_removeSong(char *url, int index);
 
 /**
- * Set the status of a song. Should be used for thread safety.
- * NOTE: The song will be deleted if the song's status was set to CONTROL_SONG_STATUS_REMOVED
- * @param song Address of song to change (must exist in the queue)
- * @param status Status to set for the song
- * @return Current status of the song; CONTROL_SONG_STATUS_UNKNOWN, if error
+ * Set the status of a song's file. Should be used for thread safety.
+ * @param file Address of the file to change
+ * @param status Status to set for the file
+ * @return Current status of the file; CONTROL_SONG_STATUS_REMOVED, if no song
+ *         uses it anymore; CONTROL_SONG_STATUS_UNKNOWN, if error
+ */
+enum control_song_status control_setSongStatus(song_file_t *file, enum control_song_status status);
+
+/**
+ * Get the status of a song in the queue
+ * @param song Address of song
+ * @return CONTROL_SONG_STATUS_PLAYING, if the song is playing; otherwise the status of its file
  */
-enum control_song_status control_setSongStatus(song_t *song, enum control_song_status status);
+enum control_song_status control_getSongStatus(const song_t *song);
+
+/**
+ * Get the status of the current song, safe to call from other threads
+ * @return Status of the first song in the queue, see control_getSongStatus();
+ *         CONTROL_SONG_STATUS_UNKNOWN, if the queue is empty
+ */
+enum control_song_status control_getCurrentStatus(void);
 
 /**
  * Get the playback progress of the current song
@@ -128,9 +229,54 @@ void control_getSongProgress(int *curr, int *end);
 const song_t *control_getQueue(void);
 
 /**
- * Callback when a download completes
- * @param song Address of song that finished downloading
+ * Get the position of the first song in the queue that uses a file
+ * @param file Address of the song's file
+ * @return Index of the song, 0 being the current song; -1, if no song uses the file
+ */
+int control_getSongIndex(const song_file_t *file);
+
+/**
+ * Get the version of the song queue, which changes whenever songs are
+ * added to or removed from it
+ * @return Version of the song queue
+ */
+unsigned int control_getQueueVersion(void);
+
+/**
+ * Copy the video ids of the song queue, safe to call from other threads
+ * @param ids Address of an array from malloc(), or of NULL; the array is
+ *        reallocated to fit the queue, and keeps its old contents if that fails
+ * @param len Address to store the number of ids copied, in queue order
+ * @param version Address to store the version of the queue that was copied
+ * @return 0, if successful; ENOMEM, if unable to allocate the array
+ */
+int control_getQueueIds(char (**ids)[CONTROL_MAXLEN_VID], int *len, unsigned int *version);
+
+/**
+ * Get the progress of the songs being downloaded, excluding songs still
+ * waiting for a worker
+ * @param list Array to store the progress of the songs
+ * @param max Size of the array
+ * @return Number of songs stored, in queue order
+ */
+int control_getDownloads(struct control_download_status *list, int max);
+
+/**
+ * Callback when more of a song has been written to its file, or the
+ * download tools reported progress
+ * @param file Address of the file being downloaded
+ * @param bytes Bytes of audio data written so far
+ * @param download Progress reported by the download tools
+ */
+void control_onDownloadProgress(song_file_t *file, long long bytes, const struct control_download *download);
+
+/**
+ * Callback when a download completes. The file is freed if no song uses it
+ * anymore, and fetched again if its download was cancelled before a song
+ * was queued with it again.
+ * @param file Address of the file that finished downloading
+ * @param err 0, if successful; ECANCELED, if the download was cancelled; otherwise error
  */
-void control_onDownloadComplete(song_t* song);
+void control_onDownloadComplete(song_file_t *file, int err);
 
 #endif
@@ -1,104 +1,234 @@
 #include "downloader.h"
 
+#include "cache.h"
+#include "lac.h"
+#include "library.h"
+#include "prefetch.h"
+#include "supervisor.h"
+#include "timesync.h"
+
 #include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define PRINTF_MODULE   "[download] "
 
-#define CMDLINE_MAX_LEN 1024
-static const char* DOWNLOAD_CMDLINE = "youtube-dl --extract-audio --audio-format wav -o '~/cache/%%(id)s.%%(ext)s' --postprocessor-args \"-ar 44100\" https://www.youtube.com/watch?v=%s";
-#ifdef MP_DESKTOP
-static const char* RM_CACHE_CMDLINE = "rm /home/chris/cache/*";
-#else
-static const char* RM_CACHE_CMDLINE = "rm /root/cache/*";
-#endif
-static const char* RM_CMDLINE = "rm %s";
-
-#define FIFO_QUEUE_SIZE 5
-static song_t* songFifoQueue[FIFO_QUEUE_SIZE];
-static int fifoHeadIndex = 0;
-static int fifoTailIndex = 0;   // The next empty slot, at the end of the queue
-static pthread_mutex_t fifoMutex = PTHREAD_MUTEX_INITIALIZER;
-
-static pthread_mutex_t isDownloadingMutex = PTHREAD_MUTEX_INITIALIZER;
+static const char* URL_FORMAT = "https://www.youtube.com/watch?v=%s";
+
+#define STREAM_CHUNK_SIZE   16384
+#define PCM_FRAME_SIZE      4
+#define PCM_SAMPLE_RATE     44100
+
+// Songs the fixture backend makes up until it is configured otherwise:
+// half a second until they start, arriving at 4 times the rate they play
+#define FIXTURE_DEFAULT_LATENCY_MS  500
+#define FIXTURE_DEFAULT_BYTES_PER_S (4 * PCM_SAMPLE_RATE * PCM_FRAME_SIZE)
+#define FIXTURE_DEFAULT_SONG_MS     180000
+#define FIXTURE_MAX_SONG_MS         3600000
+// keeps the bytes arrived, rate times time since the start, within a long long
+#define FIXTURE_MAX_BYTES_PER_S     1000000000LL
+#define FIXTURE_AMPLITUDE           8000
+#define FIXTURE_NOISE               512
+
+// A download is killed if it takes longer than this, or once its song is
+// removed from the queue; the latter is checked this often
+#define DOWNLOAD_TIMEOUT_MS 600000
+#define CANCEL_CHECK_MS     200
+
+// Jobs waiting for a worker. Full means the song stays QUEUED and is
+// offered again by the control module after the next download completes.
+static song_file_t* jobs[DOWNLOADER_MAX_JOBS];
+static int numJobs = 0;
+static pthread_mutex_t jobsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobsCond = PTHREAD_COND_INITIALIZER;
+
+// Only the first numWorkers of the workers take jobs
+static pthread_t workers[DOWNLOADER_MAX_WORKERS];
+static int numWorkers = DOWNLOADER_DEFAULT_WORKERS;
+static bool running = false;
+
+// Progress and completions are reported one at a time, as they may start playback
+static pthread_mutex_t reportMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Fixture backend settings, guarded by jobsMutex
+static long long fixtureLatencyMs = FIXTURE_DEFAULT_LATENCY_MS;
+static long long fixtureBytesPerS = FIXTURE_DEFAULT_BYTES_PER_S;
+static long long fixtureSongMs = FIXTURE_DEFAULT_SONG_MS;
+
+// A song being fetched by a backend, read as raw 44.1 kHz stereo S16LE
+struct fetchSource {
+    const struct fetchBackend* backend;
+    struct control_download* download;
+    // tools run by the youtube and local backends
+    struct supervisor_job job;
+    char arg[CONTROL_MAXLEN_FN];
+    // audio made up by the fixture backend
+    long long startedUs;
+    long long latencyUs;
+    long long bytesPerS;
+    long long totalBytes;
+    long long sentBytes;
+    double hz;
+    unsigned int noise;
+};
+
+// Where songs are fetched from. A song ID names its backend before a '.',
+// which YouTube video IDs never contain, e.g. "file.song.flac"; the rest
+// of the ID is the name of the song within the backend.
+struct fetchBackend {
+    const char* prefix;     // NULL for plain YouTube video IDs
+    int (*start)(struct fetchSource* source, const char* name);
+    // like supervisor_read()
+    ssize_t (*read)(struct fetchSource* source, void* buf, size_t len, int waitMs);
+    // like supervisor_finish()
+    int (*finish)(struct fetchSource* source, bool cancel);
+};
 
 
 /*
  * Forward declations
  */
-static void* downloadThread();
-static void enqueueSong();
-static song_t* dequeueSong();
+static void* downloadThread(void* arg);
+static int enqueueSong(song_file_t* file);
+static song_file_t* dequeueSong(int worker);
+static int streamSong(song_file_t* file);
+static int youtubeStart(struct fetchSource* source, const char* name);
+static int localStart(struct fetchSource* source, const char* name);
+static int libraryStart(struct fetchSource* source, const char* name);
+static ssize_t toolRead(struct fetchSource* source, void* buf, size_t len, int waitMs);
+static int toolFinish(struct fetchSource* source, bool cancel);
+static int fixtureStart(struct fetchSource* source, const char* name);
+static ssize_t fixtureRead(struct fetchSource* source, void* buf, size_t len, int waitMs);
+static int fixtureFinish(struct fetchSource* source, bool cancel);
+
+static const struct fetchBackend backends[] = {
+    { NULL,         youtubeStart,   toolRead,       toolFinish },
+    { "file",       localStart,     toolRead,       toolFinish },
+    { "lib",        libraryStart,   toolRead,       toolFinish },
+    { "fixture",    fixtureStart,   fixtureRead,    fixtureFinish },
+};
 
 
 /*
  * Public functions
  */
-void downloader_init(void) 
+void downloader_init(void)
 {
-    pthread_mutex_init(&fifoMutex, NULL);
-
-    // Clean FIFO queue
-    pthread_mutex_lock(&fifoMutex);
-    memset(songFifoQueue, 0, FIFO_QUEUE_SIZE * sizeof(songFifoQueue));
-        fifoHeadIndex = 0;
-        fifoTailIndex = 0;
-    pthread_mutex_unlock(&fifoMutex);
-
-    // Clear cache
-    system(RM_CACHE_CMDLINE);
+    // Clean job queue
+    pthread_mutex_lock(&jobsMutex);
+    memset(jobs, 0, sizeof(jobs));
+    numJobs = 0;
+    running = true;
+    pthread_mutex_unlock(&jobsMutex);
+
+    // Songs downloaded before a restart are kept
+    (void)cache_init();
+    (void)library_init();
+
+    for (long i = 0; i < DOWNLOADER_MAX_WORKERS; i++) {
+        (void)pthread_create(&workers[i], NULL, &downloadThread, (void*)i);
+    }
 }
 
-void downloader_cleanup(void) 
+void downloader_cleanup(void)
 {
-    // Clear cache
-    system(RM_CACHE_CMDLINE);
+    // Let the workers finish their current download and exit
+    pthread_mutex_lock(&jobsMutex);
+    running = false;
+    pthread_cond_broadcast(&jobsCond);
+    pthread_mutex_unlock(&jobsMutex);
+
+    for (int i = 0; i < DOWNLOADER_MAX_WORKERS; i++) {
+        (void)pthread_join(workers[i], NULL);
+    }
+
+    library_cleanup();
+    cache_cleanup();
 }
 
-void downloader_queueDownloadSong(song_t* song) 
+int downloader_queueDownloadSong(song_file_t* file)
 {
-    if (song->status != CONTROL_SONG_STATUS_QUEUED) {
+    int err;
+
+    // Checked and enqueued under the lock, so concurrent callers
+    // cannot queue the same song twice
+    pthread_mutex_lock(&jobsMutex);
+
+    if (file->status != CONTROL_SONG_STATUS_QUEUED) {
+        pthread_mutex_unlock(&jobsMutex);
         printf(PRINTF_MODULE "Warning: Song is not in expected status QUEUED, skipping\n");
-        return;
+        return EINVAL;
     }
 
-    // Check if the file exists already
-    if (!access(song->filepath, F_OK)) {
+    // Check if the file exists already. A song queued twice shares its
+    // file, so this is never the file of a download in progress.
+    if (!access(file->filepath, F_OK)) {
+        pthread_mutex_unlock(&jobsMutex);
         printf(PRINTF_MODULE "Notice: music file already exists, item not queued\n");
-        pthread_mutex_unlock(&fifoMutex);
 
-        control_setSongStatus(song, CONTROL_SONG_STATUS_LOADED);
-        return;
+        (void)cache_store(file->vid);
+        control_setSongStatus(file, CONTROL_SONG_STATUS_LOADED);
+        return 0;
     }
 
-    // Update to LOADING status
-    control_setSongStatus(song, CONTROL_SONG_STATUS_LOADING);
-    enqueueSong(song);
+    err = enqueueSong(file);
+    if (!err) {
+        // Update to LOADING status
+        control_setSongStatus(file, CONTROL_SONG_STATUS_LOADING);
+        pthread_cond_broadcast(&jobsCond);
+    }
+    pthread_mutex_unlock(&jobsMutex);
 
-    // Spawn download thread if it's not running
-    if (!pthread_mutex_trylock(&isDownloadingMutex)) {
-        pthread_t pDownloadThread;
-                pthread_attr_t attr;
+    return err;
+}
 
-        // set detached thread state, so join is not necessary for cleanup
-        (void)pthread_attr_init(&attr);
-        (void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-        (void)pthread_create(&pDownloadThread, &attr, &downloadThread, 0);
-        (void)pthread_attr_destroy(&attr);
-    }
+int downloader_setWorkers(int workers)
+{
+    if (workers < 1 || workers > DOWNLOADER_MAX_WORKERS)
+        return EINVAL;
+
+    pthread_mutex_lock(&jobsMutex);
+    numWorkers = workers;
+    pthread_cond_broadcast(&jobsCond);
+    pthread_mutex_unlock(&jobsMutex);
+
+    printf(PRINTF_MODULE "Notice: downloading %d songs at a time\n", workers);
+    (void)fflush(stdout);
+
+    return 0;
+}
+
+int downloader_getWorkers(void)
+{
+    return numWorkers;
 }
 
-void downloader_deleteSongFile(song_t* song)
-{        
-    // Run $rm /root/cache/____.wav
-    char cmdline[CMDLINE_MAX_LEN];
-    sprintf(cmdline, RM_CMDLINE, song->filepath);
-    system(cmdline);
+int downloader_setFixture(long long latencyMs, long long bytesPerS, long long songMs)
+{
+    if (latencyMs < 0 || latencyMs > DOWNLOAD_TIMEOUT_MS || bytesPerS < PCM_FRAME_SIZE ||
+        bytesPerS > FIXTURE_MAX_BYTES_PER_S || songMs <= 0 || songMs > FIXTURE_MAX_SONG_MS)
+        return EINVAL;
+
+    pthread_mutex_lock(&jobsMutex);
+    fixtureLatencyMs = latencyMs;
+    fixtureBytesPerS = bytesPerS;
+    fixtureSongMs = songMs;
+    pthread_mutex_unlock(&jobsMutex);
+
+    printf(PRINTF_MODULE "Notice: fixture songs take %lld ms to start, arrive at %lld bytes/s and last %lld ms\n",
+        latencyMs, bytesPerS, songMs);
+    (void)fflush(stdout);
+
+    return 0;
 }
 
 
@@ -106,60 +236,486 @@ void downloader_deleteSongFile(song_t* song)
  * Private functions
  */
 
-static void enqueueSong(song_t* song)
+// NOTE: jobsMutex must be held
+static int enqueueSong(song_file_t* file)
 {
-    pthread_mutex_lock(&fifoMutex);
-    if (songFifoQueue[fifoTailIndex] != NULL) {
-        printf(PRINTF_MODULE "Warning: Download queue full - item not queued\n");
-            pthread_mutex_unlock(&fifoMutex);
-        return;
+    if (numJobs == DOWNLOADER_MAX_JOBS) {
+        printf(PRINTF_MODULE "Notice: Download queue full - item will be queued later\n");
+        return EBUSY;
     }
 
-    songFifoQueue[fifoTailIndex] = song;
-    fifoTailIndex = (fifoTailIndex + 1) % FIFO_QUEUE_SIZE;
-    pthread_mutex_unlock(&fifoMutex);
+    jobs[numJobs++] = file;
+    return 0;
 }
 
-static song_t* dequeueSong()
+// Blocks until there is a job for the worker, and returns the one whose
+// song is closest to the front of the queue; NULL, when shutting down
+static song_file_t* dequeueSong(int worker)
 {
-    if (songFifoQueue[fifoHeadIndex] == NULL) {
+    song_file_t* output;
+    int best = 0;
+    int bestIndex = -1;
+
+    pthread_mutex_lock(&jobsMutex);
+    while (running && (numJobs == 0 || worker >= numWorkers)) {
+        pthread_cond_wait(&jobsCond, &jobsMutex);
+    }
+
+    if (!running) {
+        pthread_mutex_unlock(&jobsMutex);
         return NULL;
     }
 
-    pthread_mutex_lock(&fifoMutex);
-    song_t* output = songFifoQueue[fifoHeadIndex];
-    songFifoQueue[fifoHeadIndex] = NULL;
-    fifoHeadIndex = (fifoHeadIndex + 1) % FIFO_QUEUE_SIZE;
-    pthread_mutex_unlock(&fifoMutex);
+    // Songs removed from the queue have no index, and are taken first
+    // as there is nothing to download for them
+    for (int i = 0; i < numJobs; i++) {
+        int index = control_getSongIndex(jobs[i]);
+        if (i == 0 || index < bestIndex) {
+            best = i;
+            bestIndex = index;
+        }
+    }
+
+    output = jobs[best];
+    jobs[best] = jobs[--numJobs];
+    jobs[numJobs] = NULL;
+    pthread_mutex_unlock(&jobsMutex);
 
     return output;
 }
 
-// args is a pointer to song_t
-static void* downloadThread()
+// Reads a size such as "3.45MiB" or "~3.45MiB", as youtube-dl writes them
+static bool parseSize(const char* text, long long* bytes)
+{
+    char* end;
+    double value;
+
+    text += strspn(text, " ~");
+    value = strtod(text, &end);
+    if (end == text) {
+        return false;
+    }
+
+    switch (*end) {
+    case 'k':
+    case 'K': value *= 1024; break;
+    case 'M': value *= 1024 * 1024; break;
+    case 'G': value *= 1024 * 1024 * 1024; break;
+    default: break;
+    }
+
+    *bytes = (long long)value;
+    return true;
+}
+
+// Follows youtube-dl's progress, written with --newline as lines like
+// "[download]  45.3% of ~3.45MiB at  1.23MiB/s ETA 00:02"
+static int parseProgressLine(void* arg, const char* line)
 {
-    // Keep downloading as long as there are songs in the queue
-    song_t* song = dequeueSong();
-    while (song) {
-        if (song->status != CONTROL_SONG_STATUS_LOADING) {
-            printf(PRINTF_MODULE "Warning: Song is not in expected status LOADING, skipping\n");
+    struct control_download* download = arg;
+    const char* field;
+    double percent;
+    int h, m, sec;
+    char* end;
+
+    if (strncmp(line, "[download]", 10)) {
+        return 0;
+    }
+
+    // Other lines of this kind only name the destination
+    percent = strtod(line + 10, &end);
+    if (end == line + 10 || *end != '%') {
+        return 1;
+    }
+
+    download->percent = (int)percent;
+    if ((field = strstr(end, " of ")) && parseSize(field + 4, &download->total_bytes)) {
+        download->fetched_bytes = (long long)(download->total_bytes * percent / 100);
+    }
+    if ((field = strstr(end, " at ")) && !parseSize(field + 4, &download->speed)) {
+        download->speed = -1;
+    }
+    if ((field = strstr(end, " ETA "))) {
+        if (sscanf(field + 5, "%d:%d:%d", &h, &m, &sec) == 3) {
+            download->eta_s = (h * 60 + m) * 60 + sec;
+        }
+        else if (sscanf(field + 5, "%d:%d", &m, &sec) == 2) {
+            download->eta_s = m * 60 + sec;
         }
         else {
-            // Run youtube-dl to download youtube audio as .wav file
-            char cmdline[CMDLINE_MAX_LEN];
-            sprintf(cmdline, DOWNLOAD_CMDLINE, song->vid);
-            system(cmdline);
+            download->eta_s = -1;
+        }
+    }
+
+    // The transcoder still has to convert what it has not read yet
+    download->phase = download->percent >= 100 ? CONTROL_DOWNLOAD_TRANSCODING : CONTROL_DOWNLOAD_FETCHING;
+    if (download->phase == CONTROL_DOWNLOAD_TRANSCODING) {
+        download->eta_s = 0;
+    }
+
+    return 1;
+}
+
+// Fetches YouTube videos, today's default
+static int youtubeStart(struct fetchSource* source, const char* name)
+{
+    // Writes the song as raw 44.1 kHz stereo S16 to stdout while it downloads
+    // Progress is written to stderr, a line each
+    char* const youtubeDl[] = { "youtube-dl", "--newline", "-f", "bestaudio", "-o", "-", source->arg, NULL };
+    char* const ffmpeg[] = { "ffmpeg", "-loglevel", "error", "-i", "pipe:0",
+        "-f", "s16le", "-ar", "44100", "-ac", "2", "pipe:1", NULL };
+    char* const* pipeline[] = { youtubeDl, ffmpeg };
+
+    snprintf(source->arg, sizeof(source->arg), URL_FORMAT, name);
+    if (supervisor_start(&source->job, name, pipeline, 2, DOWNLOAD_TIMEOUT_MS)) {
+        return EIO;
+    }
+
+    supervisor_setLineHandler(&source->job, parseProgressLine, source->download);
+    return 0;
+}
+
+// Decodes the file at source->arg
+static int decodeFile(struct fetchSource* source, const char* name)
+{
+    char* const ffmpeg[] = { "ffmpeg", "-loglevel", "error", "-i", source->arg,
+        "-f", "s16le", "-ar", "44100", "-ac", "2", "pipe:1", NULL };
+    char* const* pipeline[] = { ffmpeg };
+
+    if (access(source->arg, R_OK)) {
+        printf(PRINTF_MODULE "Warning: Unable to read %s\n", source->arg);
+        return ENOENT;
+    }
+
+    return supervisor_start(&source->job, name, pipeline, 1, DOWNLOAD_TIMEOUT_MS) ? EIO : 0;
+}
+
+// Decodes files of DOWNLOADER_LOCAL_DIR, e.g. a mounted NAS folder
+static int localStart(struct fetchSource* source, const char* name)
+{
+    // Only files right in the directory can be named
+    if (!*name || *name == '.' || strchr(name, '/')) {
+        printf(PRINTF_MODULE "Warning: %s is not a file name\n", name);
+        return EINVAL;
+    }
+
+    snprintf(source->arg, sizeof(source->arg), "%s%s", DOWNLOADER_LOCAL_DIR, name);
+    return decodeFile(source, name);
+}
+
+// Decodes tracks of the library, which are found by their ID
+static int libraryStart(struct fetchSource* source, const char* name)
+{
+    char vid[CONTROL_MAXLEN_VID];
+    unsigned int id;
+
+    snprintf(vid, sizeof(vid), "%s%s", LIBRARY_PREFIX, name);
+    if (library_parseId(vid, &id) || library_getPath(id, source->arg)) {
+        printf(PRINTF_MODULE "Warning: %s is not in the library\n", vid);
+        return ENOENT;
+    }
+
+    return decodeFile(source, name);
+}
+
+static ssize_t toolRead(struct fetchSource* source, void* buf, size_t len, int waitMs)
+{
+    return supervisor_read(&source->job, buf, len, waitMs);
+}
+
+static int toolFinish(struct fetchSource* source, bool cancel)
+{
+    return supervisor_finish(&source->job, cancel);
+}
+
+// Makes up songs as if they were downloaded, a tone with some noise, so the
+// pipeline can be tested without a network. They take the configured
+// latency to start, then arrive at the configured rate.
+static int fixtureStart(struct fetchSource* source, const char* name)
+{
+    unsigned int hash = 5381;
+
+    pthread_mutex_lock(&jobsMutex);
+    source->latencyUs = fixtureLatencyMs * 1000;
+    source->bytesPerS = fixtureBytesPerS;
+    source->totalBytes = fixtureSongMs * PCM_SAMPLE_RATE / 1000 * PCM_FRAME_SIZE;
+    pthread_mutex_unlock(&jobsMutex);
+
+    // Every song sounds different
+    for (const char* c = name; *c; c++) {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    source->hz = 220 + hash % 660;
+    source->noise = hash;
+    source->sentBytes = 0;
+    source->startedUs = timesync_getTimeUs();
+
+    return 0;
+}
+
+static ssize_t fixtureRead(struct fetchSource* source, void* buf, size_t len, int waitMs)
+{
+    struct control_download* download = source->download;
+    struct timespec wait;
+    long long arrived;
+    long long elapsedUs;
+    long long waitUs;
+    long long frame;
+    ssize_t n;
+    int16_t sample;
+
+    for (;;) {
+        // a reader that stalls for hours must not overflow the product
+        elapsedUs = timesync_getTimeUs() - source->startedUs - source->latencyUs;
+        if (elapsedUs >= source->totalBytes * 1000000 / source->bytesPerS) {
+            arrived = source->totalBytes;
+        } else {
+            arrived = elapsedUs * source->bytesPerS / 1000000;
+        }
+        arrived -= arrived % PCM_FRAME_SIZE;
+
+        if (source->sentBytes == source->totalBytes) {
+            return 0;
+        }
+        if (arrived > source->sentBytes) {
+            break;
+        }
+        if (waitMs <= 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        // Until the next frame arrives
+        waitUs = source->startedUs + source->latencyUs - timesync_getTimeUs() +
+            (source->sentBytes + PCM_FRAME_SIZE) * 1000000 / source->bytesPerS + 1;
+        if (waitUs > waitMs * 1000LL) {
+            waitUs = waitMs * 1000LL;
+        }
+        waitMs = 0;
+        if (waitUs > 0) {
+            wait.tv_sec = waitUs / 1000000;
+            wait.tv_nsec = waitUs % 1000000 * 1000;
+            (void)nanosleep(&wait, NULL);
+        }
+    }
+
+    n = len - len % PCM_FRAME_SIZE;
+    if (n > arrived - source->sentBytes) {
+        n = arrived - source->sentBytes;
+    }
+
+    // The buffer follows a partial frame, so it may not be aligned
+    frame = source->sentBytes / PCM_FRAME_SIZE;
+    for (ssize_t i = 0; i < n / (ssize_t)sizeof(sample); i++) {
+        double tone = FIXTURE_AMPLITUDE * sin(2 * M_PI * source->hz * (frame + i / 2) / PCM_SAMPLE_RATE);
+
+        source->noise = source->noise * 1103515245 + 12345;
+        sample = (int16_t)htole16((uint16_t)(int16_t)(tone + (int)(source->noise >> 16) % FIXTURE_NOISE - FIXTURE_NOISE / 2));
+        memcpy((unsigned char*)buf + i * sizeof(sample), &sample, sizeof(sample));
+    }
+    source->sentBytes += n;
+
+    download->phase = CONTROL_DOWNLOAD_FETCHING;
+    download->percent = (int)(source->sentBytes * 100 / source->totalBytes);
+    download->fetched_bytes = source->sentBytes;
+    download->total_bytes = source->totalBytes;
+    download->speed = source->bytesPerS;
+    download->eta_s = (source->totalBytes - source->sentBytes) / source->bytesPerS;
+
+    return n;
+}
+
+static int fixtureFinish(struct fetchSource* source, bool cancel)
+{
+    (void)source;
+    (void)cancel;
+    return 0;
+}
 
-            // Update to LOADED status
-            control_setSongStatus(song, CONTROL_SONG_STATUS_LOADED);
+// Picks the backend of a song and the name of the song within it
+static const struct fetchBackend* findBackend(const char* vid, const char** name)
+{
+    const char* dot = strchr(vid, '.');
+
+    if (!dot) {
+        *name = vid;
+        return &backends[0];
+    }
+
+    *name = dot + 1;
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (backends[i].prefix && strlen(backends[i].prefix) == (size_t)(dot - vid) &&
+            !strncmp(backends[i].prefix, vid, dot - vid)) {
+            return &backends[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Fetches the song from its backend, compressing the audio into the song's
+// file as it arrives. The file is completed once the song is. Returns
+// ECANCELED, if no song in the queue uses the file anymore.
+static int streamSong(song_file_t* file)
+{
+    struct fetchSource source;
+    const char* name;
+    struct control_download download;
+    struct control_download reported;
+    struct lac_writer writer;
+    unsigned char chunk[STREAM_CHUNK_SIZE];
+    short samples[STREAM_CHUNK_SIZE / sizeof(short)];
+    size_t carry = 0;
+    long long reportedFrames = 0;
+    long long startedUs;
+    long long firstAudioUs = -1;
+    bool cancel = false;
+    bool removed = false;
+    ssize_t len;
+    int frames;
+    int status;
+
+    source.backend = findBackend(file->vid, &name);
+    if (!source.backend) {
+        printf(PRINTF_MODULE "Warning: No backend serves %s\n", file->vid);
+        return EINVAL;
+    }
+
+    if (lac_create(&writer, file->filepath)) {
+        printf(PRINTF_MODULE "Warning: Unable to create %s\n", file->filepath);
+        return EIO;
+    }
+
+    memset(&download, 0, sizeof(download));
+    download.phase = CONTROL_DOWNLOAD_STARTING;
+    download.percent = -1;
+    download.fetched_bytes = -1;
+    download.total_bytes = -1;
+    download.speed = -1;
+    download.eta_s = -1;
+    reported = download;
+
+    source.download = &download;
+    startedUs = timesync_getTimeUs();
+    if (source.backend->start(&source, name)) {
+        (void)lac_finish(&writer);
+        unlink(file->filepath);
+        return EIO;
+    }
+
+    pthread_mutex_lock(&reportMutex);
+    control_onDownloadProgress(file, 0, &download);
+    pthread_mutex_unlock(&reportMutex);
+
+    // Flushed a block at a time, for the song to be played while downloading
+    for (;;) {
+        // Nobody is waiting for the song anymore
+        if (file->status == CONTROL_SONG_STATUS_REMOVED || !running) {
+            cancel = true;
+            removed = true;
+            break;
+        }
+
+        len = source.backend->read(&source, chunk + carry, sizeof(chunk) - carry, CANCEL_CHECK_MS);
+        if (len == 0) {
+            break;
+        }
+        else if (len < 0 && errno != EAGAIN) {
+            cancel = true;
+            break;
         }
 
-        control_onDownloadComplete(song);
+        if (len > 0) {
+            // The tools write raw S16LE, whose frames may be split between reads
+            len += carry;
+            frames = len / PCM_FRAME_SIZE;
+            for (int i = 0; i < frames * 2; i++) {
+                uint16_t sample;
+                memcpy(&sample, chunk + i * sizeof(sample), sizeof(sample));
+                samples[i] = (short)le16toh(sample);
+            }
+            carry = len % PCM_FRAME_SIZE;
+            memmove(chunk, chunk + frames * PCM_FRAME_SIZE, carry);
+
+            if (lac_write(&writer, samples, frames)) {
+                printf(PRINTF_MODULE "Warning: Unable to write %s\n", file->filepath);
+                cancel = true;
+                break;
+            }
+
+            // Tools that report no progress are fetching once they write
+            if (download.phase == CONTROL_DOWNLOAD_STARTING) {
+                download.phase = CONTROL_DOWNLOAD_FETCHING;
+            }
+            if (firstAudioUs < 0 && writer.frames) {
+                firstAudioUs = timesync_getTimeUs();
+            }
+        }
+
+        if (writer.frames == reportedFrames && !memcmp(&download, &reported, sizeof(download))) {
+            continue;
+        }
+
+        reported = download;
+        reportedFrames = writer.frames;
+        pthread_mutex_lock(&reportMutex);
+        control_onDownloadProgress(file, writer.frames * PCM_FRAME_SIZE, &download);
+        pthread_mutex_unlock(&reportMutex);
+    }
 
-        song = dequeueSong();
+    status = source.backend->finish(&source, cancel);
+
+    // The file is completed even if the download failed, so a partial
+    // song that already plays still comes to its end
+    if (lac_finish(&writer)) {
+        printf(PRINTF_MODULE "Warning: Unable to complete %s\n", file->filepath);
+        status = EIO;
+    }
+
+    // Only complete songs are cached
+    if (status || cancel || !writer.frames) {
+        unlink(file->filepath);
+        return removed ? ECANCELED : EIO;
     }
 
-    pthread_mutex_unlock(&isDownloadingMutex);
+    // The planner learns how far ahead songs need to be fetched
+    prefetch_recordDownload(writer.frames * 1000000 / LAC_SAMPLE_RATE, firstAudioUs - startedUs,
+        timesync_getTimeUs() - startedUs, writer.bytes);
+
+    return 0;
+}
+
+// arg is the index of the worker
+static void* downloadThread(void* arg)
+{
+    int worker = (int)(long)arg;
+    int err;
+
+    // Keep downloading until shutdown
+    song_file_t* file = dequeueSong(worker);
+    while (file) {
+        if (file->status != CONTROL_SONG_STATUS_LOADING) {
+            // Removed from the queue while waiting for a worker
+            err = ECANCELED;
+        }
+        else {
+            // Download youtube audio into the song's file, it can be played meanwhile
+            err = streamSong(file);
+            if (!err) {
+                err = cache_store(file->vid);
+            }
+            if (err && err != ECANCELED) {
+                printf(PRINTF_MODULE "Warning: no music file was downloaded for %s\n", file->vid);
+            }
+        }
+
+        // Update to LOADED status, or free the file if no song uses it
+        pthread_mutex_lock(&reportMutex);
+        control_onDownloadComplete(file, err);
+        pthread_mutex_unlock(&reportMutex);
+
+        file = dequeueSong(worker);
+    }
 
     return 0;
 }
@@ -3,10 +3,57 @@
 
 #include "control.h"
 
+#define DOWNLOADER_MAX_WORKERS          4
+#define DOWNLOADER_DEFAULT_WORKERS      2
+#define DOWNLOADER_MAX_JOBS             8
+
+// Songs are fetched by a backend named in their ID before a '.':
+//   <YouTube video ID>     downloaded from YouTube
+//   file.<file name>       decoded from DOWNLOADER_LOCAL_DIR; the ID limits the
+//                          name to CONTROL_MAXLEN_VID - 6 characters, longer
+//                          names are queued by their lib. ID
+//   fixture.<any name>     made up, see downloader_setFixture()
+//   lib.<track ID>         decoded from DOWNLOADER_LOCAL_DIR, see library.h
+#ifdef MP_DESKTOP
+#define DOWNLOADER_LOCAL_DIR            "/home/chris/music/"
+#else
+#define DOWNLOADER_LOCAL_DIR            "/root/music/"
+#endif
+
 void downloader_init(void);
 void downloader_cleanup(void);
 
-void downloader_queueDownloadSong(song_t* song);
-void downloader_deleteSongFile(song_t* song);
+/**
+ * Queue a song to be downloaded. Songs closer to the front of the song
+ * queue are downloaded first.
+ * @param file File of the song, in status CONTROL_SONG_STATUS_QUEUED
+ * @return 0, if the song is queued or already downloaded; EBUSY, if too many
+ *         songs are waiting and the song should be queued again later
+ */
+int downloader_queueDownloadSong(song_file_t* file);
+
+/**
+ * Set how many songs are downloaded at the same time
+ * @param workers Number of downloads, from 1 to DOWNLOADER_MAX_WORKERS
+ * @return 0, if successful; EINVAL, if out of range
+ */
+int downloader_setWorkers(int workers);
+
+/**
+ * Get how many songs are downloaded at the same time
+ * @return Number of downloads
+ */
+int downloader_getWorkers(void);
+
+/**
+ * Set how the fixture backend makes up songs, to test the pipeline
+ * without a network
+ * @param latencyMs Time until the audio of a song starts to arrive
+ * @param bytesPerS Rate the raw audio arrives at, 176400 bytes/s is real time,
+ *        at most 1 GB/s
+ * @param songMs Length of the songs
+ * @return 0, if successful; EINVAL, if out of range
+ */
+int downloader_setFixture(long long latencyMs, long long bytesPerS, long long songMs);
 
 #endif
@@ -0,0 +1,286 @@
+#include "fec.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define PRINTF_MODULE           "[fec     ] "
+
+// received packets remembered by the decoder, indexed by seq
+#define HISTORY_SIZE            (2 * FEC_MAX_GROUP_SIZE)
+// jumps in seq larger than this are a new stream, not loss
+#define MAX_SEQ_JUMP            1000
+
+struct history_entry {
+        int valid;
+        struct network_audio_hdr hdr;
+        char payload[NETWORK_MAX_AUDIO_PAYLOAD];
+};
+
+// encoder
+static int group_size = 0;
+static int group_count = 0;
+static unsigned int group_seq = 0;
+static unsigned char group_codec = 0;
+static unsigned short group_len = 0;
+static unsigned short group_max_len = 0;
+static unsigned int group_pos = 0;
+static unsigned long long group_pts = 0;
+static char group_payload[NETWORK_MAX_AUDIO_PAYLOAD];
+static pthread_mutex_t mtx_enc = PTHREAD_MUTEX_INITIALIZER;
+
+// decoder
+static struct history_entry history[HISTORY_SIZE];
+static int started = 0;
+static unsigned int next_seq = 0;
+static unsigned int num_received = 0;
+static unsigned int num_lost = 0;
+static unsigned int num_recovered = 0;
+
+/*
+ * Helper functions
+ */
+static void xorBytes(char *dst, const char *src, int len)
+{
+        int i;
+
+        for (i = 0; i < len; ++i)
+                dst[i] ^= src[i];
+}
+
+static void putU32(char *buf, unsigned int val)
+{
+        val = htonl(val);
+        (void)memcpy(buf, &val, sizeof(val));
+}
+
+static unsigned int getU32(const char *buf)
+{
+        unsigned int val;
+
+        (void)memcpy(&val, buf, sizeof(val));
+        return ntohl(val);
+}
+
+static void putU16(char *buf, unsigned short val)
+{
+        val = htons(val);
+        (void)memcpy(buf, &val, sizeof(val));
+}
+
+static unsigned short getU16(const char *buf)
+{
+        unsigned short val;
+
+        (void)memcpy(&val, buf, sizeof(val));
+        return ntohs(val);
+}
+
+// NOTE: mtx_enc must be held
+static void resetGroup(void)
+{
+        group_count = 0;
+        group_len = 0;
+        group_max_len = 0;
+        group_pos = 0;
+        group_pts = 0;
+        (void)memset(group_payload, 0, sizeof(group_payload));
+}
+
+static void remember(const struct network_audio_hdr *hdr, const char *payload)
+{
+        struct history_entry *e = &history[hdr->seq % HISTORY_SIZE];
+
+        if (hdr->len > NETWORK_MAX_AUDIO_PAYLOAD)
+                return;
+
+        e->valid = 1;
+        e->hdr = *hdr;
+        (void)memcpy(e->payload, payload, hdr->len);
+}
+
+static const struct history_entry *lookup(unsigned int seq)
+{
+        const struct history_entry *e = &history[seq % HISTORY_SIZE];
+
+        if (!e->valid || e->hdr.seq != seq)
+                return NULL;
+
+        return e;
+}
+
+/*
+ * Public functions
+ */
+int fec_setGroupSize(int k)
+{
+        if (k != 0 && (k < 2 || k > FEC_MAX_GROUP_SIZE))
+                return EINVAL;
+
+        pthread_mutex_lock(&mtx_enc);
+        group_size = k;
+        resetGroup();
+        pthread_mutex_unlock(&mtx_enc);
+
+        printf(PRINTF_MODULE "Notice: parity group size set to %d\n", k);
+        (void)fflush(stdout);
+
+        return 0;
+}
+
+int fec_getGroupSize(void)
+{
+        return group_size;
+}
+
+int fec_encode(const struct network_audio_hdr *hdr, const char *payload,
+        char *parity, unsigned int *parity_seq)
+{
+        int len = 0;
+
+        pthread_mutex_lock(&mtx_enc);
+
+        if (!group_size)
+                goto out;
+
+        // a group is made of consecutive packets of the same codec only
+        if (group_count && (hdr->seq != group_seq + group_count || hdr->codec != group_codec))
+                resetGroup();
+
+        if (!group_count) {
+                group_seq = hdr->seq;
+                group_codec = hdr->codec;
+        }
+
+        group_len ^= hdr->len;
+        group_pos ^= hdr->pos;
+        group_pts ^= (unsigned long long)hdr->pts;
+        xorBytes(group_payload, payload, hdr->len);
+        if (hdr->len > group_max_len)
+                group_max_len = hdr->len;
+
+        if (++group_count < group_size)
+                goto out;
+
+        putU16(parity, group_count);
+        putU16(parity + 2, group_len);
+        putU32(parity + 4, group_pos);
+        putU32(parity + 8, group_pts >> 32);
+        putU32(parity + 12, group_pts & 0xFFFFFFFF);
+        (void)memcpy(parity + FEC_PARITY_HDR_SIZE, group_payload, group_max_len);
+        len = FEC_PARITY_HDR_SIZE + group_max_len;
+        *parity_seq = group_seq;
+
+        resetGroup();
+out:
+        pthread_mutex_unlock(&mtx_enc);
+        return len;
+}
+
+void fec_resetEncoder(void)
+{
+        pthread_mutex_lock(&mtx_enc);
+        resetGroup();
+        pthread_mutex_unlock(&mtx_enc);
+}
+
+void fec_resetDecoder(void)
+{
+        (void)memset(history, 0, sizeof(history));
+        started = 0;
+        next_seq = 0;
+        num_received = 0;
+        num_lost = 0;
+        num_recovered = 0;
+}
+
+void fec_receive(const struct network_audio_hdr *hdr, const char *payload)
+{
+        int jump, duplicate;
+
+        ++num_received;
+        duplicate = lookup(hdr->seq) != NULL;
+        remember(hdr, payload);
+
+        jump = (int)(hdr->seq - next_seq);
+
+        if (!started || jump > MAX_SEQ_JUMP || jump < -MAX_SEQ_JUMP) {
+                // first packet of a stream
+                started = 1;
+        } else if (jump > 0) {
+                num_lost += jump;
+        } else if (jump < 0) {
+                // a late packet, which was counted as lost when skipped over
+                if (!duplicate && num_lost)
+                        --num_lost;
+                return;
+        }
+
+        next_seq = hdr->seq + 1;
+}
+
+int fec_recover(const struct network_audio_hdr *hdr, const char *parity,
+        struct network_audio_hdr *out_hdr, char *out_payload)
+{
+        const struct history_entry *e;
+        unsigned int seq, missing = 0;
+        unsigned long long pts;
+        int k, i, len, num_missing = 0;
+
+        if (hdr->len < FEC_PARITY_HDR_SIZE)
+                return EINVAL;
+
+        k = getU16(parity);
+        len = hdr->len - FEC_PARITY_HDR_SIZE;
+        if (k < 2 || k > FEC_MAX_GROUP_SIZE || len > NETWORK_MAX_AUDIO_PAYLOAD)
+                return EINVAL;
+
+        for (i = 0; i < k; ++i) {
+                seq = hdr->seq + i;
+                if (!lookup(seq)) {
+                        missing = seq;
+                        ++num_missing;
+                }
+        }
+
+        // XOR parity can only rebuild a single packet per group
+        if (num_missing != 1)
+                return ENODATA;
+
+        out_hdr->magic = NETWORK_AUDIO_MAGIC;
+        out_hdr->type = NETWORK_PKT_AUDIO;
+        out_hdr->codec = hdr->codec;
+        out_hdr->seq = missing;
+        out_hdr->len = getU16(parity + 2);
+        out_hdr->pos = getU32(parity + 4);
+        pts = ((unsigned long long)getU32(parity + 8) << 32) | getU32(parity + 12);
+        (void)memcpy(out_payload, parity + FEC_PARITY_HDR_SIZE, len);
+
+        for (i = 0; i < k; ++i) {
+                if (!(e = lookup(hdr->seq + i)))
+                        continue;
+
+                out_hdr->len ^= e->hdr.len;
+                out_hdr->pos ^= e->hdr.pos;
+                pts ^= (unsigned long long)e->hdr.pts;
+                xorBytes(out_payload, e->payload, e->hdr.len < len ? e->hdr.len : len);
+        }
+        out_hdr->pts = (long long)pts;
+
+        if (out_hdr->len > len)
+                return EINVAL;
+
+        remember(out_hdr, out_payload);
+        ++num_recovered;
+
+        return 0;
+}
+
+void fec_getStats(unsigned int *received, unsigned int *lost, unsigned int *recovered)
+{
+        *received = num_received;
+        *lost = num_lost;
+        *recovered = num_recovered;
+}
@@ -0,0 +1,77 @@
+#ifndef _FEC_H_
+#define _FEC_H_
+
+#include "network.h"
+
+/**
+ * Forward error correction module - XOR parity over groups of consecutive
+ * audio packets. One parity packet per group lets a slave rebuild a single
+ * packet lost from that group without a retransmission.
+ */
+
+#define FEC_MAX_GROUP_SIZE      32
+#define FEC_PARITY_HDR_SIZE     16
+#define FEC_MAX_PARITY_SIZE     (FEC_PARITY_HDR_SIZE + NETWORK_MAX_AUDIO_PAYLOAD)
+
+/**
+ * Set the number of audio packets protected by each parity packet
+ * @param k Group size from 2 to FEC_MAX_GROUP_SIZE; 0, to disable parity
+ * @return 0 if successful, otherwise error
+ */
+int fec_setGroupSize(int k);
+
+/**
+ * Get the number of audio packets protected by each parity packet
+ * @return Group size; 0, if parity is disabled
+ */
+int fec_getGroupSize(void);
+
+/**
+ * Add an outgoing audio packet to the current parity group
+ * @param hdr Header of the audio packet
+ * @param payload Payload of the audio packet
+ * @param parity Buffer of FEC_MAX_PARITY_SIZE bytes for the parity payload
+ * @param parity_seq Address to store the seq of the first packet in the group
+ * @return Size of the parity payload if the group is complete; 0, otherwise
+ */
+int fec_encode(const struct network_audio_hdr *hdr, const char *payload,
+        char *parity, unsigned int *parity_seq);
+
+/**
+ * Start a new parity group, e.g. when the stream is flushed, so a parity
+ * packet never protects audio from both sides of the flush
+ */
+void fec_resetEncoder(void);
+
+/**
+ * Forget received packets and statistics, e.g. when joining a new stream
+ */
+void fec_resetDecoder(void);
+
+/**
+ * Record an incoming audio packet
+ * @param hdr Header of the audio packet
+ * @param payload Payload of the audio packet
+ */
+void fec_receive(const struct network_audio_hdr *hdr, const char *payload);
+
+/**
+ * Rebuild the packet missing from the group protected by a parity packet
+ * @param hdr Header of the parity packet, carrying the codec of its group
+ * @param parity Payload of the parity packet
+ * @param out_hdr Address to store the header of the rebuilt packet
+ * @param out_payload Buffer of NETWORK_MAX_AUDIO_PAYLOAD bytes for the rebuilt payload
+ * @return 0 if a packet was rebuilt, otherwise error
+ */
+int fec_recover(const struct network_audio_hdr *hdr, const char *parity,
+        struct network_audio_hdr *out_hdr, char *out_payload);
+
+/**
+ * Get the packet counters of the incoming stream
+ * @param received Address to store the number of packets received
+ * @param lost Address to store the number of packets lost on the network
+ * @param recovered Address to store the number of lost packets rebuilt from parity
+ */
+void fec_getStats(unsigned int *received, unsigned int *lost, unsigned int *recovered);
+
+#endif
@@ -0,0 +1,882 @@
+#include "lac.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+
+/*
+ * File layout, all numbers little endian:
+ *
+ * header       "MPLC", version (1), channels (1), block frames (2),
+ *              sample rate (4), total frames (4), index offset (4),
+ *              number of blocks (4); the total frames read STREAMING
+ *              until the file is complete
+ * blocks       "LACB", payload bytes (4), frames (2), stereo mode (1),
+ *              reserved (1), payload
+ * index        "LACI", file offset of every block (4 each)
+ *
+ * The payload holds a subframe for each of the two channels of the stereo
+ * mode, as a bit stream, most significant bit first:
+ *
+ *      order (5)
+ *      shift (4) and order coefficients (COEF_BITS each), if order > 0
+ *      order warm-up samples (SAMPLE_BITS each)
+ *      for every PARTITION_SAMPLES samples, a Rice parameter (5) and the
+ *      Rice codes of the zigzag encoded residuals after the warm-up
+ *
+ * A sample is predicted as the sum of the coefficients times the samples
+ * before it, shifted right by shift.
+ */
+
+#define MAGIC                   "MPLC"
+#define BLOCK_TAG               "LACB"
+#define INDEX_TAG               "LACI"
+#define TAG_SIZE                4
+#define VERSION                 1
+#define STREAMING               0xFFFFFFFFu
+
+#define HDR_SIZE                24
+#define BLOCK_HDR_SIZE          12
+
+#define PARTITION_SAMPLES       256
+#define ORDER_BITS              5
+#define SHIFT_BITS              4
+#define MAX_SHIFT               15
+#define COEF_BITS               15
+#define SAMPLE_BITS             17      // the side channel needs a bit more than S16
+#define RICE_BITS               5
+#define MAX_RICE                30
+// residuals beyond this rule a predictor out
+#define MAX_RESIDUAL            (1 << 30)
+
+// each subframe tries these fixed predictors, and one of LAC_MAX_ORDER
+// computed from the signal; lower orders of the latter rarely do better
+#define NUM_FIXED               5
+static const int32_t fixed_coefs[NUM_FIXED][4] = {
+        { 0 }, { 1 }, { 2, -1 }, { 3, -3, 1 }, { 4, -6, 4, -1 }
+};
+
+enum stereo_mode {
+        STEREO_LEFT_RIGHT = 0,
+        STEREO_LEFT_SIDE  = 1,
+        STEREO_SIDE_RIGHT = 2,
+        STEREO_MID_SIDE   = 3
+};
+
+enum signal {
+        SIGNAL_LEFT, SIGNAL_RIGHT, SIGNAL_MID, SIGNAL_SIDE
+};
+
+struct predictor {
+        int order;
+        int shift;
+        int32_t coefs[LAC_MAX_ORDER];
+};
+
+struct bit_writer {
+        unsigned char *buf;
+        int len;
+        int cap;
+        uint64_t acc;
+        int bits;
+        int overflow;
+};
+
+struct bit_reader {
+        const unsigned char *buf;
+        int len;
+        int pos;                // may run past len, the bytes beyond read as 0
+        uint64_t acc;           // valid bits are aligned to the top
+        int bits;
+};
+
+/*
+ * Helper functions
+ */
+
+static void putLe16(unsigned char *p, uint16_t v)
+{
+        p[0] = v;
+        p[1] = v >> 8;
+}
+
+static void putLe32(unsigned char *p, uint32_t v)
+{
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+        p[3] = v >> 24;
+}
+
+static uint16_t getLe16(const unsigned char *p)
+{
+        return p[0] | p[1] << 8;
+}
+
+static uint32_t getLe32(const unsigned char *p)
+{
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+        return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t u)
+{
+        return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+}
+
+// Writes the low n bits of value, n <= 32
+static void putBits(struct bit_writer *bw, uint32_t value, int n)
+{
+        bw->acc = (bw->acc << n) | (value & (uint32_t)((1ULL << n) - 1));
+        bw->bits += n;
+        while (bw->bits >= 8) {
+                bw->bits -= 8;
+                if (bw->len < bw->cap)
+                        bw->buf[bw->len++] = bw->acc >> bw->bits;
+                else
+                        bw->overflow = 1;
+        }
+}
+
+static void putRice(struct bit_writer *bw, uint32_t u, int k)
+{
+        uint32_t q = u >> k;
+
+        if (q + 1 + k <= 32) {
+                putBits(bw, (1U << k) | (u & ((1U << k) - 1)), q + 1 + k);
+                return;
+        }
+
+        for (; q >= 32; q -= 32)
+                putBits(bw, 0, 32);
+        putBits(bw, 1, q + 1);
+        putBits(bw, u, k);
+}
+
+// Pads the last byte with zeros
+static void flushBits(struct bit_writer *bw)
+{
+        if (bw->bits)
+                putBits(bw, 0, 8 - bw->bits);
+}
+
+static void refill(struct bit_reader *br)
+{
+        while (br->bits <= 56) {
+                uint64_t byte = br->pos < br->len ? br->buf[br->pos] : 0;
+
+                br->acc |= byte << (56 - br->bits);
+                br->bits += 8;
+                ++br->pos;
+        }
+}
+
+// Reads n bits, n <= 32
+static uint32_t getBits(struct bit_reader *br, int n)
+{
+        uint32_t v;
+
+        if (!n)
+                return 0;
+
+        refill(br);
+        v = br->acc >> (64 - n);
+        br->acc <<= n;
+        br->bits -= n;
+
+        return v;
+}
+
+static int32_t getSigned(struct bit_reader *br, int n)
+{
+        return (int32_t)(getBits(br, n) << (32 - n)) >> (32 - n);
+}
+
+// @return 0 if successful; -1, if the code runs past the end of the block
+static int getRice(struct bit_reader *br, int k, uint32_t *u)
+{
+        uint32_t q = 0;
+        int z;
+
+        // count the zeros before the terminating one
+        for (;;) {
+                refill(br);
+                z = br->acc ? __builtin_clzll(br->acc) : 64;
+                if (z < br->bits)
+                        break;
+
+                q += br->bits;
+                br->acc = 0;
+                br->bits = 0;
+                if (br->pos > br->len + 8)
+                        return -1;
+        }
+        q += z;
+        br->acc <<= z;
+        br->acc <<= 1;
+        br->bits -= z + 1;
+
+        *u = (q << k) | getBits(br, k);
+        return 0;
+}
+
+// Chooses the Rice parameter of a partition from the sum of its values
+// @return Bits the partition takes at most
+static uint64_t riceCost(uint64_t sum, int n, int *k)
+{
+        uint64_t bits, best = UINT64_MAX;
+        int i;
+
+        for (i = 0; i <= MAX_RICE; ++i) {
+                bits = (uint64_t)n * (i + 1) + (sum >> i);
+                if (bits < best) {
+                        best = bits;
+                        *k = i;
+                }
+        }
+
+        return RICE_BITS + best;
+}
+
+// Residuals of the samples after the warm-up
+// @return 0 if successful; -1, if a residual is out of range
+static int computeResidual(const int32_t *x, int n, const struct predictor *p, int32_t *res)
+{
+        int64_t sum;
+        int32_t r;
+        int i, j;
+
+        for (i = p->order; i < n; ++i) {
+                sum = 0;
+                for (j = 0; j < p->order; ++j)
+                        sum += (int64_t)p->coefs[j] * x[i - 1 - j];
+
+                r = x[i] - (int32_t)(sum >> p->shift);
+                if (r >= MAX_RESIDUAL || r <= -MAX_RESIDUAL)
+                        return -1;
+                res[i] = r;
+        }
+
+        return 0;
+}
+
+static void partitionBounds(int p, int n, int order, int *start, int *end)
+{
+        *start = p * PARTITION_SAMPLES;
+        if (*start < order)
+                *start = order;
+        *end = (p + 1) * PARTITION_SAMPLES;
+        if (*end > n)
+                *end = n;
+}
+
+// @return Bits the subframe takes with this predictor; UINT64_MAX, if it cannot be used
+static uint64_t predictorCost(const int32_t *x, int n, const struct predictor *p, int32_t *res)
+{
+        uint64_t bits, sum;
+        int parts = (n + PARTITION_SAMPLES - 1) / PARTITION_SAMPLES;
+        int i, k, start, end, part;
+
+        if (computeResidual(x, n, p, res))
+                return UINT64_MAX;
+
+        bits = ORDER_BITS + (p->order ? SHIFT_BITS + p->order * COEF_BITS : 0) +
+                p->order * SAMPLE_BITS;
+
+        for (part = 0; part < parts; ++part) {
+                partitionBounds(part, n, p->order, &start, &end);
+                sum = 0;
+                for (i = start; i < end; ++i)
+                        sum += zigzag(res[i]);
+                bits += riceCost(sum, end > start ? end - start : 0, &k);
+        }
+
+        return bits;
+}
+
+// Linear predictors of every order up to LAC_MAX_ORDER, from the
+// autocorrelation of the windowed signal
+// @return 0 if successful; -1, if the signal is silent
+static int computeLpc(const int32_t *x, int n, double lpc[LAC_MAX_ORDER][LAC_MAX_ORDER])
+{
+        double autoc[LAC_MAX_ORDER + 1] = { 0 };
+        double a[LAC_MAX_ORDER];
+        double xw[LAC_BLOCK_FRAMES];
+        double err, r, tmp, w, half;
+        int i, j, lag;
+
+        // Welch window
+        half = (n - 1) / 2.0;
+        for (i = 0; i < n; ++i) {
+                w = (i - half) / half;
+                xw[i] = x[i] * (1.0 - w * w);
+        }
+
+        for (lag = 0; lag <= LAC_MAX_ORDER; ++lag) {
+                for (i = lag; i < n; ++i)
+                        autoc[lag] += xw[i] * xw[i - lag];
+        }
+
+        // Levinson-Durbin recursion
+        err = autoc[0];
+        if (err <= 0)
+                return -1;
+
+        for (i = 0; i < LAC_MAX_ORDER; ++i) {
+                r = -autoc[i + 1];
+                for (j = 0; j < i; ++j)
+                        r -= a[j] * autoc[i - j];
+                r /= err;
+
+                a[i] = r;
+                for (j = 0; j < i >> 1; ++j) {
+                        tmp = a[j];
+                        a[j] += r * a[i - 1 - j];
+                        a[i - 1 - j] += r * tmp;
+                }
+                if (i & 1)
+                        a[j] += a[j] * r;
+
+                err *= 1.0 - r * r;
+                if (err <= 0)
+                        return -1;
+
+                for (j = 0; j <= i; ++j)
+                        lpc[i][j] = -a[j];
+        }
+
+        return 0;
+}
+
+// Rounds coefficients to COEF_BITS, carrying the rounding error over
+// @return 0 if successful; -1, if they cannot be represented
+static int quantizeLpc(const double *lpc, int order, struct predictor *p)
+{
+        const int32_t qmax = (1 << (COEF_BITS - 1)) - 1;
+        double cmax = 0, err = 0;
+        int32_t q;
+        int i, log2cmax;
+
+        for (i = 0; i < order; ++i) {
+                if (fabs(lpc[i]) > cmax)
+                        cmax = fabs(lpc[i]);
+        }
+        if (cmax <= 0)
+                return -1;
+
+        (void)frexp(cmax, &log2cmax);
+        p->shift = COEF_BITS - 1 - log2cmax;
+        if (p->shift > MAX_SHIFT)
+                p->shift = MAX_SHIFT;
+        if (p->shift < 0)
+                return -1;
+
+        for (i = 0; i < order; ++i) {
+                err += lpc[i] * (1 << p->shift);
+                q = lround(err);
+                if (q > qmax)
+                        q = qmax;
+                else if (q < -qmax)
+                        q = -qmax;
+                p->coefs[i] = q;
+                err -= q;
+        }
+        p->order = order;
+
+        return 0;
+}
+
+// Finds the predictor taking the fewest bits for a signal
+// @return Bits the subframe takes
+static uint64_t analyzeSignal(struct lac_writer *w, const int32_t *x, int n, struct predictor *best)
+{
+        double lpc[LAC_MAX_ORDER][LAC_MAX_ORDER];
+        uint64_t cost, best_cost = UINT64_MAX;
+        struct predictor p;
+        int i;
+
+        for (i = 0; i < NUM_FIXED && i < n; ++i) {
+                memset(&p, 0, sizeof(p));
+                p.order = i;
+                (void)memcpy(p.coefs, fixed_coefs[i], sizeof(fixed_coefs[i]));
+
+                cost = predictorCost(x, n, &p, w->residual);
+                if (cost < best_cost) {
+                        best_cost = cost;
+                        *best = p;
+                }
+        }
+
+        if (n <= 2 * LAC_MAX_ORDER || computeLpc(x, n, lpc) ||
+            quantizeLpc(lpc[LAC_MAX_ORDER - 1], LAC_MAX_ORDER, &p))
+                return best_cost;
+
+        cost = predictorCost(x, n, &p, w->residual);
+        if (cost < best_cost) {
+                best_cost = cost;
+                *best = p;
+        }
+
+        return best_cost;
+}
+
+static void writeSubframe(struct bit_writer *bw, const int32_t *x, int n,
+        const struct predictor *p, int32_t *res)
+{
+        int parts = (n + PARTITION_SAMPLES - 1) / PARTITION_SAMPLES;
+        int i, k = 0, start, end, part;
+        uint64_t sum;
+
+        (void)computeResidual(x, n, p, res);
+
+        putBits(bw, p->order, ORDER_BITS);
+        if (p->order) {
+                putBits(bw, p->shift, SHIFT_BITS);
+                for (i = 0; i < p->order; ++i)
+                        putBits(bw, (uint32_t)p->coefs[i], COEF_BITS);
+        }
+        for (i = 0; i < p->order; ++i)
+                putBits(bw, (uint32_t)x[i], SAMPLE_BITS);
+
+        for (part = 0; part < parts; ++part) {
+                partitionBounds(part, n, p->order, &start, &end);
+                sum = 0;
+                for (i = start; i < end; ++i)
+                        sum += zigzag(res[i]);
+                (void)riceCost(sum, end > start ? end - start : 0, &k);
+
+                putBits(bw, k, RICE_BITS);
+                for (i = start; i < end; ++i)
+                        putRice(bw, zigzag(res[i]), k);
+        }
+}
+
+// Encodes the buffered frames into w->out
+// @return Size of the block in bytes; -1, if it does not fit
+static int encodeBlock(struct lac_writer *w)
+{
+        static const int channels[4][2] = {
+                [STEREO_LEFT_RIGHT] = { SIGNAL_LEFT, SIGNAL_RIGHT },
+                [STEREO_LEFT_SIDE]  = { SIGNAL_LEFT, SIGNAL_SIDE },
+                [STEREO_SIDE_RIGHT] = { SIGNAL_SIDE, SIGNAL_RIGHT },
+                [STEREO_MID_SIDE]   = { SIGNAL_MID, SIGNAL_SIDE }
+        };
+        struct predictor p[4];
+        struct bit_writer bw;
+        uint64_t cost[4], mode_cost, best_cost = UINT64_MAX;
+        int n = w->block_frames;
+        int i, mode, best = 0;
+        int32_t l, r;
+
+        for (i = 0; i < n; ++i) {
+                l = w->block[i * LAC_CHANNELS];
+                r = w->block[i * LAC_CHANNELS + 1];
+                w->signals[SIGNAL_LEFT][i] = l;
+                w->signals[SIGNAL_RIGHT][i] = r;
+                w->signals[SIGNAL_MID][i] = (l + r) >> 1;
+                w->signals[SIGNAL_SIDE][i] = l - r;
+        }
+
+        for (i = 0; i < 4; ++i)
+                cost[i] = analyzeSignal(w, w->signals[i], n, &p[i]);
+
+        for (mode = 0; mode < 4; ++mode) {
+                mode_cost = cost[channels[mode][0]] + cost[channels[mode][1]];
+                if (mode_cost < best_cost) {
+                        best_cost = mode_cost;
+                        best = mode;
+                }
+        }
+
+        memset(&bw, 0, sizeof(bw));
+        bw.buf = w->out + BLOCK_HDR_SIZE;
+        bw.cap = LAC_MAX_BLOCK_BYTES - BLOCK_HDR_SIZE;
+        for (i = 0; i < LAC_CHANNELS; ++i) {
+                writeSubframe(&bw, w->signals[channels[best][i]], n,
+                        &p[channels[best][i]], w->residual);
+        }
+        flushBits(&bw);
+        if (bw.overflow)
+                return -1;
+
+        (void)memcpy(w->out, BLOCK_TAG, TAG_SIZE);
+        putLe32(w->out + 4, bw.len);
+        putLe16(w->out + 8, n);
+        w->out[10] = best;
+        w->out[11] = 0;
+
+        return BLOCK_HDR_SIZE + bw.len;
+}
+
+static int decodeSubframe(struct bit_reader *br, int32_t *x, int n)
+{
+        int32_t coefs[LAC_MAX_ORDER];
+        int parts = (n + PARTITION_SAMPLES - 1) / PARTITION_SAMPLES;
+        int i, j, k, order, shift = 0, start, end, part;
+        uint32_t u;
+        int64_t sum;
+
+        order = getBits(br, ORDER_BITS);
+        if (order > LAC_MAX_ORDER || order >= n)
+                return -1;
+
+        if (order) {
+                shift = getBits(br, SHIFT_BITS);
+                for (i = 0; i < order; ++i)
+                        coefs[i] = getSigned(br, COEF_BITS);
+        }
+        for (i = 0; i < order; ++i)
+                x[i] = getSigned(br, SAMPLE_BITS);
+
+        for (part = 0; part < parts; ++part) {
+                partitionBounds(part, n, order, &start, &end);
+                k = getBits(br, RICE_BITS);
+
+                for (i = start; i < end; ++i) {
+                        if (getRice(br, k, &u))
+                                return -1;
+
+                        sum = 0;
+                        for (j = 0; j < order; ++j)
+                                sum += (int64_t)coefs[j] * x[i - 1 - j];
+                        // a corrupt block must not overflow, so the sum wraps
+                        x[i] = (int32_t)((uint32_t)unzigzag(u) + (uint32_t)(sum >> shift));
+                }
+        }
+
+        return 0;
+}
+
+// Decodes the block in r->payload into r->pcm
+static int decodeBlock(struct lac_reader *r, int len, int n, int mode)
+{
+        struct bit_reader br = { r->payload, len, 0, 0, 0 };
+        int32_t *a = r->signals[0];
+        int32_t *b = r->signals[1];
+        // wide enough for any two samples of a corrupt block
+        int64_t l, m, s;
+        int i;
+
+        if (decodeSubframe(&br, a, n) || decodeSubframe(&br, b, n))
+                return -1;
+        if ((long long)br.pos * 8 - br.bits > (long long)len * 8)
+                return -1;
+
+        for (i = 0; i < n; ++i) {
+                switch (mode) {
+                case STEREO_LEFT_SIDE:
+                        l = a[i];
+                        r->pcm[2 * i] = l;
+                        r->pcm[2 * i + 1] = l - b[i];
+                        break;
+                case STEREO_SIDE_RIGHT:
+                        r->pcm[2 * i] = (int64_t)a[i] + b[i];
+                        r->pcm[2 * i + 1] = b[i];
+                        break;
+                case STEREO_MID_SIDE:
+                        s = b[i];
+                        m = ((int64_t)a[i] * 2) | (s & 1);
+                        r->pcm[2 * i] = (m + s) >> 1;
+                        r->pcm[2 * i + 1] = (m - s) >> 1;
+                        break;
+                default:
+                        r->pcm[2 * i] = a[i];
+                        r->pcm[2 * i + 1] = b[i];
+                        break;
+                }
+        }
+
+        return 0;
+}
+
+static int writeHeader(struct lac_writer *w, uint32_t total_frames, uint32_t index_offset)
+{
+        unsigned char hdr[HDR_SIZE];
+
+        (void)memcpy(hdr, MAGIC, TAG_SIZE);
+        hdr[4] = VERSION;
+        hdr[5] = LAC_CHANNELS;
+        putLe16(hdr + 6, LAC_BLOCK_FRAMES);
+        putLe32(hdr + 8, LAC_SAMPLE_RATE);
+        putLe32(hdr + 12, total_frames);
+        putLe32(hdr + 16, index_offset);
+        putLe32(hdr + 20, w->num_blocks);
+
+        return fwrite(hdr, 1, HDR_SIZE, w->file) == HDR_SIZE ? 0 : EIO;
+}
+
+// Blocks are flushed once written, so the file can be read meanwhile
+static int writeBlock(struct lac_writer *w)
+{
+        uint32_t *index;
+        int len;
+
+        if (w->num_blocks == w->index_cap) {
+                index = realloc(w->index, (w->index_cap + 256) * sizeof(*index));
+                if (!index)
+                        return ENOMEM;
+                w->index = index;
+                w->index_cap += 256;
+        }
+
+        len = encodeBlock(w);
+        if (len < 0)
+                return EIO;
+
+        if (fwrite(w->out, 1, len, w->file) != (size_t)len || fflush(w->file))
+                return EIO;
+
+        w->index[w->num_blocks++] = w->bytes;
+        w->bytes += len;
+        w->frames += w->block_frames;
+        w->block_frames = 0;
+
+        return 0;
+}
+
+// Reads the header again, as it is completed once the whole file is written
+static int readHeader(struct lac_reader *r)
+{
+        unsigned char hdr[HDR_SIZE];
+        unsigned char tag[TAG_SIZE];
+        uint32_t total, offset;
+
+        if (pread(r->fd, hdr, HDR_SIZE, 0) != HDR_SIZE || memcmp(hdr, MAGIC, TAG_SIZE) ||
+            hdr[4] != VERSION || hdr[5] != LAC_CHANNELS ||
+            getLe16(hdr + 6) != LAC_BLOCK_FRAMES || getLe32(hdr + 8) != LAC_SAMPLE_RATE)
+                return EINVAL;
+
+        total = getLe32(hdr + 12);
+        offset = getLe32(hdr + 16);
+        if (total == STREAMING || offset < HDR_SIZE)
+                return 0;
+
+        // the blocks end where the index starts
+        if (pread(r->fd, tag, TAG_SIZE, offset) != TAG_SIZE || memcmp(tag, INDEX_TAG, TAG_SIZE))
+                return EIO;
+
+        r->total_frames = total;
+        r->index_offset = offset;
+
+        return 0;
+}
+
+// Decodes the block at r->pos
+// @return 0 if successful; EAGAIN, if it has not been written yet or there
+//         are no more blocks; EIO, if the file is corrupt
+static int nextBlock(struct lac_reader *r)
+{
+        unsigned char hdr[BLOCK_HDR_SIZE];
+        uint32_t len;
+        int frames, mode;
+
+        if (r->total_frames < 0 &&
+            (pread(r->fd, hdr, BLOCK_HDR_SIZE, r->pos) != BLOCK_HDR_SIZE ||
+             memcmp(hdr, BLOCK_TAG, TAG_SIZE))) {
+                // no block yet, unless the file has been completed meanwhile
+                if (readHeader(r) || r->total_frames < 0)
+                        return EAGAIN;
+        }
+
+        if (r->total_frames >= 0) {
+                if (r->pos >= r->index_offset) {
+                        r->end = 1;
+                        return EAGAIN;
+                }
+                if (pread(r->fd, hdr, BLOCK_HDR_SIZE, r->pos) != BLOCK_HDR_SIZE ||
+                    memcmp(hdr, BLOCK_TAG, TAG_SIZE))
+                        return EIO;
+        }
+
+        len = getLe32(hdr + 4);
+        frames = getLe16(hdr + 8);
+        mode = hdr[10];
+        if (len > LAC_MAX_BLOCK_BYTES || !frames || frames > LAC_BLOCK_FRAMES || mode > STEREO_MID_SIDE)
+                return EIO;
+
+        // part of the block may still be on its way
+        if (pread(r->fd, r->payload, len, r->pos + BLOCK_HDR_SIZE) != (ssize_t)len)
+                return r->total_frames < 0 ? EAGAIN : EIO;
+
+        if (decodeBlock(r, len, frames, mode))
+                return EIO;
+
+        r->pos += BLOCK_HDR_SIZE + len;
+        r->pcm_pos = 0;
+        r->pcm_len = frames * LAC_CHANNELS;
+
+        return 0;
+}
+
+/*
+ * Public functions
+ */
+int lac_create(struct lac_writer *w, const char *path)
+{
+        w->file = fopen(path, "w");
+        if (!w->file)
+                return errno;
+
+        w->block_frames = 0;
+        w->frames = 0;
+        w->index = NULL;
+        w->num_blocks = 0;
+        w->index_cap = 0;
+        w->bytes = HDR_SIZE;
+
+        if (writeHeader(w, STREAMING, 0) || fflush(w->file)) {
+                fclose(w->file);
+                return EIO;
+        }
+
+        return 0;
+}
+
+int lac_write(struct lac_writer *w, const short *samples, int frames)
+{
+        int n, err;
+
+        while (frames > 0) {
+                n = LAC_BLOCK_FRAMES - w->block_frames;
+                if (n > frames)
+                        n = frames;
+
+                (void)memcpy(w->block + w->block_frames * LAC_CHANNELS, samples,
+                        n * LAC_CHANNELS * sizeof(*samples));
+                w->block_frames += n;
+                samples += n * LAC_CHANNELS;
+                frames -= n;
+
+                if (w->block_frames == LAC_BLOCK_FRAMES && (err = writeBlock(w)))
+                        return err;
+        }
+
+        return 0;
+}
+
+int lac_finish(struct lac_writer *w)
+{
+        unsigned char buf[TAG_SIZE];
+        uint32_t index_offset;
+        int err = 0;
+        int i;
+
+        if (w->block_frames)
+                err = writeBlock(w);
+
+        // the index follows the last block, then the header is completed
+        index_offset = w->bytes;
+        if (!err && fwrite(INDEX_TAG, 1, TAG_SIZE, w->file) != TAG_SIZE)
+                err = EIO;
+        for (i = 0; !err && i < w->num_blocks; ++i) {
+                putLe32(buf, w->index[i]);
+                if (fwrite(buf, 1, sizeof(buf), w->file) != sizeof(buf))
+                        err = EIO;
+        }
+
+        if (!err && (fflush(w->file) || fseek(w->file, 0, SEEK_SET) ||
+                     writeHeader(w, w->frames, index_offset)))
+                err = EIO;
+
+        if (fclose(w->file) && !err)
+                err = EIO;
+
+        free(w->index);
+        w->index = NULL;
+        w->file = NULL;
+
+        return err;
+}
+
+int lac_open(struct lac_reader *r, const char *path)
+{
+        int err;
+
+        r->total_frames = -1;
+        r->index_offset = 0;
+        r->pos = HDR_SIZE;
+        r->end = 0;
+        r->pcm_pos = 0;
+        r->pcm_len = 0;
+
+        r->fd = open(path, O_RDONLY);
+        if (r->fd < 0)
+                return errno;
+
+        err = readHeader(r);
+        if (err)
+                lac_close(r);
+
+        return err;
+}
+
+void lac_close(struct lac_reader *r)
+{
+        if (r->fd < 0)
+                return;
+
+        close(r->fd);
+        r->fd = -1;
+}
+
+int lac_read(struct lac_reader *r, short *buf, int samples)
+{
+        int n, read = 0;
+        int err;
+
+        while (read < samples) {
+                if (r->pcm_pos == r->pcm_len) {
+                        err = nextBlock(r);
+                        if (err == EAGAIN)
+                                break;
+                        if (err)
+                                return -1;
+                }
+
+                n = r->pcm_len - r->pcm_pos;
+                if (n > samples - read)
+                        n = samples - read;
+                (void)memcpy(buf + read, r->pcm + r->pcm_pos, n * sizeof(*buf));
+                r->pcm_pos += n;
+                read += n;
+        }
+
+        return read;
+}
+
+int lac_isEnd(const struct lac_reader *r)
+{
+        return r->end && r->pcm_pos == r->pcm_len;
+}
+
+long long lac_getFrames(const struct lac_reader *r)
+{
+        return r->total_frames;
+}
+
+long long lac_probeFrames(const char *path)
+{
+        unsigned char hdr[HDR_SIZE];
+        uint32_t total;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return -1;
+
+        if (pread(fd, hdr, HDR_SIZE, 0) != HDR_SIZE || memcmp(hdr, MAGIC, TAG_SIZE) ||
+            getLe32(hdr + 8) != LAC_SAMPLE_RATE)
+                total = STREAMING;
+        else
+                total = getLe32(hdr + 12);
+        close(fd);
+
+        return total == STREAMING ? -1 : total;
+}
@@ -0,0 +1,122 @@
+#ifndef _LAC_H_
+#define _LAC_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * LAC module - Lossless audio cache format. Songs are stored as blocks of
+ * 44.1 kHz stereo S16, each compressed on its own with linear prediction
+ * and Rice coded residuals, like FLAC. A file can be read while it is
+ * being written, a whole block at a time. A complete file ends with an
+ * index of its blocks, so any frame is found without decoding the ones
+ * before it.
+ */
+
+#define LAC_CHANNELS            2
+#define LAC_SAMPLE_RATE         44100
+// every block but the last holds this many frames
+#define LAC_BLOCK_FRAMES        4096
+#define LAC_MAX_ORDER           12
+// encoded blocks are never larger, a block takes about 21 bits per sample at most
+#define LAC_MAX_BLOCK_BYTES     (LAC_BLOCK_FRAMES * LAC_CHANNELS * 4)
+
+struct lac_writer {
+        FILE *file;
+        short block[LAC_BLOCK_FRAMES * LAC_CHANNELS];   // frames waiting for a block
+        int block_frames;
+        long long frames;                               // frames written to the file
+        uint32_t bytes;                                 // size of the file
+        uint32_t *index;                                // file offset of every block
+        int num_blocks;
+        int index_cap;
+        int32_t signals[4][LAC_BLOCK_FRAMES];           // left, right, mid and side
+        int32_t residual[LAC_BLOCK_FRAMES];
+        unsigned char out[LAC_MAX_BLOCK_BYTES];
+};
+
+struct lac_reader {
+        int fd;                                         // -1, if closed
+        long long total_frames;                         // -1, while the file is being written
+        uint32_t index_offset;
+        off_t pos;                                      // file offset of the next block
+        int end;                                        // every block has been decoded
+        short pcm[LAC_BLOCK_FRAMES * LAC_CHANNELS];     // decoded block
+        int pcm_pos;                                    // next sample of pcm to read
+        int pcm_len;
+        int32_t signals[LAC_CHANNELS][LAC_BLOCK_FRAMES];
+        unsigned char payload[LAC_MAX_BLOCK_BYTES];
+};
+
+/**
+ * Create a file, which can be read from as soon as blocks are written to it
+ * @param w Writer
+ * @param path Path of the file
+ * @return 0 if successful, otherwise error
+ */
+int lac_create(struct lac_writer *w, const char *path);
+
+/**
+ * Append audio to a file. Every LAC_BLOCK_FRAMES frames are encoded and
+ * flushed to the file as a block.
+ * @param w Writer
+ * @param samples Interleaved stereo samples
+ * @param frames Number of frames
+ * @return 0 if successful, otherwise error
+ */
+int lac_write(struct lac_writer *w, const short *samples, int frames);
+
+/**
+ * Write the last block and the index, then complete the header and close the file
+ * @param w Writer
+ * @return 0 if successful, otherwise error
+ */
+int lac_finish(struct lac_writer *w);
+
+/**
+ * Open a file, complete or still being written
+ * @param r Reader
+ * @param path Path of the file
+ * @return 0 if successful; EINVAL, if not a LAC file; otherwise error
+ */
+int lac_open(struct lac_reader *r, const char *path);
+
+/**
+ * Close a file, if open
+ * @param r Reader
+ */
+void lac_close(struct lac_reader *r);
+
+/**
+ * Decode the next samples. Of a file still being written, only what has
+ * been written so far is returned.
+ * @param r Open reader
+ * @param buf Buffer to store interleaved stereo samples
+ * @param samples Size of the buffer in samples
+ * @return Number of samples stored, 0 if there are none yet; <0, if the file is corrupt
+ */
+int lac_read(struct lac_reader *r, short *buf, int samples);
+
+/**
+ * Check if every sample of a complete file has been read
+ * @param r Open reader
+ * @return Nonzero, if at the end of the file
+ */
+int lac_isEnd(const struct lac_reader *r);
+
+/**
+ * Get the length of a file
+ * @param r Open reader
+ * @return Number of frames; -1, while the file is being written
+ */
+long long lac_getFrames(const struct lac_reader *r);
+
+/**
+ * Get the length of a file without opening it for reading, e.g. of a cached song
+ * @param path Path of the file
+ * @return Number of frames; -1, if the file is incomplete or not a LAC file
+ */
+long long lac_probeFrames(const char *path);
+
+#endif
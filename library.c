@@ -0,0 +1,726 @@
+#include "library.h"
+
+#include "control.h"
+#include "cache.h"
+#include "downloader.h"
+#include "tags.h"
+#include "timesync.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PRINTF_MODULE           "[library ] "
+
+// hidden, so the cache does not take it for a stray download
+#define INDEX_FILE              CACHE_DIR ".library"
+#define INDEX_TMP_FILE          CACHE_DIR ".library.tmp"
+#define INDEX_MAGIC             "MPLI"
+#define INDEX_VERSION           1
+
+#define MAX_DEPTH               16
+#define MAX_TRACKS              (1 << 20)
+#define MAX_FORMAT              8
+
+// The index file: a header, the tracks sorted by path, the indices of the
+// tracks sorted by ID, the strings the tracks refer to, and the search keys.
+// A search key is the lower case title, artist and file name of a track,
+// separated by tabs and ended by a newline, so a term never matches across
+// fields. Searching scans all keys at once.
+struct index_header {
+        char magic[4];
+        uint32_t version;
+        uint32_t num_tracks;
+        uint32_t next_id;               // IDs are never given out twice
+        uint32_t strings_size;
+        uint32_t keys_size;
+};
+
+struct index_track {
+        uint32_t id;
+        uint32_t duration_ms;
+        int64_t mtime;
+        int64_t size;
+        uint32_t path;                  // offsets into the strings
+        uint32_t title;
+        uint32_t artist;
+        uint32_t format;
+        uint32_t key;                   // offset into the keys
+        uint32_t reserved;
+};
+
+struct index {
+        void *map;                      // NULL, if there is no index
+        size_t map_size;
+        const struct index_header *hdr;
+        const struct index_track *tracks;
+        const uint32_t *by_id;
+        const char *strings;
+        const char *keys;
+};
+
+// a track while the directory is scanned
+struct scan_track {
+        uint32_t id;
+        uint32_t duration_ms;
+        int64_t mtime;
+        int64_t size;
+        char *path;
+        char *title;
+        char *artist;
+        char format[MAX_FORMAT];
+};
+
+struct scan {
+        const struct index *old;
+        struct scan_track *tracks;
+        int num;
+        int cap;
+        uint32_t next_id;
+        int reread;                     // tracks whose tags were read
+};
+
+struct buffer {
+        char *data;
+        size_t len;
+        size_t cap;
+};
+
+static struct index idx;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t th_scan;
+static int scan_running = 0;
+static int scan_joinable = 0;
+static volatile int stopping = 0;
+
+/*
+ * Helper functions
+ */
+
+static void unmapIndex(struct index *index)
+{
+        if (index->map)
+                (void)munmap(index->map, index->map_size);
+        (void)memset(index, 0, sizeof(*index));
+}
+
+// Maps an index file, checking that everything it refers to is inside it
+static int mapIndex(const char *path, struct index *index)
+{
+        const struct index_header *hdr;
+        const struct index_track *t;
+        struct stat st;
+        uint64_t size;
+        uint32_t i, n;
+        void *map;
+        int fd;
+
+        (void)memset(index, 0, sizeof(*index));
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return errno;
+        if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+                (void)close(fd);
+                return EINVAL;
+        }
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        (void)close(fd);
+        if (map == MAP_FAILED)
+                return errno;
+
+        index->map = map;
+        index->map_size = st.st_size;
+
+        hdr = map;
+        n = hdr->num_tracks;
+        size = sizeof(*hdr) + (uint64_t)n * (sizeof(*t) + sizeof(uint32_t)) +
+                hdr->strings_size + hdr->keys_size;
+        if (memcmp(hdr->magic, INDEX_MAGIC, 4) || hdr->version != INDEX_VERSION ||
+            n > MAX_TRACKS || size != (uint64_t)st.st_size ||
+            (n && (!hdr->strings_size || !hdr->keys_size))) {
+                unmapIndex(index);
+                return EINVAL;
+        }
+
+        index->hdr = hdr;
+        index->tracks = (const struct index_track *)(hdr + 1);
+        index->by_id = (const uint32_t *)(index->tracks + n);
+        index->strings = (const char *)(index->by_id + n);
+        index->keys = index->strings + hdr->strings_size;
+
+        if (n && (index->strings[hdr->strings_size - 1] || index->keys[hdr->keys_size - 1] != '\n')) {
+                unmapIndex(index);
+                return EINVAL;
+        }
+
+        for (i = 0; i < n; ++i) {
+                t = &index->tracks[i];
+                if (t->path >= hdr->strings_size || t->title >= hdr->strings_size ||
+                    t->artist >= hdr->strings_size || t->format >= hdr->strings_size ||
+                    t->key >= hdr->keys_size || (i && t->key <= index->tracks[i - 1].key) ||
+                    index->by_id[i] >= n) {
+                        unmapIndex(index);
+                        return EINVAL;
+                }
+        }
+
+        return 0;
+}
+
+static const struct index_track *findPath(const struct index *index, const char *path)
+{
+        int lo = 0, hi, mid, cmp;
+
+        if (!index->hdr)
+                return NULL;
+
+        hi = index->hdr->num_tracks - 1;
+        while (lo <= hi) {
+                mid = (lo + hi) / 2;
+                cmp = strcmp(path, index->strings + index->tracks[mid].path);
+                if (!cmp)
+                        return &index->tracks[mid];
+                if (cmp < 0)
+                        hi = mid - 1;
+                else
+                        lo = mid + 1;
+        }
+
+        return NULL;
+}
+
+// NOTE: mtx must be held
+static const struct index_track *findId(uint32_t id)
+{
+        const struct index_track *t;
+        int lo = 0, hi, mid;
+
+        if (!idx.hdr)
+                return NULL;
+
+        hi = idx.hdr->num_tracks - 1;
+        while (lo <= hi) {
+                mid = (lo + hi) / 2;
+                t = &idx.tracks[idx.by_id[mid]];
+                if (t->id == id)
+                        return t;
+                if (t->id > id)
+                        hi = mid - 1;
+                else
+                        lo = mid + 1;
+        }
+
+        return NULL;
+}
+
+// Finds the track a search key belongs to
+// NOTE: mtx must be held
+static uint32_t trackOfKey(uint32_t off)
+{
+        uint32_t lo = 0, hi = idx.hdr->num_tracks - 1, mid;
+
+        while (lo < hi) {
+                mid = (lo + hi + 1) / 2;
+                if (idx.tracks[mid].key <= off)
+                        lo = mid;
+                else
+                        hi = mid - 1;
+        }
+
+        return lo;
+}
+
+// Bytes of UTF-8 characters count as letters
+static int startsWord(const char *keys, const char *hit)
+{
+        unsigned char c;
+
+        if (hit == keys)
+                return 1;
+
+        c = hit[-1];
+        return c < 0x80 && !isalnum(c);
+}
+
+// Copies a string, cut at a character boundary if too long
+static void copyTag(char *dst, const char *src)
+{
+        size_t len = strlen(src);
+
+        if (len > LIBRARY_MAXLEN_TAG - 1) {
+                len = LIBRARY_MAXLEN_TAG - 1;
+                while (len && ((unsigned char)src[len] & 0xc0) == 0x80)
+                        --len;
+        }
+        (void)memcpy(dst, src, len);
+        dst[len] = '\0';
+}
+
+static int append(struct buffer *b, const void *data, size_t len)
+{
+        size_t cap;
+        char *p;
+
+        if (b->len + len > b->cap) {
+                cap = b->cap ? b->cap : 4096;
+                while (b->len + len > cap)
+                        cap *= 2;
+                p = realloc(b->data, cap);
+                if (!p)
+                        return ENOMEM;
+                b->data = p;
+                b->cap = cap;
+        }
+
+        (void)memcpy(b->data + b->len, data, len);
+        b->len += len;
+        return 0;
+}
+
+// Appends a string with its terminator, returning its offset
+static uint32_t appendString(struct buffer *b, const char *s, int *err)
+{
+        uint32_t off = b->len;
+
+        *err |= append(b, s, strlen(s) + 1);
+        return off;
+}
+
+static void appendKey(struct buffer *b, const char *s, char end, int *err)
+{
+        char c;
+
+        for (; *s; ++s) {
+                c = tolower((unsigned char)*s);
+                *err |= append(b, &c, 1);
+        }
+        *err |= append(b, &end, 1);
+}
+
+static int comparePaths(const void *a, const void *b)
+{
+        return strcmp(((const struct scan_track *)a)->path, ((const struct scan_track *)b)->path);
+}
+
+static const struct scan_track *sorted_tracks;
+
+static int compareIds(const void *a, const void *b)
+{
+        uint32_t x = sorted_tracks[*(const uint32_t *)a].id;
+        uint32_t y = sorted_tracks[*(const uint32_t *)b].id;
+
+        return x < y ? -1 : x > y;
+}
+
+// Names a track by its file when it has no tags, "<artist> - <title>.mp3"
+// being a common way to name files
+static void nameFromFile(struct tags_info *info, const char *path)
+{
+        const char *base = strrchr(path, '/');
+        const char *ext, *dash;
+
+        base = base ? base + 1 : path;
+        ext = strrchr(base, '.');
+        dash = strstr(base, " - ");
+
+        // file names may hold tabs and newlines, which would break the replies
+        if (!*info->artist && !*info->title && dash && dash < ext) {
+                tags_setString(info->artist, base, dash - base);
+                base = dash + 3;
+        }
+        if (!*info->title)
+                tags_setString(info->title, base, ext - base);
+}
+
+static void freeScan(struct scan *scan)
+{
+        int i;
+
+        for (i = 0; i < scan->num; ++i) {
+                free(scan->tracks[i].path);
+                free(scan->tracks[i].title);
+                free(scan->tracks[i].artist);
+        }
+        free(scan->tracks);
+}
+
+// Adds a file to the scan, reusing what the old index knows of it if the
+// file did not change since
+static int addTrack(struct scan *scan, const char *rel, const char *path,
+        const struct stat *st, const char *format)
+{
+        const struct index_track *old = findPath(scan->old, rel);
+        struct tags_info info;
+        struct scan_track *t, *tracks;
+
+        if (scan->num == MAX_TRACKS)
+                return ENOSPC;
+
+        if (scan->num == scan->cap) {
+                scan->cap = scan->cap ? scan->cap * 2 : 1024;
+                tracks = realloc(scan->tracks, scan->cap * sizeof(*tracks));
+                if (!tracks)
+                        return ENOMEM;
+                scan->tracks = tracks;
+        }
+
+        t = &scan->tracks[scan->num];
+        t->mtime = st->st_mtime;
+        t->size = st->st_size;
+        (void)snprintf(t->format, sizeof(t->format), "%s", format);
+
+        if (old && old->mtime == t->mtime && old->size == t->size) {
+                t->id = old->id;
+                t->duration_ms = old->duration_ms;
+                t->path = strdup(rel);
+                t->title = strdup(scan->old->strings + old->title);
+                t->artist = strdup(scan->old->strings + old->artist);
+        } else {
+                if (tags_read(path, format, &info))
+                        return 0;
+                nameFromFile(&info, rel);
+
+                // a changed file is a new track, so its old download is not played
+                t->id = scan->next_id++;
+                t->duration_ms = info.duration_ms;
+                t->path = strdup(rel);
+                t->title = strdup(info.title);
+                t->artist = strdup(info.artist);
+                ++scan->reread;
+        }
+
+        if (!t->path || !t->title || !t->artist) {
+                free(t->path);
+                free(t->title);
+                free(t->artist);
+                return ENOMEM;
+        }
+
+        ++scan->num;
+        return 0;
+}
+
+// Adds the audio files of a directory and its subdirectories
+// @param rel Path of the directory relative to DOWNLOADER_LOCAL_DIR, "" or ending with '/'
+static int scanDir(struct scan *scan, const char *rel, int depth)
+{
+        char path[CONTROL_MAXLEN_FN];
+        char child[CONTROL_MAXLEN_FN];
+        char format[MAX_FORMAT];
+        struct dirent *ent;
+        struct stat st;
+        const char *ext;
+        int err = 0;
+        DIR *dir;
+        int i;
+
+        (void)snprintf(path, sizeof(path), "%s%s", DOWNLOADER_LOCAL_DIR, rel);
+        dir = opendir(path);
+        if (!dir)
+                return 0;
+
+        while (!err && !stopping && (ent = readdir(dir))) {
+                if (ent->d_name[0] == '.')
+                        continue;
+
+                // the decoder is given the whole path, so it must fit
+                if (snprintf(child, sizeof(child), "%s%s", rel, ent->d_name) >= (int)sizeof(child) ||
+                    snprintf(path, sizeof(path), "%s%s", DOWNLOADER_LOCAL_DIR, child) >= (int)sizeof(path) ||
+                    stat(path, &st))
+                        continue;
+
+                if (S_ISDIR(st.st_mode)) {
+                        if (depth < MAX_DEPTH && strlen(child) + 1 < sizeof(child)) {
+                                (void)strcat(child, "/");
+                                err = scanDir(scan, child, depth + 1);
+                        }
+                        continue;
+                }
+
+                ext = strrchr(ent->d_name, '.');
+                if (!S_ISREG(st.st_mode) || !ext || strlen(ext + 1) >= sizeof(format))
+                        continue;
+
+                for (i = 0; ext[i + 1]; ++i)
+                        format[i] = tolower((unsigned char)ext[i + 1]);
+                format[i] = '\0';
+
+                if (tags_isAudioFormat(format))
+                        err = addTrack(scan, child, path, &st, format);
+        }
+
+        closedir(dir);
+        return err;
+}
+
+// Writes the index of a scan, to a temporary file first so a crash never
+// leaves half an index
+static int writeIndex(struct scan *scan)
+{
+        struct buffer strings = { 0 };
+        struct buffer keys = { 0 };
+        struct index_header hdr;
+        struct index_track *tracks;
+        struct scan_track *s;
+        const char *base;
+        uint32_t *by_id;
+        FILE *file;
+        int err = 0;
+        int i;
+
+        qsort(scan->tracks, scan->num, sizeof(*scan->tracks), comparePaths);
+
+        tracks = calloc(scan->num ? scan->num : 1, sizeof(*tracks));
+        by_id = malloc((scan->num ? scan->num : 1) * sizeof(*by_id));
+        if (!tracks || !by_id) {
+                free(tracks);
+                free(by_id);
+                return ENOMEM;
+        }
+
+        for (i = 0; i < scan->num; ++i) {
+                s = &scan->tracks[i];
+                base = strrchr(s->path, '/');
+                base = base ? base + 1 : s->path;
+
+                tracks[i].id = s->id;
+                tracks[i].duration_ms = s->duration_ms;
+                tracks[i].mtime = s->mtime;
+                tracks[i].size = s->size;
+                tracks[i].path = appendString(&strings, s->path, &err);
+                tracks[i].title = appendString(&strings, s->title, &err);
+                tracks[i].artist = appendString(&strings, s->artist, &err);
+                tracks[i].format = appendString(&strings, s->format, &err);
+                tracks[i].key = keys.len;
+                appendKey(&keys, s->title, '\t', &err);
+                appendKey(&keys, s->artist, '\t', &err);
+                appendKey(&keys, base, '\n', &err);
+                by_id[i] = i;
+        }
+
+        sorted_tracks = scan->tracks;
+        qsort(by_id, scan->num, sizeof(*by_id), compareIds);
+
+        (void)memcpy(hdr.magic, INDEX_MAGIC, 4);
+        hdr.version = INDEX_VERSION;
+        hdr.num_tracks = scan->num;
+        hdr.next_id = scan->next_id;
+        hdr.strings_size = strings.len;
+        hdr.keys_size = keys.len;
+
+        file = err ? NULL : fopen(INDEX_TMP_FILE, "w");
+        if (file) {
+                if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+                    fwrite(tracks, sizeof(*tracks), scan->num, file) != (size_t)scan->num ||
+                    fwrite(by_id, sizeof(*by_id), scan->num, file) != (size_t)scan->num ||
+                    fwrite(strings.data, 1, strings.len, file) != strings.len ||
+                    fwrite(keys.data, 1, keys.len, file) != keys.len)
+                        err = EIO;
+                if (fclose(file))
+                        err = EIO;
+                if (!err && rename(INDEX_TMP_FILE, INDEX_FILE))
+                        err = errno;
+        } else if (!err) {
+                err = errno;
+        }
+
+        free(tracks);
+        free(by_id);
+        free(strings.data);
+        free(keys.data);
+        return err;
+}
+
+static void *scanLoop(void *arg)
+{
+        struct scan scan = { 0 };
+        struct index index;
+        long long start = timesync_getTimeUs();
+        int err;
+
+        // only this thread replaces the index, so it reads it unlocked
+        scan.old = &idx;
+        scan.next_id = idx.hdr ? idx.hdr->next_id : 1;
+
+        err = scanDir(&scan, "", 0);
+        if (!err && !stopping)
+                err = writeIndex(&scan);
+        freeScan(&scan);
+
+        if (!err && !stopping && !(err = mapIndex(INDEX_FILE, &index))) {
+                pthread_mutex_lock(&mtx);
+                unmapIndex(&idx);
+                idx = index;
+                pthread_mutex_unlock(&mtx);
+
+                printf(PRINTF_MODULE "Info: %d tracks in %s, %d read again, scanned in %lld ms\n",
+                        scan.num, DOWNLOADER_LOCAL_DIR, scan.reread, (timesync_getTimeUs() - start) / 1000);
+        } else if (err) {
+                printf(PRINTF_MODULE "Warning: unable to scan %s, error %d\n", DOWNLOADER_LOCAL_DIR, err);
+        }
+        (void)fflush(stdout);
+
+        pthread_mutex_lock(&mtx);
+        scan_running = 0;
+        pthread_mutex_unlock(&mtx);
+
+        return NULL;
+}
+
+/*
+ * Public functions
+ */
+
+int library_init(void)
+{
+        struct index index;
+
+        stopping = 0;
+        if (!mapIndex(INDEX_FILE, &index)) {
+                pthread_mutex_lock(&mtx);
+                idx = index;
+                pthread_mutex_unlock(&mtx);
+        }
+
+        return library_rescan();
+}
+
+void library_cleanup(void)
+{
+        stopping = 1;
+        if (scan_joinable)
+                (void)pthread_join(th_scan, NULL);
+        scan_joinable = 0;
+
+        pthread_mutex_lock(&mtx);
+        unmapIndex(&idx);
+        pthread_mutex_unlock(&mtx);
+}
+
+int library_rescan(void)
+{
+        int err;
+
+        pthread_mutex_lock(&mtx);
+        if (scan_running) {
+                pthread_mutex_unlock(&mtx);
+                return EBUSY;
+        }
+        if (scan_joinable)
+                (void)pthread_join(th_scan, NULL);
+
+        scan_running = 1;
+        err = pthread_create(&th_scan, NULL, scanLoop, NULL);
+        scan_joinable = !err;
+        scan_running = !err;
+        pthread_mutex_unlock(&mtx);
+
+        return err;
+}
+
+int library_getPath(unsigned int id, char *path)
+{
+        const struct index_track *t;
+
+        pthread_mutex_lock(&mtx);
+        t = findId(id);
+        if (t)
+                (void)snprintf(path, CONTROL_MAXLEN_FN, "%s%s", DOWNLOADER_LOCAL_DIR, idx.strings + t->path);
+        pthread_mutex_unlock(&mtx);
+
+        return t ? 0 : ENOENT;
+}
+
+int library_parseId(const char *vid, unsigned int *id)
+{
+        const char *c = vid + strlen(LIBRARY_PREFIX);
+
+        if (strncmp(vid, LIBRARY_PREFIX, strlen(LIBRARY_PREFIX)) || !*c || strlen(c) > 9 ||
+            strspn(c, "0123456789") != strlen(c))
+                return EINVAL;
+
+        *id = strtoul(c, NULL, 10);
+        return 0;
+}
+
+int library_search(const char *term, struct library_track *tracks, int max, int *total)
+{
+        uint32_t words[LIBRARY_MAX_RESULTS];
+        uint32_t others[LIBRARY_MAX_RESULTS];
+        char key[LIBRARY_MAXLEN_TERM];
+        const char *p, *end, *hit, *key_end;
+        const struct index_track *t;
+        int num_words = 0, num_others = 0;
+        int len, i, n;
+        uint32_t ti;
+
+        *total = 0;
+        len = strlen(term);
+        if (!len || len >= (int)sizeof(key) || strpbrk(term, "\t\n"))
+                return -1;
+        for (i = 0; i <= len; ++i)
+                key[i] = tolower((unsigned char)term[i]);
+        if (max > LIBRARY_MAX_RESULTS)
+                max = LIBRARY_MAX_RESULTS;
+
+        pthread_mutex_lock(&mtx);
+        if (!idx.hdr || !idx.hdr->num_tracks) {
+                pthread_mutex_unlock(&mtx);
+                return 0;
+        }
+
+        p = idx.keys;
+        end = idx.keys + idx.hdr->keys_size;
+        while ((hit = memmem(p, end - p, key, len))) {
+                ti = trackOfKey(hit - idx.keys);
+                key_end = ti + 1 < idx.hdr->num_tracks ? idx.keys + idx.tracks[ti + 1].key : end;
+                ++*total;
+
+                // the term may start a word further into the same track
+                while (hit && !startsWord(idx.keys, hit))
+                        hit = memmem(hit + 1, key_end - hit - 1, key, len);
+
+                if (hit && num_words < max)
+                        words[num_words++] = ti;
+                else if (!hit && num_others < max)
+                        others[num_others++] = ti;
+                p = key_end;
+        }
+
+        n = 0;
+        for (i = 0; i < num_words + num_others && n < max; ++i) {
+                t = &idx.tracks[i < num_words ? words[i] : others[i - num_words]];
+                tracks[n].id = t->id;
+                tracks[n].duration_ms = t->duration_ms;
+                (void)snprintf(tracks[n].format, sizeof(tracks[n].format), "%s", idx.strings + t->format);
+                copyTag(tracks[n].title, idx.strings + t->title);
+                copyTag(tracks[n].artist, idx.strings + t->artist);
+                ++n;
+        }
+        pthread_mutex_unlock(&mtx);
+
+        return n;
+}
+
+int library_getSize(void)
+{
+        int n;
+
+        pthread_mutex_lock(&mtx);
+        n = idx.hdr ? (int)idx.hdr->num_tracks : 0;
+        pthread_mutex_unlock(&mtx);
+
+        return n;
+}
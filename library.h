@@ -0,0 +1,78 @@
+#ifndef _LIBRARY_H_
+#define _LIBRARY_H_
+
+/**
+ * Library module - Indexes the music files of DOWNLOADER_LOCAL_DIR and its
+ * subdirectories, so they can be searched and queued by ID. The index is
+ * kept in a file that is mapped into memory, and rescans only read the
+ * tags of files whose mtime or size changed. A track keeps its ID until its
+ * file changes, which gives it a new one, so a cached song is never stale.
+ * Tracks are queued as "lib.<ID>".
+ */
+
+#define LIBRARY_PREFIX          "lib."
+#define LIBRARY_MAXLEN_TAG      48
+#define LIBRARY_MAXLEN_TERM     64
+#define LIBRARY_MAX_RESULTS     32
+
+struct library_track {
+        unsigned int id;
+        unsigned int duration_ms;                       // 0, if unknown
+        char format[8];                                 // file extension
+        char title[LIBRARY_MAXLEN_TAG];                 // cut short if too long
+        char artist[LIBRARY_MAXLEN_TAG];
+};
+
+/**
+ * Initializes this module, mapping the index and rescanning the
+ * directory in the background
+ * @return 0 if successful, otherwise error
+ */
+int library_init(void);
+
+/**
+ * Cleans up this module, waiting for a rescan to finish
+ */
+void library_cleanup(void);
+
+/**
+ * Start rescanning the directory in the background, the index is
+ * replaced once the rescan is complete
+ * @return 0 if successful; EBUSY, if a rescan is already running
+ */
+int library_rescan(void);
+
+/**
+ * Get the path of a track's file
+ * @param id ID of the track
+ * @param path Buffer of CONTROL_MAXLEN_FN bytes to store the path
+ * @return 0 if successful; ENOENT, if there is no such track
+ */
+int library_getPath(unsigned int id, char *path);
+
+/**
+ * Parse the ID of a track queued as a song
+ * @param vid Song ID, "lib.<ID>"
+ * @param id Address to store the ID of the track
+ * @return 0 if successful; EINVAL, if the song is not from the library
+ */
+int library_parseId(const char *vid, unsigned int *id);
+
+/**
+ * Find tracks whose title, artist or file name contains a term, ignoring
+ * the case of ASCII letters. Tracks where the term starts a word come first.
+ * @param term Text to look for
+ * @param tracks Array to store the tracks found
+ * @param max Size of the array, up to LIBRARY_MAX_RESULTS
+ * @param total Address to store the number of tracks that match
+ * @return Number of tracks stored; -1, if the term is empty or too long
+ */
+int library_search(const char *term, struct library_track *tracks, int max, int *total);
+
+/**
+ * Get the number of tracks in the index
+ * @return Number of tracks
+ */
+int library_getSize(void);
+
+#endif
@@ -3,6 +3,7 @@
 #include "control.h"
 #include "network.h"
 #include "audio.h"
+#include "timesync.h"
 
 #ifndef MP_DESKTOP
 #include "disp.h"
@@ -26,6 +27,7 @@ static int initializeModules()
         printf(PRINTF_MODULE "Notice: Initializing modules\n");
         (void)fflush(stdout);
 
+        err |= timesync_init();
         err |= control_init();
         err |= network_init();
         err |= audio_init();
@@ -44,6 +46,7 @@ static void shutdownModules()
         network_cleanup();
         control_cleanup();
         audio_cleanup();
+        timesync_cleanup();
 #ifndef MP_DESKTOP
         disp_cleanup();
 #endif
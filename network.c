@@ -2,85 +2,282 @@
 
 #include "control.h"
 #include "audio.h"
+#include "timesync.h"
+#include "fec.h"
+#include "codec.h"
+#include "downloader.h"
+#include "cache.h"
+#include "supervisor.h"
+#include "prefetch.h"
+#include "library.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <sched.h>
 #include <errno.h>
+#include <stdint.h>
 
 #define PRINTF_MODULE           "[network ] "
 
 #define INBOUND_PORT            12345
-#define OUTBOUND_PORT           23456
 #define MCAST_PORT              34567
 #define BUFFER_SIZE             NETWORK_MAX_BUFFER_SIZE
 
-#define CMD_MASTER_OFFSET       12
-#define CMD_SLAVE_OFFSET        11
-// assuming a youtube video id's minimum length is 10, this is roughly the size
-// of a fully built status response string (minus the queue) with 145 commas
-#define QUEUE_OFFSET            222
-
+// commands sent by this device
 #define CMD_PING                        "ping"
-#define CMD_VOLUME_UP                   "volup"
-#define CMD_VOLUME_DOWN                 "voldown"
 #define CMD_PLAY                        "play"
 #define CMD_PAUSE                       "pause"
 #define CMD_SKIP                        "skip"
-#define CMD_ADD_SONG                    "addsong=%s"
-#define CMD_ADD_SONG_SSCANF_MATCHES     1
-#define CMD_REMOVE_SONG                 "rmsong=%s,%d"
-#define CMD_REMOVE_SONG_SSCANF_MATCHES  2
-#define CMD_REPEAT_SONG                 "repeat=%d"
-#define CMD_REPEAT_SONG_SSCANF_MATCHES  1
-#define CMD_SET_VOL                     "vol=%d"
-#define CMD_SET_VOL_SSCANF_MATCHES      1
-#define CMD_CHANGE_MODE                 "mode="
 #define CMD_GET_MCAST                   "getmcast"
 #define CMD_MCAST                       "mcast=%u:%hu"
 #define CMD_MCAST_BUF_SIZE              32
-#define CMD_MCAST_SSCANF_MATCHES        2
+#define CMD_TIME_REQ                    "timereq=%lld"
+#define CMD_TIME_RESP                   "timeresp=%lld,%lld,%lld"
+#define CMD_TIME_BUF_SIZE               80
+#define CMD_TIME_PREFIX                 "time"
+#define CMD_REPORT                      "report=%u,%u,%u,%u,%u,%lld,%lld,%u"
+#define CMD_REPORT_BUF_SIZE             128
+#define CMD_UNICAST                     "unicast=%hu"
+#define CMD_UNICAST_BUF_SIZE            32
+#define CMD_BACKFILL                    "backfill=%hu"
+#define CMD_REPORT_PREFIX               "report="
+#define CMD_UNICAST_PREFIX              "unicast="
+
+// a command is "<keyword>[=<arg>[,<arg>...]]", ':' also separates arguments
+#define CMD_ARG_START                   '='
+#define CMD_ARG_SEPARATORS              ",:"
+#define CMD_MAX_ARGS                    8
 
 #define SEND_MCAST_IP                   -1
+#define NO_REPLY                        -2
 #define DEFAULT_MCAST_IP                "224.255.255.255"
-#define MCAST_TIMEOUT_US                1e5
-#define MCAST_RESET_US                  MCAST_TIMEOUT_US * 2
+// datagrams read per recvmmsg() call, the receiver drains the socket on every wakeup
+#define MCAST_BATCH_SIZE                16
+#define MCAST_DEFAULT_RCVBUF            (256 * 1024)
+#define MCAST_CMSG_SIZE                 CMSG_SPACE(sizeof(unsigned int))
+
+#define AUDIO_FRAME_SIZE                (AUDIO_NUM_CHANNELS * sizeof(short))
+#define FLUSH_REPEAT                    3
 
-#define MAX_AUDIO_PACKET_SIZE           256
+// slaves exchange timestamps with the master quickly after joining, then
+// periodically to follow the drift between the two clocks
+#define TIMESYNC_NUM_FAST               4
+#define TIMESYNC_FAST_INTERVAL_US       2e5
+#define TIMESYNC_INTERVAL_US            2e6
 
 #define VOL_DIFF                        5
 
+#define STATUS_FIELD_SIZE               64
+// songs listed per getqueue reply at most, so a page fits in one datagram
+#define QUEUE_MAX_PAGE                  ((BUFFER_SIZE - STATUS_FIELD_SIZE) / CONTROL_MAXLEN_VID)
+
+// subscribers renew their lease well before it ends, and get a progress
+// update every tick while a song plays
+#define MAX_SUBSCRIBERS                 8
+#define SUBSCRIBE_LEASE_US              30e6
+#define SUBSCRIBE_TICK_US               1e6
+
+// slaves report their reception along with every periodic time exchange,
+// the master forgets receivers that stopped reporting
+#define MAX_RECEIVERS                   16
+#define RECEIVER_TIMEOUT_US             10e6
+#define RECEIVER_LINE_SIZE              200
+
+// tracks listed per search reply at most, sent in as many datagrams as needed
+#define SEARCH_MAX_RESULTS              LIBRARY_MAX_RESULTS
+#define SEARCH_LINE_SIZE                (LIBRARY_MAXLEN_TAG * 2 + 40)
+
+// the master keeps the latest audio packets for slaves that cannot receive
+// multicast and for slaves that just joined, and sends them to each one in
+// turns of a few packets, so a slave that falls behind only loses its own
+// oldest packets. It holds the longest lead of the smallest packets, with
+// a parity packet for every two, and is a power of two so the index stays
+// in order when history_head wraps
+#define HISTORY_LEAD_PKTS               (CONTROL_MAX_LEAD_US * AUDIO_SAMPLE_RATE / 1000000 / CODEC_MIN_PACKET_FRAMES)
+#define HISTORY_SIZE                    256
+#if HISTORY_SIZE < HISTORY_LEAD_PKTS * 3 / 2
+#error "HISTORY_SIZE does not hold the longest lead"
+#endif
+#define HISTORY_PKT_SIZE                (NETWORK_AUDIO_HDR_SIZE + FEC_MAX_PARITY_SIZE)
+#define UCAST_BATCH_SIZE                64
+#define UCAST_BURST                     4
+
+// a joining slave is sent the audio that is not heard yet, and ignores the
+// live stream until that burst starts or its end marker arrives, as it
+// already holds those packets
+#define BACKFILL_MARGIN_US              5e3
+#define BACKFILL_WAIT_US                1e5
+
+#define MAX_EVENTS                      8
+
 static int loop = 0;
-static pthread_t th_rx;
-static pthread_t th_tx;
-static pthread_t th_mcast;
+static pthread_t th_net;
+
+// every socket is served by one event loop thread, other threads only
+// queue outbound messages and wake it up through wake_fd
+static int ep_fd = -1;
+static int wake_fd = -1;
+static int timer_fd = -1;
+static int tick_fd = -1;
+static int cmd_fd = -1;
+static int mcast_fd = -1;
+static int ucast_fd = -1;
 
 struct out_msg {
         char buf[BUFFER_SIZE];
         int msg_len;
+        int audio;                      // also sent to the unicast receivers
         struct sockaddr_in out_addr;
         struct out_msg *next;
 };
 
 static struct out_msg *out_queue = NULL;
 static pthread_mutex_t mtx_queue = PTHREAD_MUTEX_INITIALIZER;
-static sem_t sem_queue;
 
 static struct sockaddr_in mcast_addr;
-static struct timespec mcast_refresh = { .tv_nsec = MCAST_RESET_US };
-static pthread_mutex_t mtx_mcast = PTHREAD_MUTEX_INITIALIZER;
+// group mcast_fd has joined, may lag behind mcast_addr until the loop catches up
+static struct ip_mreq mcast_mreq;
+static unsigned short mcast_joined_port = 0;
+static int num_timereq = 0;
+
+static struct sockaddr_in master_addr;
+
+// receive buffers of the multicast receiver, only used by the event loop
+static struct mmsghdr mcast_msgs[MCAST_BATCH_SIZE];
+static struct iovec mcast_iovs[MCAST_BATCH_SIZE];
+static char mcast_bufs[MCAST_BATCH_SIZE][BUFFER_SIZE];
+static char mcast_cmsgs[MCAST_BATCH_SIZE][MCAST_CMSG_SIZE];
+static int mcast_rcvbuf = MCAST_DEFAULT_RCVBUF;
+// datagrams dropped by the kernel because the socket buffer was full
+static unsigned int mcast_overflows = 0;
+// slave: ask the master to send the audio by unicast instead of multicast
+static int mcast_unicast = 0;
+// slave: local time (us) to stop waiting for the backfill burst; 0, if not waiting
+static long long backfill_until = 0;
+
+// master: latest audio packets, history_head counts every packet ever added
+static char history[HISTORY_SIZE][HISTORY_PKT_SIZE];
+static unsigned short history_len[HISTORY_SIZE];
+static long long history_pts[HISTORY_SIZE];
+static unsigned int history_head = 0;
+
+// type bytes of packets sent as backfill, indexed by enum network_pkt_type
+static const unsigned char backfill_types[] = {
+        NETWORK_PKT_AUDIO | NETWORK_PKT_BACKFILL,
+        NETWORK_PKT_PARITY | NETWORK_PKT_BACKFILL,
+        NETWORK_PKT_FLUSH | NETWORK_PKT_BACKFILL
+};
+// set while the socket buffer is full, until ucast_fd is writable again
+static int ucast_blocked = 0;
+
+// position of the outgoing audio stream on the master
+static unsigned int audio_seq = 0;
+static unsigned int audio_pos = 0;
+static enum codec_type audio_codec = CODEC_PCM;
+
+// status replies are built from cached fields, each remembering the version
+// of the status it last changed in, so a client only receives what changed
+// since the version it last saw
+enum status_field {
+        STATUS_MODE,
+        STATUS_VOL,
+        STATUS_PLAY,
+        STATUS_REPEAT,
+        STATUS_STREAM,
+        STATUS_SONG,
+        STATUS_QUEUE,           // version and length only, songs are listed with getqueue
+        STATUS_NUM_FIELDS
+};
+
+struct status_since {
+        unsigned int epoch;
+        unsigned int version;
+};
+
+static char status_text[STATUS_NUM_FIELDS][STATUS_FIELD_SIZE];
+static unsigned int status_changed[STATUS_NUM_FIELDS];
+static unsigned int status_version = 0;
+// identifies this run of the device, so versions from before a restart are not trusted
+static unsigned int status_epoch = 0;
+// copy of the song queue's video ids, so any page of it is found directly
+static char (*status_queue)[CONTROL_MAXLEN_VID] = NULL;
+static int status_queue_len = 0;
+static unsigned int status_queue_version = 0;
+// set when the status may have changed, the event loop then pushes it
+static int status_dirty = 0;
+
+// clients that get status changes pushed to them until their lease ends
+struct subscriber {
+        int active;
+        struct sockaddr_in addr;
+        long long expires;              // local time (us) the lease ends
+        unsigned int version;           // status version last sent to the subscriber
+};
+
+static struct subscriber subscribers[MAX_SUBSCRIBERS];
+static int num_subscribers = 0;
+
+// slaves known to the master from their receiver reports
+struct receiver {
+        int active;
+        struct sockaddr_in addr;
+        long long expires;              // local time (us) the receiver is forgotten
+        unsigned int received;          // counters of the last report
+        unsigned int lost;
+        unsigned int recovered;
+        unsigned int concealed;
+        unsigned int overflows;
+        unsigned int xruns;
+        long long buffered_us;
+        long long offset_us;
+        unsigned int loss;              // smoothed network loss in 1/1000
+        int unicast;                    // audio is sent to audio_addr, not multicast
+        struct sockaddr_in audio_addr;
+        unsigned int cursor;            // next packet of history to send
+        unsigned int backfill_end;      // packets before this one are backfill
+        int backfill_marker;            // the end of the backfill is still to be sent
+        unsigned int sent;
+        unsigned int dropped;           // packets overwritten before they were sent
+};
+
+static struct receiver receivers[MAX_RECEIVERS];
+// pick the FEC group size from the worst receiver's loss
+static int fec_auto = 0;
 
 /**
  * Helper functions
  */
+static void wakeEventLoop(void)
+{
+        unsigned long long one = 1;
+
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+                printf(PRINTF_MODULE "Warning: unable to wake up event loop (%s)\n", strerror(errno));
+                (void)fflush(stdout);
+        }
+}
+
+static void armTimer(int fd, long long first_us, long long interval_us)
+{
+        struct itimerspec its;
+
+        its.it_value.tv_sec = first_us / 1000000;
+        its.it_value.tv_nsec = (first_us % 1000000) * 1000;
+        its.it_interval.tv_sec = interval_us / 1000000;
+        its.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+
+        (void)timerfd_settime(fd, 0, &its, NULL);
+}
+
 static int getSocketFD(unsigned short port, int *fd)
 {
         struct sockaddr_in sa;
@@ -106,7 +303,7 @@ static int getSocketFD(unsigned short port, int *fd)
         return 0;
 }
 
-static void queueOutboundMessage(char *buf, unsigned int buf_size, struct sockaddr_in sa)
+static void queueMessage(char *buf, unsigned int buf_size, struct sockaddr_in sa, int audio)
 {
         struct out_msg *msg, *elem;
 
@@ -124,8 +321,9 @@ static void queueOutboundMessage(char *buf, unsigned int buf_size, struct sockad
         }
 
         (void)memset(msg, 0, sizeof(struct out_msg));
-        (void)strncpy(msg->buf, buf, buf_size);
+        (void)memcpy(msg->buf, buf, buf_size);
         msg->msg_len = buf_size;
+        msg->audio = audio;
         msg->out_addr = sa;
 
         pthread_mutex_lock(&mtx_queue);
@@ -139,513 +337,2001 @@ static void queueOutboundMessage(char *buf, unsigned int buf_size, struct sockad
                         out_queue = msg;
                 }
 
-                if (sem_post(&sem_queue) < 0) {
-                        printf(PRINTF_MODULE "Warning: semaphore is full, a message may be lost\n");
-                        (void)fflush(stdout);
-                }
         }
         pthread_mutex_unlock(&mtx_queue);
+
+        wakeEventLoop();
 }
 
-static int queueSystemStatusMessage(struct sockaddr_in sa)
+static void queueOutboundMessage(char *buf, unsigned int buf_size, struct sockaddr_in sa)
 {
-        char buf[BUFFER_SIZE] = {0};
-        char *c;
-        size_t bytes;
-        const song_t *s;
-        int song_status;
-
-        c = buf;
-        s = control_getQueue();
-
-        bytes = sprintf(c, "mode=%d\n", control_getMode());
-        if (!bytes)
-                goto out;
-        c += bytes;
-
-        bytes = sprintf(c, "vol=%d\n", audio_getVolume());
-        if (!bytes)
-                goto out;
-        c += bytes;
-
-        bytes = sprintf(c, "play=%d\n", control_getPlayStatus());
-        if (!bytes)
-                goto out;
-        c += bytes;
-
-        bytes = sprintf(c, "repeat=%d\n", control_getRepeatStatus());
-        if (!bytes)
-                goto out;
-        c += bytes;
-
-        song_status = s ? s->status : CONTROL_SONG_STATUS_UNKNOWN;
-        bytes = sprintf(c, "status=%d\n", song_status);
-        if (!bytes)
-                goto out;
-        c += bytes;
-
-        if (s) {
-                int play_curr;
-                int play_end;
+        queueMessage(buf, buf_size, sa, 0);
+}
 
-                control_getSongProgress(&play_curr, &play_end);
-                bytes = sprintf(c, "progress=%d/%d\n", play_curr, play_end);
-                if (!bytes)
-                        goto out;
-                c += bytes;
-        }
+static void queueAudioMessage(char *buf, unsigned int buf_size)
+{
+        queueMessage(buf, buf_size, mcast_addr, 1);
+}
 
-        bytes = sprintf(c, "queue=");
-        if (!bytes)
-                goto out;
-        c += bytes;
+static void packAudioHeader(const struct network_audio_hdr *hdr, unsigned char *buf)
+{
+        unsigned short len = htons(hdr->len);
+        unsigned int seq = htonl(hdr->seq);
+        unsigned int pos = htonl(hdr->pos);
+        unsigned int pts_hi = htonl((unsigned long long)hdr->pts >> 32);
+        unsigned int pts_lo = htonl((unsigned long long)hdr->pts & 0xFFFFFFFF);
+
+        buf[0] = hdr->magic;
+        buf[1] = hdr->type;
+        (void)memcpy(buf + 2, &len, sizeof(len));
+        (void)memcpy(buf + 4, &seq, sizeof(seq));
+        (void)memcpy(buf + 8, &pos, sizeof(pos));
+        (void)memcpy(buf + 12, &pts_hi, sizeof(pts_hi));
+        (void)memcpy(buf + 16, &pts_lo, sizeof(pts_lo));
+        buf[20] = hdr->codec;
+}
 
-        while (s) {
-                if ((c-buf) >= BUFFER_SIZE - CONTROL_MAXLEN_VID - QUEUE_OFFSET) {
-                        queueOutboundMessage(buf, (c-buf), sa);
-                        (void)memset(buf, 0, BUFFER_SIZE);
-                        c = buf;
+static int unpackAudioHeader(const unsigned char *buf, unsigned int buf_size,
+        struct network_audio_hdr *hdr)
+{
+        unsigned short len;
+        unsigned int seq, pos, pts_hi, pts_lo;
 
-                        bytes = sprintf(c, "queuemore=");
-                        if (!bytes)
-                                goto out;
-                        c += bytes;
-                }
+        if (buf_size < NETWORK_AUDIO_HDR_SIZE || buf[0] != NETWORK_AUDIO_MAGIC)
+                return EINVAL;
 
-                bytes = sprintf(c, "%s,", s->vid);
-                if (!bytes)
-                        goto out;
-                c += bytes;
-                s = s->next;
-        }
+        (void)memcpy(&len, buf + 2, sizeof(len));
+        (void)memcpy(&seq, buf + 4, sizeof(seq));
+        (void)memcpy(&pos, buf + 8, sizeof(pos));
+        (void)memcpy(&pts_hi, buf + 12, sizeof(pts_hi));
+        (void)memcpy(&pts_lo, buf + 16, sizeof(pts_lo));
+
+        hdr->magic = buf[0];
+        hdr->type = buf[1];
+        hdr->len = ntohs(len);
+        hdr->seq = ntohl(seq);
+        hdr->pos = ntohl(pos);
+        hdr->pts = (long long)(((unsigned long long)ntohl(pts_hi) << 32) | ntohl(pts_lo));
+        hdr->codec = buf[20];
+
+        if (hdr->len > buf_size - NETWORK_AUDIO_HDR_SIZE)
+                return EINVAL;
 
-        queueOutboundMessage(buf, (c-buf), sa);
+        // payloads are copied into buffers of the largest size the master sends
+        if (hdr->len > ((hdr->type & ~NETWORK_PKT_BACKFILL) == NETWORK_PKT_PARITY ?
+                        FEC_MAX_PARITY_SIZE : NETWORK_MAX_AUDIO_PAYLOAD))
+                return EINVAL;
 
         return 0;
-out:
-        printf(PRINTF_MODULE "Warning: failed to build system status string\n");
-        (void)fflush(stdout);
-        return errno;
-}
-
-static int processCmd(char *buf)
-{
-        char url[CONTROL_MAXLEN_VID] = {0};
-        int num = 0;
-        unsigned int mcast_ip = 0;
-        unsigned short mcast_port = 0;
-
-        if (strstr(buf, CMD_PING)) {
-                // do nothing, since a status message is return on valid commands
-        } else if (strstr(buf, CMD_VOLUME_UP)) {
-                audio_setVolume(audio_getVolume() + VOL_DIFF);
-        } else if (strstr(buf, CMD_VOLUME_DOWN)) {
-                audio_setVolume(audio_getVolume() - VOL_DIFF);
-        } else if (sscanf(buf, CMD_SET_VOL, &num) == CMD_SET_VOL_SSCANF_MATCHES) {
-                audio_setVolume(num);
-        } else if (strstr(buf, CMD_PLAY)) {
-                control_playAudio();
-        } else if (strstr(buf, CMD_PAUSE)) {
-                control_pauseAudio();
-        } else if (strstr(buf, CMD_SKIP)) {
-                control_skipSong();
-        } else if (sscanf(buf, CMD_ADD_SONG, url) == CMD_ADD_SONG_SSCANF_MATCHES) {
-                control_addSong(url);
-        } else if (sscanf(buf, CMD_REMOVE_SONG, url, &num) == CMD_REMOVE_SONG_SSCANF_MATCHES) {
-                control_removeSong(url, num);
-        } else if (sscanf(buf, CMD_REPEAT_SONG, &num) == CMD_REPEAT_SONG_SSCANF_MATCHES) {
-                control_setRepeatStatus(num);
-        } else if (strstr(buf, CMD_CHANGE_MODE)) {
-                in_addr_t addr;
-                unsigned short port;
-                char *c;
-
-                if (strstr(buf, "master")) {
-                        buf += CMD_MASTER_OFFSET;
-
-                        // extract designated multicast IP and port if possible
-                        if ((c = strchr(buf, ':'))) {
-                                *c = '\0';
-                                ++c;
-
-                                port = atoi(c);
-
-                                if (!port)
-                                        port = MCAST_PORT;
-                        } else {
-                                // try using MCAST_PORT as default
-                                port = MCAST_PORT;
-                        }
-
-                        addr = inet_addr(buf);
-                        if (addr < 0) {
-                                printf(PRINTF_MODULE "Warning: invalid address provided for multicast\n");
-                                (void)fflush(stdout);
-                                return EADDRNOTAVAIL;
-                        }
+}
 
-                        mcast_addr.sin_port = htons(port);
-                        mcast_addr.sin_addr.s_addr = addr;
+// Decodes a received audio packet and hands it to the control loop
+static void queueAudioPacket(const struct network_audio_hdr *hdr, const char *payload)
+{
+        static int warned_codec = CODEC_PCM;
+        short pcm[CODEC_MAX_PACKET_FRAMES * AUDIO_NUM_CHANNELS];
+        int frames;
+
+        frames = codec_decode(hdr->codec, payload, hdr->len, pcm);
+        if (frames < 0) {
+                // only warn once, or every packet of the stream would be reported
+                if (hdr->codec != warned_codec) {
+                        printf(PRINTF_MODULE "Warning: dropping audio of unsupported codec %u\n", hdr->codec);
+                        (void)fflush(stdout);
+                        warned_codec = hdr->codec;
+                }
+                return;
+        }
 
-                        control_setMode(CONTROL_MODE_MASTER);
+        control_queueAudio((char *)pcm, frames * AUDIO_FRAME_SIZE, hdr->pos, hdr->pts);
+}
 
-                        // lock mcast receiver thread if it isn't already
-                        (void)pthread_mutex_trylock(&mtx_mcast);
+static void setReceiveBuffer(int fd, int size)
+{
+        int actual = 0;
+        socklen_t len = sizeof(actual);
 
-                        printf(PRINTF_MODULE "Notice: setting device to master mode\n");
-                        (void)fflush(stdout);
-                } else if (strstr(buf, "slave,")) {
-                        struct sockaddr_in sa;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0 ||
+            getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &actual, &len) < 0) {
+                printf(PRINTF_MODULE "Warning: unable to set multicast receive buffer (%s)\n", strerror(errno));
+                (void)fflush(stdout);
+                return;
+        }
 
-                        buf += CMD_SLAVE_OFFSET;
+        // the kernel doubles the requested size and caps it at rmem_max
+        printf(PRINTF_MODULE "Notice: multicast receive buffer is %d bytes\n", actual);
+        (void)fflush(stdout);
+}
 
-                        // extract master IP and port if possible
-                        if ((c = strchr(buf, ':'))) {
-                                *c = '\0';
-                                ++c;
+// Resets the batch before each recvmmsg(), which overwrites the lengths
+static void prepareBatch(void)
+{
+        int i;
 
-                                port = atoi(c);
+        for (i = 0; i < MCAST_BATCH_SIZE; ++i) {
+                mcast_iovs[i].iov_base = mcast_bufs[i];
+                mcast_iovs[i].iov_len = BUFFER_SIZE;
 
-                                if (!port)
-                                        port = INBOUND_PORT;
-                        } else {
-                                // try using INBOUND_PORT as default
-                                port = INBOUND_PORT;
-                        }
+                (void)memset(&mcast_msgs[i].msg_hdr, 0, sizeof(mcast_msgs[i].msg_hdr));
+                mcast_msgs[i].msg_hdr.msg_iov = &mcast_iovs[i];
+                mcast_msgs[i].msg_hdr.msg_iovlen = 1;
+                mcast_msgs[i].msg_hdr.msg_control = mcast_cmsgs[i];
+                mcast_msgs[i].msg_hdr.msg_controllen = MCAST_CMSG_SIZE;
+        }
+}
 
-                        memset(&sa, 0, sizeof(sa));
-                        sa.sin_family = AF_INET;
-                        sa.sin_port = htons(port);
-                        sa.sin_addr.s_addr = inet_addr(buf);
-                        if (sa.sin_addr.s_addr < 0) {
-                                printf(PRINTF_MODULE "Warning: invalid address provided for master device\n");
-                                (void)fflush(stdout);
-                                return EADDRNOTAVAIL;
-                        }
+// Reads the socket's drop counter attached by SO_RXQ_OVFL, if present
+static void updateOverflows(struct msghdr *msg)
+{
+        struct cmsghdr *cmsg;
+        unsigned int drops;
 
-                        // send request to master to obtain the multicast IP
-                        queueOutboundMessage(CMD_GET_MCAST, strlen(CMD_GET_MCAST) + 1, sa);
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL)
+                        continue;
 
-                        // NOTE: device isn't changed to slave mode here,
-                        // must get multicast IP first
-                }
-        } else if (strstr(buf, CMD_GET_MCAST)) {
-                return SEND_MCAST_IP;
-        } else if (sscanf(buf, CMD_MCAST, &mcast_ip, &mcast_port) == CMD_MCAST_SSCANF_MATCHES) {
-                // extract multicast group IP
-                mcast_addr.sin_addr.s_addr = mcast_ip;
-                mcast_addr.sin_port = mcast_port;
-
-                // if it was already in slave mode, we need to reset the socket
-                // to listen for the new address
-                if (control_getMode() == CONTROL_MODE_SLAVE) {
-                        // temporarily set to master to reset the multicast loop
-                        control_setMode(CONTROL_MODE_MASTER);
-                        nanosleep(&mcast_refresh, NULL);
+                (void)memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                if (drops != mcast_overflows) {
+                        printf(PRINTF_MODULE "Warning: multicast socket buffer overflowed, %u datagrams dropped so far\n", drops);
+                        (void)fflush(stdout);
+                        mcast_overflows = drops;
                 }
+        }
+}
 
-                control_setMode(CONTROL_MODE_SLAVE);
-
-                // unlock multicast receiver thread
-                pthread_mutex_unlock(&mtx_mcast);
+static void processAudioDatagram(char *buf, unsigned int size)
+{
+        struct network_audio_hdr hdr, rec_hdr;
+        char rec_buf[NETWORK_MAX_AUDIO_PAYLOAD];
 
-                printf(PRINTF_MODULE "Notice: setting device to slave mode\n");
-                (void)fflush(stdout);
-        } else {
-                printf(PRINTF_MODULE "Warning: invalid command received (\"%s\")\n", buf);
+        if (unpackAudioHeader((unsigned char *)buf, size, &hdr)) {
+                printf(PRINTF_MODULE "Warning: dropping malformed audio packet\n");
                 (void)fflush(stdout);
-                return EINVAL;
+                return;
         }
 
-        return 0;
+        // the live packets sent before the backfill burst are part of it,
+        // the ones after it follow on from its last packet
+        if (backfill_until) {
+                // the end marker also comes after an empty or lost burst
+                if (hdr.type & NETWORK_PKT_BACKFILL)
+                        backfill_until = 0;
+                else if (timesync_getTimeUs() < backfill_until)
+                        return;
+                else
+                        backfill_until = 0;
+        }
+        hdr.type &= ~NETWORK_PKT_BACKFILL;
+
+        if (hdr.type == NETWORK_PKT_AUDIO) {
+                fec_receive(&hdr, buf + NETWORK_AUDIO_HDR_SIZE);
+
+                // send audio to control loop
+                queueAudioPacket(&hdr, buf + NETWORK_AUDIO_HDR_SIZE);
+        } else if (hdr.type == NETWORK_PKT_PARITY &&
+                   !fec_recover(&hdr, buf + NETWORK_AUDIO_HDR_SIZE, &rec_hdr, rec_buf)) {
+                // rebuilt a lost packet, which may still be in time
+                queueAudioPacket(&rec_hdr, rec_buf);
+        } else if (hdr.type == NETWORK_PKT_FLUSH) {
+                control_flushAudio(hdr.pos);
+        }
 }
 
-static void processMessage(char *buf, struct sockaddr_in sa)
+static void sendTimeRequest(void)
 {
-        char *cmd, *c;
-        int err = 0;
+        char buf[CMD_TIME_BUF_SIZE] = {0};
 
-        cmd = buf;
-        c = buf;
+        sprintf(buf, CMD_TIME_REQ "\n", timesync_getTimeUs());
+        queueOutboundMessage(buf, strlen(buf) + 1, master_addr);
+}
 
-        while (*c != '\0' && (c-buf) < BUFFER_SIZE) {
-                if (*c == '\n' || (c-buf) >= BUFFER_SIZE) {
-                        *c = '\0';
+static void sendReceiverReport(void)
+{
+        char buf[CMD_REPORT_BUF_SIZE] = {0};
+        unsigned int received, lost, recovered;
 
-                        if (!strstr(cmd, CMD_PING)) {
-                                printf(PRINTF_MODULE "Notice: processing command: \"%s\"\n", cmd);
-                                (void)fflush(stdout);
-                        }
+        fec_getStats(&received, &lost, &recovered);
 
-                        if ((err = processCmd(cmd)))
-                                break;
-                        ++c;
-                        cmd = c;
-                } else {
-                        ++c;
-                }
-        }
+        sprintf(buf, CMD_REPORT "\n", received, lost, recovered,
+                control_getConcealedFrames(), mcast_overflows, control_getBufferedUs(),
+                timesync_isSynced() ? timesync_getOffsetUs() : 0, audio_getXruns());
+        queueOutboundMessage(buf, strlen(buf) + 1, master_addr);
+}
 
-        // error handling
-        if (err == SEND_MCAST_IP) {
-                // not actually an error, but we don't need to send the
-                // system status message, so we can treat it like one
-                char out_buf[CMD_MCAST_BUF_SIZE] = {0};
+// Asks the master for the audio that is not heard yet, right after joining
+static void sendBackfillRequest(void)
+{
+        char buf[CMD_UNICAST_BUF_SIZE] = {0};
 
-                sprintf(out_buf, CMD_MCAST,
-                        mcast_addr.sin_addr.s_addr,
-                        mcast_addr.sin_port);
+        sprintf(buf, CMD_BACKFILL "\n", ntohs(mcast_addr.sin_port));
+        queueOutboundMessage(buf, strlen(buf) + 1, master_addr);
 
-                // send the broadcast IP of this device back to the slave
-                queueOutboundMessage(out_buf, strlen(out_buf) + 1, sa);
-        } else if (err == EADDRNOTAVAIL) {
-                queueOutboundMessage("error=\"invalid address provided\"\n",
-                        strlen("error=\"invalid address provided\"\n") + 1, sa);
-        } else if (err == EINVAL) {
-                queueOutboundMessage("error=\"invalid command\"\n",
-                        strlen("error=\"invalid command\"\n") + 1, sa);
-        } else if (err == ENOMEM) {
-                // don't send anything, otherwise the slave and master will keep
-                // sending error messages back and forth between each other
-        } else {
-                (void)queueSystemStatusMessage(sa);
-        }
+        backfill_until = timesync_getTimeUs() + BACKFILL_WAIT_US;
+}
 
-        return;
+// Asks for the audio by unicast, renewing the lease on every report
+static void sendUnicastRequest(void)
+{
+        char buf[CMD_UNICAST_BUF_SIZE] = {0};
+
+        sprintf(buf, CMD_UNICAST "\n", ntohs(mcast_addr.sin_port));
+        queueOutboundMessage(buf, strlen(buf) + 1, master_addr);
 }
 
-static void *receiverLoop(void *arg)
+static void setStatusField(enum status_field f, const char *text)
 {
-        int fd = 0;
-        struct sockaddr_in sa;
-        char buf[BUFFER_SIZE] = {0};
-        int bytes_recv;
-        unsigned int sa_len;
+        if (!strcmp(status_text[f], text))
+                return;
 
-        if (getSocketFD(INBOUND_PORT, &fd))
-                return NULL;
+        (void)snprintf(status_text[f], STATUS_FIELD_SIZE, "%s", text);
+        status_changed[f] = ++status_version;
+}
 
-        while (loop) {
-                sa_len = sizeof(sa);
-                bytes_recv = recvfrom(fd, buf, BUFFER_SIZE-1, 0,
-                        (struct sockaddr *)&sa, &sa_len);
+// Copies the video ids of the song queue, if it changed since last time
+static void refreshStatusQueue(void)
+{
+        char text[STATUS_FIELD_SIZE];
 
-                if (bytes_recv < 0) {
-                        printf(PRINTF_MODULE "Error: receiverLoop's recvfrom encountered an error\n");
-                        (void)fflush(stdout);
-                        return NULL;
-                }
+        if (status_queue && control_getQueueVersion() == status_queue_version)
+                return;
 
-                processMessage(buf, sa);
-                (void)memset(buf, 0, BUFFER_SIZE);
+        if (control_getQueueIds(&status_queue, &status_queue_len, &status_queue_version)) {
+                printf(PRINTF_MODULE "Warning: unable to allocate memory for the status queue\n");
+                (void)fflush(stdout);
+                return;
         }
 
-        return NULL;
+        (void)sprintf(text, "queueinfo=%u,%d\n", status_queue_version, status_queue_len);
+        setStatusField(STATUS_QUEUE, text);
 }
 
-static void *senderLoop(void *arg)
+// Brings the cached status up to date, bumping the version of changed fields
+static void refreshStatus(void)
 {
-        int fd = 0;
-        struct out_msg *msg;
+        char text[STATUS_FIELD_SIZE];
 
-        if (getSocketFD(OUTBOUND_PORT, &fd))
-                return NULL;
+        (void)sprintf(text, "mode=%d\n", control_getMode());
+        setStatusField(STATUS_MODE, text);
 
-        while (loop) {
-                if (sem_wait(&sem_queue) < 0)
-                        continue;
-                if (!out_queue)
-                        continue;
+        (void)sprintf(text, "vol=%d\n", audio_getVolume());
+        setStatusField(STATUS_VOL, text);
 
-                pthread_mutex_lock(&mtx_queue);
-                {
-                        msg = out_queue;
+        (void)sprintf(text, "play=%d\n", control_getPlayStatus());
+        setStatusField(STATUS_PLAY, text);
 
-                        if (sendto(fd, msg->buf, msg->msg_len, 0,
-                            (struct sockaddr *)&(msg->out_addr), sizeof(msg->out_addr)) < 0) {
-                                printf(PRINTF_MODULE "Warning: sendto failed (%s)\n", strerror(errno));
-                                (void)fflush(stdout);
-                        }
+        (void)sprintf(text, "repeat=%d\n", control_getRepeatStatus());
+        setStatusField(STATUS_REPEAT, text);
 
-                        out_queue = msg->next;
-                        free(msg);
-                        msg = NULL;
-                }
-                pthread_mutex_unlock(&mtx_queue);
-        }
-        return NULL;
+        // the receive counters of a slave change constantly, they are
+        // sent with every reply instead
+        if (control_getMode() == CONTROL_MODE_SLAVE)
+                text[0] = '\0';
+        else
+                (void)sprintf(text, "fec=%d\ncodec=%s\nlead=%lld\n", fec_getGroupSize(),
+                        codec_getName(audio_codec), control_getLead() / 1000);
+        setStatusField(STATUS_STREAM, text);
+
+        (void)sprintf(text, "status=%d\n", control_getCurrentStatus());
+        setStatusField(STATUS_SONG, text);
+
+        refreshStatusQueue();
 }
 
-static void *mcastReceiverLoop(void *arg)
+static int queueSystemStatusMessage(struct sockaddr_in sa, const struct status_since *since)
 {
-        int fd = 0;
-        struct ip_mreq mreq;
-        fd_set rfds;
-        struct timeval timeout;
-        struct sockaddr_in sa;
         char buf[BUFFER_SIZE] = {0};
-        int bytes_recv;
-        unsigned int sa_len;
-        int ret;
+        char *c;
+        int f, full;
 
-        while (loop) {
-                // lock this thread when we are not using it
-                pthread_mutex_lock(&mtx_mcast);
-                pthread_mutex_unlock(&mtx_mcast);
+        refreshStatus();
 
-                if (getSocketFD(ntohs(mcast_addr.sin_port), &fd)) {
-                        printf(PRINTF_MODULE "Error: unable to get socket file descriptor for multicast\n");
-                        (void)fflush(stdout);
-                        goto out;
-                }
+        // deltas only make sense against a status of this run of the device
+        full = since->epoch != status_epoch || since->version > status_version;
 
-                mreq.imr_multiaddr.s_addr = mcast_addr.sin_addr.s_addr;
-                mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        c = buf;
+        c += sprintf(c, "version=%u,%u\nupdate=%s\n", status_epoch, status_version,
+                full ? "full" : since->version == status_version ? "none" : "delta");
 
-                if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
-                        printf(PRINTF_MODULE "Error: unable to join multicast group (%s)\n", strerror(errno));
-                        (void)fflush(stdout);
-                        goto out;
-                }
+        for (f = 0; f < STATUS_NUM_FIELDS; ++f) {
+                if (full || status_changed[f] > since->version)
+                        c += sprintf(c, "%s", status_text[f]);
+        }
 
-                printf(PRINTF_MODULE "Notice: starting multicast receiver thread at %u:%hu\n",
-                        ntohl(mcast_addr.sin_addr.s_addr), ntohs(mcast_addr.sin_port));
-                (void)fflush(stdout);
+        if (control_getMode() == CONTROL_MODE_SLAVE) {
+                unsigned int received, lost, recovered;
 
-                while (control_getMode() == CONTROL_MODE_SLAVE) {
-                        // prepare timeout and file descriptor list
-                        FD_ZERO(&rfds);
-                        FD_SET(fd, &rfds);
+                fec_getStats(&received, &lost, &recovered);
+                c += sprintf(c, "rx=%u,%u,%u,%u,%u\n", received, recovered,
+                        lost > recovered ? lost - recovered : 0,
+                        control_getConcealedFrames(), mcast_overflows);
+        }
 
-                        timeout.tv_sec = 0;
-                        timeout.tv_usec = MCAST_TIMEOUT_US;
+        if (control_getQueue()) {
+                int play_curr;
+                int play_end;
 
-                        // check if we can read from the socket
-                        ret = select(fd + 1, &rfds, NULL, NULL, &timeout);
+                control_getSongProgress(&play_curr, &play_end);
+                c += sprintf(c, "progress=%d/%d\n", play_curr, play_end);
+        }
 
-                        if (ret < 0) {
-                                printf(PRINTF_MODULE "Warning: an error has occurred in select(), restarting multicast receiver\n");
-                                (void)fflush(stdout);
-                                goto out;
-                        } else if (ret == 0) {
-                                // timeout expired, continue
-                                continue;
-                        } else {
-                                // data can be read from socket
-                                sa_len = sizeof(sa);
+        // download progress changes constantly too
+        if (control_getMode() != CONTROL_MODE_SLAVE) {
+                struct control_download_status downloads[DOWNLOADER_MAX_WORKERS];
+                const struct control_download *d;
+                int i, num;
+
+                num = control_getDownloads(downloads, DOWNLOADER_MAX_WORKERS);
+                for (i = 0; i < num; ++i) {
+                        d = &downloads[i].download;
+                        c += sprintf(c, "download=%d,%s,%d,%d,%lld,%lld,%lld,%d,%lld\n",
+                                downloads[i].index, downloads[i].vid, d->phase, d->percent,
+                                d->fetched_bytes, d->total_bytes, d->speed, d->eta_s,
+                                downloads[i].audio_ms);
+                }
+        }
 
-                                // NOTE: this thread can get stuck here if nothing is being multicasted
-                                bytes_recv = recvfrom(fd, buf, BUFFER_SIZE-1, 0,
-                                        (struct sockaddr *)&sa, &sa_len);
+        queueOutboundMessage(buf, (c-buf), sa);
 
-                                if (bytes_recv < 0) {
-                                        printf(PRINTF_MODULE "Error: mcastReceiverLoop's recvfrom encountered an error\n");
-                                        (void)fflush(stdout);
-                                        goto out;
-                                }
+        return 0;
+}
 
-                                // send audio to control loop
-                                control_queueAudio(buf, bytes_recv);
+static void sendStatusToSubscriber(struct subscriber *sub)
+{
+        struct status_since since = { status_epoch, sub->version };
 
-                                (void)memset(buf, 0, BUFFER_SIZE);
-                        }
-                }
-out:
-                (void)setsockopt(fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+        (void)queueSystemStatusMessage(sub->addr, &since);
+        sub->version = status_version;
+}
 
-                if (fd > 0) {
-                        close(fd);
-                        fd = 0;
-                }
+static struct subscriber *findSubscriber(struct sockaddr_in addr)
+{
+        int i;
 
+        for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+                if (subscribers[i].active &&
+                    subscribers[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
+                    subscribers[i].addr.sin_port == addr.sin_port)
+                        return &subscribers[i];
         }
 
         return NULL;
 }
 
-/**
- * Public functions
- */
-int network_init(void)
+static void removeSubscriber(struct subscriber *sub)
 {
-        int err = 0;
-        struct sched_param params;
+        sub->active = 0;
 
-        loop = 1;
+        // nothing to tick for
+        if (--num_subscribers == 0)
+                armTimer(tick_fd, 0, 0);
+}
 
-        (void)sem_init(&sem_queue, 0, 0);
+// Sends the changed status fields to every subscriber that has not seen them
+static void pushStatus(void)
+{
+        int i;
 
-        // set up multicast sockaddr_in objects
-        memset(&mcast_addr, 0, sizeof(mcast_addr));
-        mcast_addr.sin_family = AF_INET;
-        mcast_addr.sin_port = htons(MCAST_PORT);
-        mcast_addr.sin_addr.s_addr = inet_addr(DEFAULT_MCAST_IP);
+        status_dirty = 0;
+        if (!num_subscribers)
+                return;
 
-        pthread_mutex_lock(&mtx_mcast);
+        refreshStatus();
 
-        if ((err = pthread_create(&th_rx, NULL, receiverLoop, NULL))) {
-                printf(PRINTF_MODULE "Error: unable to create thread for incoming UDP connections\n");
-                return err;
-        } else if ((err = pthread_create(&th_tx, NULL, senderLoop, NULL))) {
-                printf(PRINTF_MODULE "Error: unable to create thread for outgoing UDP connections\n");
-                return err;
-        } else if ((err = pthread_create(&th_mcast, NULL, mcastReceiverLoop, NULL))) {
-                printf(PRINTF_MODULE "Error: unable to create thread for receiving multicasts\n");
-                return err;
+        for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+                if (subscribers[i].active && subscribers[i].version != status_version)
+                        sendStatusToSubscriber(&subscribers[i]);
         }
+}
 
-        // set higher scheduling priority for multicast receiver thread
-        params.sched_priority = sched_get_priority_max(SCHED_FIFO);
+static struct receiver *findReceiver(struct sockaddr_in addr)
+{
+        int i;
 
-        err = pthread_setschedparam(th_mcast, SCHED_FIFO, &params);
-        if (err)
-                printf(PRINTF_MODULE "Error: unable to schedule a higher priority for multicast receiver thread\n");
+        for (i = 0; i < MAX_RECEIVERS; ++i) {
+                if (receivers[i].active &&
+                    receivers[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
+                    receivers[i].addr.sin_port == addr.sin_port)
+                        return &receivers[i];
+        }
 
-        return err;
+        return NULL;
 }
 
-void network_cleanup(void)
+// Finds the receiver at addr, or registers it if there is room
+static struct receiver *addReceiver(struct sockaddr_in addr)
 {
-        char buf[BUFFER_SIZE];
+        struct receiver *rcv = findReceiver(addr);
+        int i;
 
-        loop = 0;
+        for (i = 0; !rcv && i < MAX_RECEIVERS; ++i) {
+                if (receivers[i].active)
+                        continue;
+
+                rcv = &receivers[i];
+                (void)memset(rcv, 0, sizeof(*rcv));
+                rcv->active = 1;
+                rcv->addr = addr;
 
-        // send a blank message to allow receiverLoop to exit recvfrom()
-        // NOTE: Linux-specific
-        (void)sprintf(buf, "echo \"a\" > /dev/udp/localhost/%d", INBOUND_PORT);
-        if (system(buf)) {
-                printf(PRINTF_MODULE "Error: unable to send blank message to close app, close manually?\n");
+                printf(PRINTF_MODULE "Notice: receiver %s:%hu joined\n",
+                        inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
                 (void)fflush(stdout);
         }
 
-        (void)pthread_join(th_rx, NULL);
-        (void)pthread_join(th_tx, NULL);
+        return rcv;
 }
 
-void network_sendPlayCmd(struct sockaddr_in addr)
+static void expireReceivers(void)
 {
-        queueOutboundMessage(CMD_PLAY "\n", strlen(CMD_PLAY "\n")+1, addr);
+        long long now = timesync_getTimeUs();
+        int i;
+
+        for (i = 0; i < MAX_RECEIVERS; ++i) {
+                if (!receivers[i].active || now < receivers[i].expires)
+                        continue;
+
+                printf(PRINTF_MODULE "Notice: receiver %s:%hu stopped reporting\n",
+                        inet_ntoa(receivers[i].addr.sin_addr), ntohs(receivers[i].addr.sin_port));
+                (void)fflush(stdout);
+                receivers[i].active = 0;
+        }
 }
 
-void network_sendPauseCmd(struct sockaddr_in addr)
+// one parity packet rebuilds one loss per group, so the group has to
+// shrink as losses get more frequent
+static int getGroupSizeForLoss(unsigned int loss)
 {
-        queueOutboundMessage(CMD_PAUSE "\n", strlen(CMD_PAUSE "\n")+1, addr);
+        if (loss == 0)
+                return 0;
+        if (loss < 10)
+                return 16;
+        if (loss < 30)
+                return 8;
+        if (loss < 100)
+                return 4;
+        return 2;
 }
 
-void network_sendSkipCmd(struct sockaddr_in addr)
+// Protects the stream just enough for the worst active receiver
+static void adaptFec(void)
 {
-        queueOutboundMessage(CMD_SKIP "\n", strlen(CMD_SKIP "\n")+1, addr);
+        unsigned int worst = 0;
+        int i, k, curr = fec_getGroupSize();
+
+        if (!fec_auto)
+                return;
+
+        for (i = 0; i < MAX_RECEIVERS; ++i) {
+                if (receivers[i].active && receivers[i].loss > worst)
+                        worst = receivers[i].loss;
+        }
+
+        k = getGroupSizeForLoss(worst);
+
+        // only lower the protection once the loss is well below the threshold,
+        // so a loss rate close to one does not flip the group size every report
+        if (curr && (k == 0 || k > curr))
+                k = getGroupSizeForLoss(worst + worst / 4);
+
+        if (k == curr)
+                return;
+
+        (void)fec_setGroupSize(k);
+
+        printf(PRINTF_MODULE "Notice: worst receiver loss is %u/1000, FEC group size set to %d\n", worst, k);
+        (void)fflush(stdout);
 }
 
-void network_sendAudio(char *buf, unsigned int len)
+static void addToHistory(const char *buf, int len)
 {
-        unsigned int size;
+        unsigned int idx = history_head % HISTORY_SIZE;
+        struct network_audio_hdr hdr;
 
-        // break up bufer into smaller chunks if too large
-        while (len > 0) {
-                size = len > MAX_AUDIO_PACKET_SIZE ? MAX_AUDIO_PACKET_SIZE : len;
+        if (len > HISTORY_PKT_SIZE)
+                return;
+
+        (void)memcpy(history[idx], buf, len);
+        history_len[idx] = len;
+        history_pts[idx] = unpackAudioHeader((const unsigned char *)buf, len, &hdr) ||
+                hdr.type != NETWORK_PKT_AUDIO ? 0 : hdr.pts;
+        ++history_head;
+}
+
+// Finds the oldest packet of the history that is not heard yet
+static unsigned int getBackfillStart(void)
+{
+        long long now = timesync_getTimeUs() - BACKFILL_MARGIN_US;
+        unsigned int oldest = history_head > HISTORY_SIZE ? history_head - HISTORY_SIZE : 0;
+        unsigned int start = history_head;
+        unsigned int idx;
+
+        // parity packets have no time, they go with the audio after them
+        while (start != oldest) {
+                idx = (start - 1) % HISTORY_SIZE;
+                if (history_pts[idx] && history_pts[idx] < now)
+                        break;
+                --start;
+        }
+
+        return start;
+}
+
+static void setUnicastBlocked(int blocked)
+{
+        struct epoll_event ev = { .events = blocked ? EPOLLOUT : 0 };
+
+        ev.data.fd = ucast_fd;
+        (void)epoll_ctl(ep_fd, EPOLL_CTL_MOD, ucast_fd, &ev);
+        ucast_blocked = blocked;
+}
+
+// Tells the receivers whose backfill burst went out that it is complete, so
+// they stop discarding the live stream, even if the burst was empty or lost
+static void sendBackfillEnds(void)
+{
+        unsigned char pkt[NETWORK_AUDIO_HDR_SIZE];
+        struct network_audio_hdr hdr = {0};
+        struct receiver *rcv;
+        int i;
+
+        hdr.magic = NETWORK_AUDIO_MAGIC;
+        hdr.type = NETWORK_PKT_BACKFILL_END | NETWORK_PKT_BACKFILL;
+        hdr.codec = audio_codec;
+        packAudioHeader(&hdr, pkt);
+
+        for (i = 0; i < MAX_RECEIVERS; ++i) {
+                rcv = &receivers[i];
+                if (!rcv->active || !rcv->backfill_marker || (int)(rcv->backfill_end - rcv->cursor) > 0)
+                        continue;
+
+                if (sendto(ucast_fd, pkt, sizeof(pkt), MSG_DONTWAIT,
+                           (struct sockaddr *)&rcv->audio_addr, sizeof(rcv->audio_addr)) < 0 &&
+                    (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        // sent once the socket buffer drains
+                        setUnicastBlocked(1);
+                        return;
+                }
+
+                // if it failed otherwise, the slave stops waiting after BACKFILL_WAIT_US
+                rcv->backfill_marker = 0;
+        }
+}
+
+// Sends the unicast receivers the packets they have not been sent yet
+static void fanOut(void)
+{
+        struct mmsghdr msgs[UCAST_BATCH_SIZE];
+        struct iovec iovs[UCAST_BATCH_SIZE][3];
+        struct receiver *owner[UCAST_BATCH_SIZE];
+        unsigned int next[MAX_RECEIVERS];
+        unsigned int end[MAX_RECEIVERS];
+        struct receiver *rcv;
+        unsigned int idx;
+        int n, i, burst, added, sent;
+
+        if (ucast_blocked)
+                return;
+
+        for (;;) {
+                for (i = 0; i < MAX_RECEIVERS; ++i) {
+                        rcv = &receivers[i];
+                        end[i] = rcv->unicast ? history_head : rcv->backfill_end;
+                        if (!rcv->active || (int)(end[i] - rcv->cursor) <= 0)
+                                continue;
+
+                        // a receiver that fell too far behind loses its oldest packets
+                        if (history_head - rcv->cursor > HISTORY_SIZE) {
+                                rcv->dropped += history_head - rcv->cursor - HISTORY_SIZE;
+                                rcv->cursor = history_head - HISTORY_SIZE;
+                        }
+
+                        next[i] = rcv->cursor;
+                }
+
+                // receivers take turns of UCAST_BURST packets to fill the batch
+                n = 0;
+                do {
+                        added = 0;
+                        for (i = 0; i < MAX_RECEIVERS && n < UCAST_BATCH_SIZE; ++i) {
+                                rcv = &receivers[i];
+                                if (!rcv->active || (int)(end[i] - rcv->cursor) <= 0)
+                                        continue;
+
+                                for (burst = 0; burst < UCAST_BURST && n < UCAST_BATCH_SIZE &&
+                                     next[i] != end[i]; ++burst, ++n) {
+                                        idx = next[i] % HISTORY_SIZE;
+
+                                        (void)memset(&msgs[n], 0, sizeof(msgs[n]));
+                                        msgs[n].msg_hdr.msg_name = &rcv->audio_addr;
+                                        msgs[n].msg_hdr.msg_namelen = sizeof(rcv->audio_addr);
+                                        msgs[n].msg_hdr.msg_iov = iovs[n];
+                                        msgs[n].msg_hdr.msg_iovlen = 1;
+
+                                        iovs[n][0].iov_base = history[idx];
+                                        iovs[n][0].iov_len = history_len[idx];
+
+                                        // swap in the type byte that marks backfill
+                                        if ((int)(rcv->backfill_end - next[i]) > 0) {
+                                                iovs[n][0].iov_len = 1;
+                                                iovs[n][1].iov_base = (void *)&backfill_types[(unsigned char)history[idx][1]];
+                                                iovs[n][1].iov_len = 1;
+                                                iovs[n][2].iov_base = history[idx] + 2;
+                                                iovs[n][2].iov_len = history_len[idx] - 2;
+                                                msgs[n].msg_hdr.msg_iovlen = 3;
+                                        }
+
+                                        ++next[i];
+                                        owner[n] = rcv;
+                                        ++added;
+                                }
+                        }
+                } while (added && n < UCAST_BATCH_SIZE);
+
+                if (!n) {
+                        sendBackfillEnds();
+                        return;
+                }
+
+                sent = sendmmsg(ucast_fd, msgs, n, MSG_DONTWAIT);
+                if (sent < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                // carry on once the socket buffer drains
+                                setUnicastBlocked(1);
+                                return;
+                        }
+
+                        printf(PRINTF_MODULE "Warning: unicast to %s failed (%s)\n",
+                                inet_ntoa(owner[0]->audio_addr.sin_addr), strerror(errno));
+                        (void)fflush(stdout);
+
+                        // skip the packet, or it would fail again
+                        ++owner[0]->cursor;
+                        ++owner[0]->dropped;
+                        continue;
+                }
+
+                // packets of one receiver are batched in order, so the ones
+                // sent always come first
+                for (i = 0; i < sent; ++i) {
+                        ++owner[i]->cursor;
+                        ++owner[i]->sent;
+                }
+        }
+}
+
+/*
+ * Command handlers, see cmd_table
+ */
+struct cmd_args {
+        struct sockaddr_in src;
+        long long t_recv;
+        struct status_since *since;     // status version the reply is relative to
+        int argc;
+        long long num[CMD_MAX_ARGS];    // value of each 'i' argument
+        char *str[CMD_MAX_ARGS];        // value of each 's' and 'r' argument
+};
+
+static int parseInt(const char *s, long long *val)
+{
+        char *end;
+
+        errno = 0;
+        *val = strtoll(s, &end, 10);
+        if (end == s || *end != '\0' || errno)
+                return EINVAL;
+
+        return 0;
+}
+
+static int cmdAddSong(struct cmd_args *args)
+{
+        return control_addSong(args->str[0]);
+}
+
+// cachesize=<MB> sets how much disk the cached songs may use
+static int cmdCacheSize(struct cmd_args *args)
+{
+        if (args->num[0] < 0 || args->num[0] > 1024 * 1024)
+                return EINVAL;
+
+        return cache_setBudget(args->num[0] * 1024 * 1024);
+}
+
+static int cmdCodec(struct cmd_args *args)
+{
+        enum codec_type codec = codec_fromName(args->str[0]);
+
+        if (codec == CODEC_UNKNOWN)
+                return EINVAL;
+
+        audio_codec = codec;
+        return 0;
+}
+
+// dlworkers=<n> sets how many songs are downloaded at the same time
+static int cmdDlWorkers(struct cmd_args *args)
+{
+        if (args->num[0] < 1 || args->num[0] > DOWNLOADER_MAX_WORKERS)
+                return EINVAL;
+
+        return downloader_setWorkers(args->num[0]);
+}
+
+// dlstats replies with how the download jobs went:
+// <jobs>,<failed>,<killed>,<average ms>,<last ms>,<last exit status>
+static int cmdDlStats(struct cmd_args *args)
+{
+        char buf[BUFFER_SIZE] = {0};
+        struct supervisor_stats stats;
+        int len;
+
+        supervisor_getStats(&stats);
+        len = sprintf(buf, "dlstats=%u,%u,%u,%lld,%lld,%d\n", stats.jobs, stats.failed,
+                stats.killed, stats.jobs ? stats.total_us / stats.jobs / 1000 : 0,
+                stats.last_us / 1000, stats.last_status);
+        queueOutboundMessage(buf, len, args->src);
+
+        return NO_REPLY;
+}
+
+static int cmdError(struct cmd_args *args)
+{
+        // never answer an error, or two devices can keep replying to each other
+        printf(PRINTF_MODULE "Warning: peer reported error=%s\n", args->str[0]);
+        (void)fflush(stdout);
+        return NO_REPLY;
+}
+
+// fec=<group size> or fec=auto, to follow the loss of the receivers
+static int cmdFec(struct cmd_args *args)
+{
+        long long k;
+
+        if (!strcmp(args->str[0], "auto")) {
+                fec_auto = 1;
+                expireReceivers();
+                adaptFec();
+                return 0;
+        }
+
+        if (parseInt(args->str[0], &k) || k < 0 || k > FEC_MAX_GROUP_SIZE)
+                return EINVAL;
+
+        fec_auto = 0;
+        return fec_setGroupSize(k) ? EINVAL : 0;
+}
+
+// fixture=<latency ms>,<kB/s>,<song s> sets how the fixture backend makes up
+// songs, e.g. queued as addsong=fixture.1
+static int cmdFixture(struct cmd_args *args)
+{
+        if (args->num[1] <= 0 || args->num[1] > INT32_MAX || args->num[2] > INT32_MAX)
+                return EINVAL;
+
+        return downloader_setFixture(args->num[0], args->num[1] * 1000, args->num[2] * 1000);
+}
+
+static int cmdGetMcast(struct cmd_args *args)
+{
+        return SEND_MCAST_IP;
+}
+
+// getqueue=<offset>,<limit> lists part of the queue, tagged with its version
+static int cmdGetQueue(struct cmd_args *args)
+{
+        char buf[BUFFER_SIZE] = {0};
+        char *c = buf;
+        long long offset = args->num[0];
+        long long limit = args->num[1];
+        int i;
+
+        if (offset < 0 || limit <= 0)
+                return EINVAL;
+
+        if (limit > QUEUE_MAX_PAGE)
+                limit = QUEUE_MAX_PAGE;
+
+        refreshStatus();
+
+        if (offset > status_queue_len)
+                offset = status_queue_len;
+
+        c += sprintf(c, "queuepage=%u,%d,%lld,", status_queue_version, status_queue_len, offset);
+        for (i = offset; i < status_queue_len && i < offset + limit; ++i)
+                c += sprintf(c, "%s,", status_queue[i]);
+        c += sprintf(c, "\n");
+
+        queueOutboundMessage(buf, (c-buf), args->src);
+
+        return NO_REPLY;
+}
+
+// lead=<ms> sets how far ahead of its own playout the master sends audio
+static int cmdLead(struct cmd_args *args)
+{
+        if (args->num[0] < 0 || args->num[0] > CONTROL_MAX_LEAD_US / 1000)
+                return EINVAL;
+
+        return control_setLead(args->num[0] * 1000) ? EINVAL : 0;
+}
+
+static int cmdMcast(struct cmd_args *args)
+{
+        if (args->num[0] < 0 || args->num[0] > UINT32_MAX ||
+            args->num[1] < 0 || args->num[1] > UINT16_MAX)
+                return EINVAL;
+
+        // extract multicast group IP, sent in network byte order
+        mcast_addr.sin_addr.s_addr = args->num[0];
+        mcast_addr.sin_port = args->num[1];
+
+        // only listen on the port, the master sends the audio straight here
+        if (mcast_unicast)
+                mcast_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        // the event loop joins the group, or moves to it if this
+        // device was already a slave of another one
+        control_setMode(CONTROL_MODE_SLAVE);
+
+        printf(PRINTF_MODULE "Notice: setting device to slave mode\n");
+        (void)fflush(stdout);
+
+        // the master is not interested in this device's status
+        return NO_REPLY;
+}
+
+// mode=master[,<multicast ip>[:<port>]] or mode=slave,<master ip>[:<port>]
+static int cmdMode(struct cmd_args *args)
+{
+        in_addr_t addr = args->argc > 1 ? inet_addr(args->str[1]) : INADDR_NONE;
+        long long port = args->argc > 2 ? args->num[2] : 0;
+        struct sockaddr_in sa;
+
+        if (port < 0 || port > UINT16_MAX)
+                return EINVAL;
+
+        // a master without an address keeps multicasting to its current group
+        if (!strcmp(args->str[0], "master") && args->argc == 1) {
+                // a slave receiving by unicast had no group
+                if (mcast_addr.sin_addr.s_addr == htonl(INADDR_ANY))
+                        mcast_addr.sin_addr.s_addr = inet_addr(DEFAULT_MCAST_IP);
+
+                control_setMode(CONTROL_MODE_MASTER);
+
+                printf(PRINTF_MODULE "Notice: setting device to master mode\n");
+                (void)fflush(stdout);
+                return 0;
+        }
+
+        if (addr == INADDR_NONE) {
+                printf(PRINTF_MODULE "Warning: invalid address provided for %s mode\n", args->str[0]);
+                (void)fflush(stdout);
+                return EADDRNOTAVAIL;
+        }
+
+        if (!strcmp(args->str[0], "master")) {
+                mcast_addr.sin_port = htons(port ? port : MCAST_PORT);
+                mcast_addr.sin_addr.s_addr = addr;
+
+                // the event loop leaves the multicast group on its own
+                control_setMode(CONTROL_MODE_MASTER);
+
+                printf(PRINTF_MODULE "Notice: setting device to master mode\n");
+                (void)fflush(stdout);
+        } else if (!strcmp(args->str[0], "slave")) {
+                memset(&sa, 0, sizeof(sa));
+                sa.sin_family = AF_INET;
+                sa.sin_port = htons(port ? port : INBOUND_PORT);
+                sa.sin_addr.s_addr = addr;
+
+                // remember the master for time synchronization
+                master_addr = sa;
+                timesync_reset();
+
+                // send request to master to obtain the multicast IP
+                queueOutboundMessage(CMD_GET_MCAST "\n", strlen(CMD_GET_MCAST "\n") + 1, sa);
+
+                // NOTE: device isn't changed to slave mode here,
+                // must get multicast IP first
+        } else {
+                return EINVAL;
+        }
+
+        return 0;
+}
+
+static int cmdPause(struct cmd_args *args)
+{
+        control_pauseAudio();
+        return 0;
+}
+
+// Reads the optional <epoch>,<version> of the status the client already has
+static int parseSince(struct cmd_args *args)
+{
+        if (args->argc < 2)
+                return 0;
+
+        if (args->num[0] < 0 || args->num[0] > UINT32_MAX ||
+            args->num[1] < 0 || args->num[1] > UINT32_MAX)
+                return EINVAL;
+
+        args->since->epoch = args->num[0];
+        args->since->version = args->num[1];
+
+        return 0;
+}
+
+// ping[=<epoch>,<version>] asks for the status changes since that version
+static int cmdPing(struct cmd_args *args)
+{
+        // a status message is returned on valid commands
+        return parseSince(args);
+}
+
+static int cmdPlay(struct cmd_args *args)
+{
+        control_playAudio();
+        return 0;
+}
+
+// prebuffer=<ms> sets how much of a song is downloaded before it can play
+static int cmdPrebuffer(struct cmd_args *args)
+{
+        if (args->num[0] < 0 || args->num[0] > CONTROL_MAX_PREBUFFER_US / 1000)
+                return EINVAL;
+
+        return control_setPrebuffer(args->num[0] * 1000) ? EINVAL : 0;
+}
+
+// prefetch replies with how far ahead songs are downloaded:
+// <songs fetched>,<startup ms>,<ms of audio downloaded per s>,<average song s>,
+// <starvations>,<total ms waited>,<last ms waited>
+static int cmdPrefetch(struct cmd_args *args)
+{
+        char buf[BUFFER_SIZE] = {0};
+        struct prefetch_stats stats;
+        int len;
+
+        prefetch_getStats(&stats);
+        len = sprintf(buf, "prefetch=%d,%lld,%d,%lld,%u,%lld,%lld\n", stats.depth,
+                stats.startup_us / 1000, stats.speed, stats.song_us / 1000000,
+                stats.starvations, stats.starved_us / 1000, stats.last_starved_us / 1000);
+        queueOutboundMessage(buf, len, args->src);
+
+        return NO_REPLY;
+}
+
+static int cmdRcvBuf(struct cmd_args *args)
+{
+        if (args->num[0] <= 0 || args->num[0] > INT32_MAX)
+                return EINVAL;
+
+        mcast_rcvbuf = args->num[0];
+        if (mcast_fd >= 0)
+                setReceiveBuffer(mcast_fd, mcast_rcvbuf);
+
+        return 0;
+}
+
+// lists the receivers that reported recently, in as many datagrams as needed
+static int cmdReceivers(struct cmd_args *args)
+{
+        char buf[BUFFER_SIZE] = {0};
+        char *c = buf;
+        struct receiver *rcv;
+        int i, num = 0;
+
+        expireReceivers();
+
+        for (i = 0; i < MAX_RECEIVERS; ++i)
+                num += receivers[i].active;
+
+        c += sprintf(c, "receivers=%d\n", num);
+
+        for (i = 0; i < MAX_RECEIVERS; ++i) {
+                rcv = &receivers[i];
+                if (!rcv->active)
+                        continue;
+
+                if ((c-buf) >= BUFFER_SIZE - RECEIVER_LINE_SIZE) {
+                        queueOutboundMessage(buf, (c-buf), args->src);
+                        (void)memset(buf, 0, BUFFER_SIZE);
+                        c = buf;
+                }
+
+                c += sprintf(c, "receiver=%s:%hu,%u,%u,%u,%u,%u,%lld,%lld,%u,%u,%d,%u,%u\n",
+                        inet_ntoa(rcv->addr.sin_addr), ntohs(rcv->addr.sin_port),
+                        rcv->received, rcv->lost, rcv->recovered, rcv->concealed,
+                        rcv->overflows, rcv->buffered_us, rcv->offset_us, rcv->xruns,
+                        rcv->loss, rcv->unicast, rcv->sent, rcv->dropped);
+        }
+
+        queueOutboundMessage(buf, (c-buf), args->src);
+
+        return NO_REPLY;
+}
+
+// rescan looks for tracks added to, changed in or removed from the library
+static int cmdRescan(struct cmd_args *args)
+{
+        // a rescan that is already running will find them too
+        int err = library_rescan();
+
+        return err == EBUSY ? 0 : err;
+}
+
+static int cmdRepeat(struct cmd_args *args)
+{
+        if (args->num[0] != 0 && args->num[0] != 1)
+                return EINVAL;
+
+        control_setRepeatStatus(args->num[0]);
+        return 0;
+}
+
+static int cmdRemoveSong(struct cmd_args *args)
+{
+        if (args->num[1] < CONTROL_RMSONG_FIRST || args->num[1] > INT32_MAX)
+                return EINVAL;
+
+        control_removeSong(args->str[0], args->num[1]);
+        return 0;
+}
+
+// search=<term> replies with the tracks of the library that match:
+// search=<matches>,<listed> followed by a line per track listed,
+// track=<ID>,<ms>,<format>,<artist>\t<title>
+static int cmdSearch(struct cmd_args *args)
+{
+        char buf[BUFFER_SIZE] = {0};
+        char *c = buf;
+        struct library_track tracks[SEARCH_MAX_RESULTS];
+        int i, n, total;
+
+        n = library_search(args->str[0], tracks, SEARCH_MAX_RESULTS, &total);
+        if (n < 0)
+                return EINVAL;
+
+        c += sprintf(c, "search=%d,%d\n", total, n);
+
+        for (i = 0; i < n; ++i) {
+                if ((c-buf) >= BUFFER_SIZE - SEARCH_LINE_SIZE) {
+                        queueOutboundMessage(buf, (c-buf), args->src);
+                        (void)memset(buf, 0, BUFFER_SIZE);
+                        c = buf;
+                }
+
+                c += sprintf(c, "track=%u,%u,%s,%s\t%s\n", tracks[i].id, tracks[i].duration_ms,
+                        tracks[i].format, tracks[i].artist, tracks[i].title);
+        }
+
+        queueOutboundMessage(buf, (c-buf), args->src);
+
+        return NO_REPLY;
+}
+
+// subscribe[=<epoch>,<version>] starts or renews a lease on status pushes
+static int cmdSubscribe(struct cmd_args *args)
+{
+        struct subscriber *sub;
+        int i;
+
+        if (parseSince(args))
+                return EINVAL;
+
+        sub = findSubscriber(args->src);
+        for (i = 0; !sub && i < MAX_SUBSCRIBERS; ++i) {
+                if (subscribers[i].active)
+                        continue;
+
+                sub = &subscribers[i];
+                sub->active = 1;
+                sub->addr = args->src;
+
+                if (++num_subscribers == 1)
+                        armTimer(tick_fd, SUBSCRIBE_TICK_US, SUBSCRIBE_TICK_US);
+
+                printf(PRINTF_MODULE "Notice: %s:%hu subscribed to status updates\n",
+                        inet_ntoa(args->src.sin_addr), ntohs(args->src.sin_port));
+                (void)fflush(stdout);
+        }
+
+        if (!sub)
+                return EBUSY;
+
+        sub->expires = timesync_getTimeUs() + SUBSCRIBE_LEASE_US;
+
+        // reply here, so the subscriber's version matches what it was sent
+        (void)queueSystemStatusMessage(sub->addr, args->since);
+        sub->version = status_version;
+
+        return NO_REPLY;
+}
+
+// backfill=<port> sends the packets of the history that are not heard yet
+// to that port of the sender, so a joining slave can start playing at once
+static int cmdBackfill(struct cmd_args *args)
+{
+        struct receiver *rcv;
+
+        if (control_getMode() != CONTROL_MODE_MASTER)
+                return NO_REPLY;
+
+        if (args->num[0] <= 0 || args->num[0] > UINT16_MAX)
+                return NO_REPLY;
+
+        expireReceivers();
+
+        rcv = addReceiver(args->src);
+        if (!rcv)
+                return NO_REPLY;
+
+        rcv->audio_addr = args->src;
+        rcv->audio_addr.sin_port = htons(args->num[0]);
+        rcv->cursor = getBackfillStart();
+        rcv->backfill_end = history_head;
+        rcv->backfill_marker = 1;
+        rcv->expires = timesync_getTimeUs() + RECEIVER_TIMEOUT_US;
+
+        printf(PRINTF_MODULE "Notice: backfilling %s:%lld with %u packets\n",
+                inet_ntoa(args->src.sin_addr), args->num[0], rcv->backfill_end - rcv->cursor);
+        (void)fflush(stdout);
+
+        // the burst and its end marker go out before any newer live packet
+        fanOut();
+
+        return NO_REPLY;
+}
+
+// transport=multicast|unicast picks how the audio reaches this device as a
+// slave, it applies from the next mode=slave
+static int cmdTransport(struct cmd_args *args)
+{
+        if (!strcmp(args->str[0], "multicast"))
+                mcast_unicast = 0;
+        else if (!strcmp(args->str[0], "unicast"))
+                mcast_unicast = 1;
+        else
+                return EINVAL;
+
+        return 0;
+}
+
+// unicast=<port> asks the master to send its audio to that port of the
+// sender, the request lasts as long as a receiver report
+static int cmdUnicast(struct cmd_args *args)
+{
+        struct receiver *rcv;
+
+        if (control_getMode() != CONTROL_MODE_MASTER)
+                return NO_REPLY;
+
+        if (args->num[0] <= 0 || args->num[0] > UINT16_MAX)
+                return NO_REPLY;
+
+        expireReceivers();
+
+        rcv = addReceiver(args->src);
+        if (!rcv)
+                return NO_REPLY;
+
+        if (!rcv->unicast || ntohs(rcv->audio_addr.sin_port) != args->num[0]) {
+                rcv->unicast = 1;
+                rcv->audio_addr = args->src;
+                rcv->audio_addr.sin_port = htons(args->num[0]);
+
+                // carry on from a backfill, if there is one
+                if ((int)(rcv->backfill_end - rcv->cursor) <= 0)
+                        rcv->cursor = history_head;
+
+                printf(PRINTF_MODULE "Notice: sending audio to %s:%lld by unicast\n",
+                        inet_ntoa(args->src.sin_addr), args->num[0]);
+                (void)fflush(stdout);
+        }
+
+        rcv->expires = timesync_getTimeUs() + RECEIVER_TIMEOUT_US;
+
+        return NO_REPLY;
+}
+
+static int cmdUnsubscribe(struct cmd_args *args)
+{
+        struct subscriber *sub = findSubscriber(args->src);
+
+        if (sub)
+                removeSubscriber(sub);
+
+        return NO_REPLY;
+}
+
+// report=<received>,<lost>,<recovered>,<concealed>,<overflows>,<buffered us>,<offset us>,<xruns>
+static int cmdReport(struct cmd_args *args)
+{
+        struct receiver *rcv;
+        unsigned int received, lost, window;
+        int i;
+
+        if (control_getMode() != CONTROL_MODE_MASTER)
+                return NO_REPLY;
+
+        // every field but the clock offset is a counter or a duration
+        for (i = 0; i < args->argc; ++i) {
+                if (i != 6 && (args->num[i] < 0 || args->num[i] > UINT32_MAX))
+                        return NO_REPLY;
+        }
+
+        expireReceivers();
+
+        rcv = addReceiver(args->src);
+
+        // reports are never answered, a full registry just misses this one
+        if (!rcv)
+                return NO_REPLY;
+
+        received = args->num[0];
+        lost = args->num[1];
+
+        // loss since the previous report, unless the slave started over
+        if (received >= rcv->received && lost >= rcv->lost) {
+                received -= rcv->received;
+                lost -= rcv->lost;
+        }
+
+        window = received + lost ? (unsigned long long)lost * 1000 / (received + lost) : 0;
+
+        // react to new losses at once, but forget them gradually
+        rcv->loss = window > rcv->loss ? window : (rcv->loss * 3 + window) / 4;
+
+        rcv->received = args->num[0];
+        rcv->lost = args->num[1];
+        rcv->recovered = args->num[2];
+        rcv->concealed = args->num[3];
+        rcv->overflows = args->num[4];
+        rcv->buffered_us = args->num[5];
+        rcv->offset_us = args->num[6];
+        rcv->xruns = args->num[7];
+        rcv->expires = timesync_getTimeUs() + RECEIVER_TIMEOUT_US;
+
+        adaptFec();
+
+        return NO_REPLY;
+}
+
+static int cmdSkip(struct cmd_args *args)
+{
+        control_skipSong();
+        return 0;
+}
+
+static int cmdTimeReq(struct cmd_args *args)
+{
+        // reply immediately, a queued status message would only add delay
+        char out_buf[CMD_TIME_BUF_SIZE] = {0};
+
+        sprintf(out_buf, CMD_TIME_RESP "\n", args->num[0], args->t_recv, timesync_getTimeUs());
+        queueOutboundMessage(out_buf, strlen(out_buf) + 1, args->src);
+        return NO_REPLY;
+}
+
+static int cmdTimeResp(struct cmd_args *args)
+{
+        timesync_addSample(args->num[0], args->num[1], args->num[2], args->t_recv);
+        return NO_REPLY;
+}
+
+static int cmdVol(struct cmd_args *args)
+{
+        if (args->num[0] < AUDIO_VOLUME_MIN || args->num[0] > AUDIO_VOLUME_MAX)
+                return EINVAL;
+
+        audio_setVolume(args->num[0]);
+        return 0;
+}
+
+static int cmdVolDown(struct cmd_args *args)
+{
+        unsigned int vol = audio_getVolume();
+
+        // the volume is unsigned, going below the minimum would wrap to the maximum
+        audio_setVolume(vol > AUDIO_VOLUME_MIN + VOL_DIFF ? vol - VOL_DIFF : AUDIO_VOLUME_MIN);
+        return 0;
+}
+
+static int cmdVolUp(struct cmd_args *args)
+{
+        audio_setVolume(audio_getVolume() + VOL_DIFF);
+        return 0;
+}
+
+/*
+ * Argument types of a command, one character per argument:
+ *   i - integer
+ *   s - string up to the next separator
+ *   r - rest of the command, separators included
+ * Arguments after a '?' are optional.
+ */
+struct cmd_entry {
+        const char *keyword;
+        const char *args;
+        int (*handler)(struct cmd_args *args);
+};
+
+// NOTE: must be kept sorted by keyword, it is searched with bsearch()
+static const struct cmd_entry cmd_table[] = {
+        { "addsong",    "s",    cmdAddSong },
+        { "backfill",   "i",    cmdBackfill },
+        { "cachesize",  "i",    cmdCacheSize },
+        { "codec",      "s",    cmdCodec },
+        { "dlstats",    "",     cmdDlStats },
+        { "dlworkers",  "i",    cmdDlWorkers },
+        { "error",      "r",    cmdError },
+        { "fec",        "s",    cmdFec },
+        { "fixture",    "iii",  cmdFixture },
+        { "getmcast",   "",     cmdGetMcast },
+        { "getqueue",   "ii",   cmdGetQueue },
+        { "lead",       "i",    cmdLead },
+        { "mcast",      "ii",   cmdMcast },
+        { "mode",       "s?si", cmdMode },
+        { "pause",      "",     cmdPause },
+        { "ping",       "?ii",  cmdPing },
+        { "play",       "",     cmdPlay },
+        { "prebuffer",  "i",    cmdPrebuffer },
+        { "prefetch",   "",     cmdPrefetch },
+        { "rcvbuf",     "i",    cmdRcvBuf },
+        { "receivers",  "",     cmdReceivers },
+        { "repeat",     "i",    cmdRepeat },
+        { "report",     "iiiiiiii", cmdReport },
+        { "rescan",     "",     cmdRescan },
+        { "rmsong",     "si",   cmdRemoveSong },
+        { "search",     "r",    cmdSearch },
+        { "skip",       "",     cmdSkip },
+        { "statusping", "",     cmdPing },      // sent by older web UIs
+        { "subscribe",  "?ii",  cmdSubscribe },
+        { "timereq",    "i",    cmdTimeReq },
+        { "timeresp",   "iii",  cmdTimeResp },
+        { "transport",  "s",    cmdTransport },
+        { "unicast",    "i",    cmdUnicast },
+        { "unsubscribe", "",    cmdUnsubscribe },
+        { "vol",        "i",    cmdVol },
+        { "voldown",    "",     cmdVolDown },
+        { "volup",      "",     cmdVolUp },
+};
+
+#define CMD_TABLE_SIZE  (sizeof(cmd_table) / sizeof(cmd_table[0]))
+
+static int compareCmdEntry(const void *key, const void *entry)
+{
+        return strcmp(key, ((const struct cmd_entry *)entry)->keyword);
+}
+
+// Splits the arguments of a command in place and converts them to their types
+static int parseArgs(const char *types, char *c, struct cmd_args *args)
+{
+        int optional = 0;
+        char *end;
+
+        args->argc = 0;
+
+        for (; *types; ++types) {
+                if (*types == '?') {
+                        optional = 1;
+                        continue;
+                }
+
+                if (!c)
+                        return optional ? 0 : EINVAL;
+
+                if (*types == 'r') {
+                        end = NULL;
+                } else if ((end = strpbrk(c, CMD_ARG_SEPARATORS))) {
+                        *end++ = '\0';
+                }
+
+                if (*types == 'i') {
+                        if (parseInt(c, &args->num[args->argc]))
+                                return EINVAL;
+                } else if (*c || *types == 'r') {
+                        args->str[args->argc] = c;
+                } else {
+                        return EINVAL;
+                }
+
+                ++args->argc;
+                c = end;
+        }
+
+        // too many arguments
+        return c ? EINVAL : 0;
+}
+
+static int processCmd(char *buf, struct sockaddr_in src, long long t_recv,
+        struct status_since *since)
+{
+        const struct cmd_entry *cmd;
+        struct cmd_args args;
+        char *c;
+
+        // split the keyword from its arguments
+        if ((c = strchr(buf, CMD_ARG_START)))
+                *c++ = '\0';
+
+        cmd = bsearch(buf, cmd_table, CMD_TABLE_SIZE, sizeof(cmd_table[0]), compareCmdEntry);
+        if (!cmd) {
+                printf(PRINTF_MODULE "Warning: invalid command received (\"%s\")\n", buf);
+                (void)fflush(stdout);
+                return EINVAL;
+        }
+
+        if (parseArgs(cmd->args, c, &args)) {
+                printf(PRINTF_MODULE "Warning: invalid arguments for command \"%s\"\n", buf);
+                (void)fflush(stdout);
+                return EINVAL;
+        }
+
+        args.src = src;
+        args.t_recv = t_recv;
+        args.since = since;
+
+        return cmd->handler(&args);
+}
+
+// Commands repeated every few seconds by every peer are not logged
+static int isPeriodicCmd(const char *cmd)
+{
+        return strstr(cmd, CMD_PING) ||
+                !strncmp(cmd, CMD_TIME_PREFIX, strlen(CMD_TIME_PREFIX)) ||
+                !strncmp(cmd, CMD_REPORT_PREFIX, strlen(CMD_REPORT_PREFIX)) ||
+                !strncmp(cmd, CMD_UNICAST_PREFIX, strlen(CMD_UNICAST_PREFIX));
+}
+
+static void processMessage(char *buf, struct sockaddr_in sa, long long t_recv)
+{
+        char *cmd, *c;
+        int err = 0;
+        struct status_since since = { 0, 0 };
+
+        cmd = buf;
+        c = buf;
+
+        while ((c-buf) < BUFFER_SIZE) {
+                // the last command of a message may not be newline terminated
+                if (*c == '\n' || *c == '\0') {
+                        int last = (*c == '\0');
+
+                        *c = '\0';
+
+                        if (*cmd) {
+                                if (!isPeriodicCmd(cmd)) {
+                                        printf(PRINTF_MODULE "Notice: processing command: \"%s\"\n", cmd);
+                                        (void)fflush(stdout);
+                                }
+
+                                if ((err = processCmd(cmd, sa, t_recv, &since)))
+                                        break;
+                        }
+
+                        if (last)
+                                break;
+                        ++c;
+                        cmd = c;
+                } else {
+                        ++c;
+                }
+        }
+
+        // error handling
+        if (err == SEND_MCAST_IP) {
+                // not actually an error, but we don't need to send the
+                // system status message, so we can treat it like one
+                char out_buf[CMD_MCAST_BUF_SIZE] = {0};
+
+                sprintf(out_buf, CMD_MCAST "\n",
+                        mcast_addr.sin_addr.s_addr,
+                        mcast_addr.sin_port);
+
+                // send the broadcast IP of this device back to the slave
+                queueOutboundMessage(out_buf, strlen(out_buf) + 1, sa);
+        } else if (err == EADDRNOTAVAIL) {
+                queueOutboundMessage("error=\"invalid address provided\"\n",
+                        strlen("error=\"invalid address provided\"\n") + 1, sa);
+        } else if (err == EINVAL) {
+                queueOutboundMessage("error=\"invalid command\"\n",
+                        strlen("error=\"invalid command\"\n") + 1, sa);
+        } else if (err == NO_REPLY) {
+                // response was already queued by the command, if any
+        } else if (err == ENOENT) {
+                queueOutboundMessage("error=\"no such track\"\n",
+                        strlen("error=\"no such track\"\n") + 1, sa);
+        } else if (err == EBUSY) {
+                queueOutboundMessage("error=\"too many subscribers\"\n",
+                        strlen("error=\"too many subscribers\"\n") + 1, sa);
+        } else if (err == ENOMEM) {
+                // don't send anything, otherwise the slave and master will keep
+                // sending error messages back and forth between each other
+        } else {
+                (void)queueSystemStatusMessage(sa, &since);
+        }
+
+        return;
+}
+
+static void leaveMcast(void)
+{
+        if (mcast_fd < 0)
+                return;
+
+        (void)epoll_ctl(ep_fd, EPOLL_CTL_DEL, mcast_fd, NULL);
+        if (mcast_mreq.imr_multiaddr.s_addr != htonl(INADDR_ANY))
+                (void)setsockopt(mcast_fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mcast_mreq, sizeof(mcast_mreq));
+        close(mcast_fd);
+        mcast_fd = -1;
+
+        // stop synchronizing with the master
+        armTimer(timer_fd, 0, 0);
+
+        printf(PRINTF_MODULE "Notice: stopped multicast receiver\n");
+        (void)fflush(stdout);
+}
+
+static void joinMcast(void)
+{
+        struct epoll_event ev = { .events = EPOLLIN };
+        int fd;
+        int one = 1;
+
+        if (getSocketFD(ntohs(mcast_addr.sin_port), &fd)) {
+                printf(PRINTF_MODULE "Error: unable to get socket file descriptor for multicast\n");
+                (void)fflush(stdout);
+                if (fd >= 0)
+                        close(fd);
+                return;
+        }
+
+        mcast_mreq.imr_multiaddr.s_addr = mcast_addr.sin_addr.s_addr;
+        mcast_mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+        if (mcast_mreq.imr_multiaddr.s_addr != htonl(INADDR_ANY) &&
+            setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mcast_mreq, sizeof(mcast_mreq)) < 0) {
+                printf(PRINTF_MODULE "Error: unable to join multicast group (%s)\n", strerror(errno));
+                (void)fflush(stdout);
+                close(fd);
+                return;
+        }
+
+        setReceiveBuffer(fd, mcast_rcvbuf);
+
+        if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0) {
+                printf(PRINTF_MODULE "Warning: socket overflows will not be counted (%s)\n", strerror(errno));
+                (void)fflush(stdout);
+        }
+
+        ev.data.fd = fd;
+        if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                printf(PRINTF_MODULE "Error: unable to watch multicast socket (%s)\n", strerror(errno));
+                (void)fflush(stdout);
+                if (mcast_mreq.imr_multiaddr.s_addr != htonl(INADDR_ANY))
+                        (void)setsockopt(fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mcast_mreq, sizeof(mcast_mreq));
+                close(fd);
+                return;
+        }
+
+        mcast_fd = fd;
+        mcast_joined_port = mcast_addr.sin_port;
+        mcast_overflows = 0;
+        fec_resetDecoder();
+
+        // exchange timestamps with the master right away
+        num_timereq = 0;
+        armTimer(timer_fd, 1, TIMESYNC_FAST_INTERVAL_US);
+
+        // the burst comes first, so a new lease does not start at the live stream
+        sendBackfillRequest();
+        if (mcast_mreq.imr_multiaddr.s_addr == htonl(INADDR_ANY))
+                sendUnicastRequest();
+
+        if (mcast_mreq.imr_multiaddr.s_addr == htonl(INADDR_ANY))
+                printf(PRINTF_MODULE "Notice: starting unicast receiver at port %hu\n",
+                        ntohs(mcast_addr.sin_port));
+        else
+                printf(PRINTF_MODULE "Notice: starting multicast receiver at %u:%hu\n",
+                        ntohl(mcast_addr.sin_addr.s_addr), ntohs(mcast_addr.sin_port));
+        (void)fflush(stdout);
+}
+
+// Joins or leaves the multicast group to follow the mode of the device
+static void updateMcast(void)
+{
+        int slave = control_getMode() == CONTROL_MODE_SLAVE;
+
+        if (mcast_fd >= 0 && (!slave ||
+            mcast_mreq.imr_multiaddr.s_addr != mcast_addr.sin_addr.s_addr ||
+            mcast_joined_port != mcast_addr.sin_port))
+                leaveMcast();
+
+        if (mcast_fd < 0 && slave)
+                joinMcast();
+}
+
+static void onTimer(void)
+{
+        unsigned long long expirations;
+
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+                return;
+
+        // keep the estimate of the master's clock up to date
+        sendTimeRequest();
+        if (++num_timereq == TIMESYNC_NUM_FAST)
+                armTimer(timer_fd, TIMESYNC_INTERVAL_US, TIMESYNC_INTERVAL_US);
+        else if (num_timereq > TIMESYNC_NUM_FAST) {
+                sendReceiverReport();
+
+                if (mcast_mreq.imr_multiaddr.s_addr == htonl(INADDR_ANY))
+                        sendUnicastRequest();
+        }
+}
+
+static void onTick(void)
+{
+        unsigned long long expirations;
+        long long now = timesync_getTimeUs();
+        int i;
+
+        if (read(tick_fd, &expirations, sizeof(expirations)) < 0)
+                return;
+
+        for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+                if (!subscribers[i].active)
+                        continue;
+
+                if (now >= subscribers[i].expires) {
+                        printf(PRINTF_MODULE "Notice: status subscription of %s:%hu expired\n",
+                                inet_ntoa(subscribers[i].addr.sin_addr), ntohs(subscribers[i].addr.sin_port));
+                        (void)fflush(stdout);
+                        removeSubscriber(&subscribers[i]);
+                } else if (control_getPlayStatus()) {
+                        // progress moves on while playing
+                        sendStatusToSubscriber(&subscribers[i]);
+                }
+        }
+}
+
+static void onCommand(void)
+{
+        struct sockaddr_in sa;
+        char buf[BUFFER_SIZE];
+        int bytes_recv;
+        socklen_t sa_len;
+        long long t_recv;
+
+        for (;;) {
+                sa_len = sizeof(sa);
+                bytes_recv = recvfrom(cmd_fd, buf, BUFFER_SIZE-1, MSG_DONTWAIT,
+                        (struct sockaddr *)&sa, &sa_len);
+                t_recv = timesync_getTimeUs();
+
+                if (bytes_recv < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                printf(PRINTF_MODULE "Warning: recvfrom on the command socket failed (%s)\n", strerror(errno));
+                                (void)fflush(stdout);
+                        }
+                        return;
+                }
+
+                buf[bytes_recv] = '\0';
+                processMessage(buf, sa, t_recv);
+
+                // subscribers are told about whatever the commands changed
+                status_dirty = 1;
+        }
+}
+
+static void onMcast(void)
+{
+        int ret, i;
+
+        // drain every datagram queued on the socket, a batch at a time
+        do {
+                prepareBatch();
+                ret = recvmmsg(mcast_fd, mcast_msgs, MCAST_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+                if (ret < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return;
+
+                        // rejoined with a fresh socket by updateMcast()
+                        printf(PRINTF_MODULE "Warning: recvmmsg on the multicast socket failed (%s), restarting multicast receiver\n",
+                                strerror(errno));
+                        (void)fflush(stdout);
+                        leaveMcast();
+                        return;
+                }
+
+                for (i = 0; i < ret; ++i) {
+                        updateOverflows(&mcast_msgs[i].msg_hdr);
+                        processAudioDatagram(mcast_bufs[i], mcast_msgs[i].msg_len);
+                }
+        } while (ret == MCAST_BATCH_SIZE);
+}
+
+static void onUnicastWritable(void)
+{
+        setUnicastBlocked(0);
+        fanOut();
+}
+
+static void flushOutbound(void)
+{
+        struct out_msg *msg, *next;
+        unsigned long long count;
+
+        // clear the wakeup, messages queued from now on wake the loop again
+        if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                printf(PRINTF_MODULE "Warning: unable to read event loop wakeup (%s)\n", strerror(errno));
+                (void)fflush(stdout);
+        }
+
+        // take the whole queue, so other threads are not held up by sendto()
+        pthread_mutex_lock(&mtx_queue);
+        msg = out_queue;
+        out_queue = NULL;
+        pthread_mutex_unlock(&mtx_queue);
+
+        for (; msg; msg = next) {
+                if (sendto(cmd_fd, msg->buf, msg->msg_len, 0,
+                    (struct sockaddr *)&(msg->out_addr), sizeof(msg->out_addr)) < 0) {
+                        printf(PRINTF_MODULE "Warning: sendto failed (%s)\n", strerror(errno));
+                        (void)fflush(stdout);
+                }
+
+                if (msg->audio)
+                        addToHistory(msg->buf, msg->msg_len);
+
+                next = msg->next;
+                free(msg);
+        }
+
+        fanOut();
+}
+
+static void *eventLoop(void *arg)
+{
+        struct epoll_event events[MAX_EVENTS];
+        int n, i;
+
+        while (loop) {
+                n = epoll_wait(ep_fd, events, MAX_EVENTS, -1);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        printf(PRINTF_MODULE "Error: epoll_wait failed (%s)\n", strerror(errno));
+                        (void)fflush(stdout);
+                        break;
+                }
+
+                for (i = 0; i < n; ++i) {
+                        if (events[i].data.fd == cmd_fd)
+                                onCommand();
+                        else if (events[i].data.fd == mcast_fd)
+                                onMcast();
+                        else if (events[i].data.fd == timer_fd)
+                                onTimer();
+                        else if (events[i].data.fd == tick_fd)
+                                onTick();
+                        else if (events[i].data.fd == wake_fd)
+                                flushOutbound();
+                        else if (events[i].data.fd == ucast_fd)
+                                onUnicastWritable();
+                }
+
+                // commands may have changed the mode or the multicast group
+                updateMcast();
+
+                if (status_dirty)
+                        pushStatus();
+        }
+
+        leaveMcast();
+
+        // send whatever was queued before the loop ended
+        flushOutbound();
+
+        return NULL;
+}
+
+static int watch(int fd, unsigned int events)
+{
+        struct epoll_event ev = { .events = events };
+
+        ev.data.fd = fd;
+        if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                return errno;
+
+        return 0;
+}
+
+/**
+ * Public functions
+ */
+int network_init(void)
+{
+        int err = 0;
+        unsigned int i;
+        struct sched_param params;
+
+        loop = 1;
+
+        // a misplaced keyword would silently become unreachable
+        for (i = 1; i < CMD_TABLE_SIZE; ++i) {
+                if (strcmp(cmd_table[i - 1].keyword, cmd_table[i].keyword) >= 0) {
+                        printf(PRINTF_MODULE "Error: command table is not sorted at \"%s\"\n", cmd_table[i].keyword);
+                        return EINVAL;
+                }
+        }
+
+        // commands and their replies share one socket, so that responses
+        // from the master arrive at the slave's command handler
+        if ((err = getSocketFD(INBOUND_PORT, &cmd_fd)))
+                return err;
+
+        ep_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ucast_fd = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (ep_fd < 0 || wake_fd < 0 || timer_fd < 0 || tick_fd < 0 || ucast_fd < 0) {
+                printf(PRINTF_MODULE "Error: unable to create event loop descriptors (%s)\n", strerror(errno));
+                return errno;
+        }
+
+        // the unicast socket is only watched for EPOLLOUT while it is blocked
+        if ((err = watch(cmd_fd, EPOLLIN)) || (err = watch(wake_fd, EPOLLIN)) ||
+            (err = watch(timer_fd, EPOLLIN)) || (err = watch(tick_fd, EPOLLIN)) ||
+            (err = watch(ucast_fd, 0))) {
+                printf(PRINTF_MODULE "Error: unable to add descriptors to the event loop\n");
+                return err;
+        }
+
+        status_epoch = time(NULL);
+
+        // set up multicast sockaddr_in objects
+        memset(&mcast_addr, 0, sizeof(mcast_addr));
+        mcast_addr.sin_family = AF_INET;
+        mcast_addr.sin_port = htons(MCAST_PORT);
+        mcast_addr.sin_addr.s_addr = inet_addr(DEFAULT_MCAST_IP);
+
+        if ((err = pthread_create(&th_net, NULL, eventLoop, NULL))) {
+                printf(PRINTF_MODULE "Error: unable to create thread for the network event loop\n");
+                return err;
+        }
+
+        // set higher scheduling priority, the event loop receives the multicast audio
+        params.sched_priority = sched_get_priority_max(SCHED_FIFO);
+
+        err = pthread_setschedparam(th_net, SCHED_FIFO, &params);
+        if (err)
+                printf(PRINTF_MODULE "Error: unable to schedule a higher priority for network event loop thread\n");
+
+        return err;
+}
+
+void network_cleanup(void)
+{
+        loop = 0;
+
+        // the event loop sees the loop has ended as soon as it wakes up
+        wakeEventLoop();
+        (void)pthread_join(th_net, NULL);
+
+        close(ucast_fd);
+        close(tick_fd);
+        close(timer_fd);
+        close(wake_fd);
+        close(ep_fd);
+        close(cmd_fd);
+
+        free(status_queue);
+        status_queue = NULL;
+}
+
+void network_notifyStatusChanged(void)
+{
+        // may be called before the event loop exists
+        if (wake_fd < 0)
+                return;
+
+        status_dirty = 1;
+        wakeEventLoop();
+}
+
+void network_sendPlayCmd(struct sockaddr_in addr)
+{
+        queueOutboundMessage(CMD_PLAY "\n", strlen(CMD_PLAY "\n")+1, addr);
+}
+
+void network_sendPauseCmd(struct sockaddr_in addr)
+{
+        queueOutboundMessage(CMD_PAUSE "\n", strlen(CMD_PAUSE "\n")+1, addr);
+}
+
+void network_sendSkipCmd(struct sockaddr_in addr)
+{
+        queueOutboundMessage(CMD_SKIP "\n", strlen(CMD_SKIP "\n")+1, addr);
+}
+
+void network_sendFlush(unsigned int frames)
+{
+        unsigned char pkt[NETWORK_AUDIO_HDR_SIZE];
+        struct network_audio_hdr hdr;
+        int i;
+
+        // the next audio sent takes the place of the dropped frames
+        audio_pos -= frames;
+        fec_resetEncoder();
+
+        hdr.magic = NETWORK_AUDIO_MAGIC;
+        hdr.type = NETWORK_PKT_FLUSH;
+        hdr.codec = audio_codec;
+        hdr.len = 0;
+        hdr.seq = audio_seq;
+        hdr.pos = audio_pos;
+        hdr.pts = 0;
+
+        // a lost flush would leave a slave playing a lead of stale audio,
+        // and the flush does nothing when repeated
+        packAudioHeader(&hdr, pkt);
+        for (i = 0; i < FLUSH_REPEAT; ++i)
+                queueAudioMessage((char *)pkt, NETWORK_AUDIO_HDR_SIZE);
+}
+
+void network_sendAudio(char *buf, unsigned int len, long long pts)
+{
+        unsigned char pkt[NETWORK_AUDIO_HDR_SIZE + FEC_MAX_PARITY_SIZE];
+        char parity[FEC_MAX_PARITY_SIZE];
+        struct network_audio_hdr hdr, parity_hdr;
+        char payload[NETWORK_MAX_AUDIO_PAYLOAD];
+        unsigned int size, frames;
+        unsigned int start_pos = audio_pos;
+        unsigned int max_size;
+        int parity_len;
+
+        hdr.magic = NETWORK_AUDIO_MAGIC;
+        hdr.type = NETWORK_PKT_AUDIO;
+        hdr.codec = audio_codec;
+        max_size = codec_getPacketFrames(hdr.codec) * AUDIO_FRAME_SIZE;
+
+        // break up bufer into smaller chunks if too large
+        while (len > 0) {
+                size = len > max_size ? max_size : len;
+                frames = size / AUDIO_FRAME_SIZE;
+
+                hdr.len = codec_encode(hdr.codec, (short *)buf, frames, payload);
+                hdr.seq = audio_seq++;
+                hdr.pos = audio_pos;
+                hdr.pts = pts + (long long)(audio_pos - start_pos) * 1000000LL / AUDIO_SAMPLE_RATE;
+
+                packAudioHeader(&hdr, pkt);
+                (void)memcpy(pkt + NETWORK_AUDIO_HDR_SIZE, payload, hdr.len);
+                queueAudioMessage((char *)pkt, NETWORK_AUDIO_HDR_SIZE + hdr.len);
+
+                // follow each group of packets with its parity, if enabled
+                parity_len = fec_encode(&hdr, payload, parity, &parity_hdr.seq);
+                if (parity_len) {
+                        parity_hdr.magic = NETWORK_AUDIO_MAGIC;
+                        parity_hdr.type = NETWORK_PKT_PARITY;
+                        parity_hdr.codec = hdr.codec;
+                        parity_hdr.len = parity_len;
+                        parity_hdr.pos = 0;
+                        parity_hdr.pts = 0;
+
+                        packAudioHeader(&parity_hdr, pkt);
+                        (void)memcpy(pkt + NETWORK_AUDIO_HDR_SIZE, parity, parity_len);
+                        queueAudioMessage((char *)pkt, NETWORK_AUDIO_HDR_SIZE + parity_len);
+                }
 
-                queueOutboundMessage(buf, size, mcast_addr);
+                // each packet is stamped with the time of its own first frame
+                audio_pos += frames;
 
                 len -= size;
                 buf += size;
@@ -5,6 +5,35 @@
 
 #define NETWORK_MAX_BUFFER_SIZE         1500
 
+#define NETWORK_AUDIO_MAGIC             0xA5
+#define NETWORK_AUDIO_HDR_SIZE          21
+#define NETWORK_MAX_AUDIO_PAYLOAD       512
+
+enum network_pkt_type {
+        NETWORK_PKT_AUDIO  = 0,
+        NETWORK_PKT_PARITY = 1,         // XOR of a group of audio packets, see fec.h
+        NETWORK_PKT_FLUSH  = 2,         // audio from pos onwards will not be played
+        NETWORK_PKT_BACKFILL_END = 3    // no payload, the backfill burst before it is complete
+};
+
+// set in the type of packets the master replays from its history to a
+// slave that just joined
+#define NETWORK_PKT_BACKFILL            0x80
+
+/*
+ * Header prepended to every multicast audio datagram. Serialized in network
+ * byte order, NETWORK_AUDIO_HDR_SIZE bytes on the wire.
+ */
+struct network_audio_hdr {
+        unsigned char magic;            // NETWORK_AUDIO_MAGIC
+        unsigned char type;             // enum network_pkt_type
+        unsigned short len;             // length of the payload in bytes
+        unsigned int seq;               // packet sequence number
+        unsigned int pos;               // stream position (in frames) of the first frame
+        long long pts;                  // master time (us) the first frame is heard
+        unsigned char codec;            // enum codec_type of the payload
+};
+
 /**
  * Initializes this module
  * @return 0 if successful, otherwise error
@@ -16,6 +45,11 @@ int network_init(void);
  */
 void network_cleanup(void);
 
+/**
+ * Push the status to subscribed clients, after it changed outside of a command
+ */
+void network_notifyStatusChanged(void);
+
 /**
  * Send the play song command to the master device
  * @param addr Address of destination
@@ -35,10 +69,18 @@ void network_sendPauseCmd(struct sockaddr_in addr);
 void network_sendSkipCmd(struct sockaddr_in addr);
 
 /**
- * Multicast audio data.
+ * Tell the slaves to drop the end of the audio sent to them, e.g. when the
+ * master pauses ahead of it. The stream continues from the first dropped frame.
+ * @param frames Number of frames at the end of the stream to drop
+ */
+void network_sendFlush(unsigned int frames);
+
+/**
+ * Multicast audio data, and send it to the slaves that asked for unicast.
  * @param buf Buffer of data to send
  * @param len Size of buffer
+ * @param pts Master time (us) the first frame of the buffer is heard
  */
-void network_sendAudio(char *buf, unsigned int len);
+void network_sendAudio(char *buf, unsigned int len, long long pts);
 
 #endif
@@ -8,58 +8,73 @@ var io;
 
 var dgram = require('dgram');
 
+// Info for connecting to the local process via UDP
+var PORT = 12345;
+var HOST = '127.0.0.1';
+
+// The local process pushes status changes to subscribers until their 30 s
+// lease runs out, so the subscription is renewed well before that
+var RENEW_INTERVAL_MS = 10000;
+
 exports.listen = function(server) {
 	io = socketio.listen(server);
 	io.set('log level 1');
-	
+
 	io.sockets.on('connection', function(socket) {
 		handleCommand(socket);
 	});
 };
 
 function handleCommand(socket) {
-	// Pased string of command to relay
-	socket.on('clientCommand', function(data) {
-		console.log('clientCommand: ' + data);
+	// One UDP socket per browser, it receives command replies as well as
+	// the status pushed by the local application
+	var client = dgram.createSocket('udp4');
 
-		if (data == "statusping") {
-			socket.emit('serverReply', "nodejsping");
-		}
-		
-		// Info for connecting to the local process via UDP
-		var PORT = 12345;
-		var HOST = '127.0.0.1';
-		var buffer = new Buffer(data);
+	// Version of the last status relayed, so renewals only return changes
+	var statusVersion = "";
 
-		var client = dgram.createSocket('udp4');
+	function sendUdp(data, callback) {
+		var buffer = new Buffer(data);
 		client.send(buffer, 0, buffer.length, PORT, HOST, function(err, bytes) {
-		    if (err) 
-		    	throw err;
-		    console.log('UDP message sent to ' + HOST +':'+ PORT);
-		});
-		
-		client.on('listening', function () {
-		    var address = client.address();
-		    //console.log('UDP Client: listening on ' + address.address + ":" + address.port);
+		    if (err)
+		    	console.log("UDP Client: error sending: ", err);
+		    if (callback)
+		    	callback();
 		});
-		
-		// Handle an incoming message over the UDP from the local application.
-		client.on('message', function (message, remote) {
-		    //console.log("UDP Client: message Rx" + remote.address + ':' + remote.port +' - ' + message);
-		    
-		    var reply = message.toString('utf8')
-		    socket.emit('serverReply', reply);
-		    
-		    client.close();
+	}
 
-		});
+	function subscribe() {
+		sendUdp(statusVersion ? 'subscribe=' + statusVersion + '\n' : 'subscribe\n');
+	}
 
-		client.on("UDP Client: close", function() {
-		    console.log("closed");
-		});
+	// Handle an incoming message over the UDP from the local application.
+	client.on('message', function (message, remote) {
+	    var reply = message.toString('utf8');
+
+	    var version = /^version=([0-9]+,[0-9]+)$/m.exec(reply);
+	    if (version)
+	    	statusVersion = version[1];
+
+	    socket.emit('serverReply', reply);
+	});
+
+	client.on('error', function(err) {
+	    console.log("UDP Client: error: ", err);
+	});
+
+	subscribe();
+	var renewTimer = setInterval(subscribe, RENEW_INTERVAL_MS);
+
+	// Pased string of command to relay
+	socket.on('clientCommand', function(data) {
+		console.log('clientCommand: ' + data);
+		sendUdp(data);
+	});
 
-		client.on("UDP Client: error", function(err) {
-		    console.log("error: ",err);
+	socket.on('disconnect', function() {
+		clearInterval(renewTimer);
+		sendUdp('unsubscribe\n', function() {
+			client.close();
 		});
 	});
 };
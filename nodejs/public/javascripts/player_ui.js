@@ -6,14 +6,10 @@
 
 "use strict";
 
-const POLL_INTERVAL_MS = 1000;
-const UPDATE_TIMEOUT = 5000;
 const ERROR_DISPLAY_TIME = 2000;
 
 var socket = io.connect();
 
-var lastUpdateTimeNodejs = Date.now();
-
 // Run when webpage fully loaded
 $(document).ready(function() {
 
@@ -40,9 +36,6 @@ $(document).ready(function() {
 		handleServerCommands(data);
 	});
 
-	// Poll server for new data
-	pollServer();
-
 	handleModeChange();
 });
 
@@ -61,6 +54,7 @@ const CMD_ADD_SONG    = "addsong=";
 const CMD_REMOVE_SONG = "rmsong=";
 const CMD_REPEAT_SONG = "repeat=";
 const CMD_CHANGE_MODE = "mode=";
+const CMD_GET_QUEUE   = "getqueue=";
 
 function sendServerCommand(data) {
 	socket.emit('clientCommand', data + '\n');
@@ -213,6 +207,50 @@ function youtube_parser(url){
     return (match&&match[7].length==11)? match[7] : false;
 }
 
+// Songs requested per getqueue, the server may return fewer
+const QUEUE_PAGE_SIZE = 20;
+
+// Version of the queue being shown, pages of any other version are stale
+var queueVersion = "";
+
+// Fetches the queue again if the server reports a different version
+function handleQueueInfo(data) {
+	var info = data.split(',');
+	if (info[0] == queueVersion) {
+		return;
+	}
+
+	sendServerCommand(CMD_GET_QUEUE + '0,' + QUEUE_PAGE_SIZE);
+}
+
+// Page data is version,length,offset followed by video IDs
+function handleQueuePage(data) {
+	var fields = data.split(',');
+	var version = fields[0];
+	var length = parseInt(fields[1]);
+	var offset = parseInt(fields[2]);
+	var vids = fields.slice(3);
+
+	if (offset == 0) {
+		// A new version is always redrawn, later pages are appended to it
+		queueVersion = version;
+		prevQueueData = "undefined";
+	}
+	else if (version != queueVersion) {
+		// The queue changed between pages, start over
+		queueVersion = "";
+		sendServerCommand(CMD_GET_QUEUE + '0,' + QUEUE_PAGE_SIZE);
+		return;
+	}
+
+	handleSongQueueData(vids.join(','), offset != 0);
+
+	var received = offset + vids.filter(function(vid) { return vid.length > 2; }).length;
+	if (received > offset && received < length) {
+		sendServerCommand(CMD_GET_QUEUE + received + ',' + QUEUE_PAGE_SIZE);
+	}
+}
+
 var prevQueueData = "undefined";
 function handleSongQueueData(data, appendData=false) {
 	if (!appendData) {
@@ -264,10 +302,34 @@ function handleSongStatus(statusData) {
 		currentSongStatus = newSongStatus;
 		if (currentSongStatus != SONG_STATUS_UNKNOWN) {
 			$("#song-status-icon").attr("class", getStatusIconClass());
+			$("#song-status-icon").attr("title", "");
 		}
 	}
 }
 
+const DOWNLOAD_PHASES = ["Waiting", "Starting", "Downloading", "Converting"];
+
+// Data is index,vid,phase,percent,fetched,total,speed,eta,audio ms,
+// unknown numbers are -1
+function handleDownloadProgress(data) {
+	var fields = data.split(',');
+	if (fields[0] != '0') {
+		return;
+	}
+
+	var text = DOWNLOAD_PHASES[parseInt(fields[2])] || "Downloading";
+	if (parseInt(fields[3]) >= 0) {
+		text += ` ${fields[3]}%`;
+	}
+	if (parseInt(fields[6]) > 0) {
+		text += `, ${(parseInt(fields[6]) / 1048576).toFixed(1)} MiB/s`;
+	}
+	if (parseInt(fields[7]) >= 0) {
+		text += `, ${parseSecsToString(parseInt(fields[7]))} left`;
+	}
+	$("#song-status-icon").attr("title", text);
+}
+
 function getStatusIconClass() {
 	var iconClass = "";
 	switch(currentSongStatus) {
@@ -354,15 +416,6 @@ function setDisplayVolume(newVolume) {
 }
 
 
-function pollServer() {
-	socket.emit('clientCommand', 'statusping\n');
-	window.setTimeout(pollServer, POLL_INTERVAL_MS);
-
-	if ((Date.now() - lastUpdateTimeNodejs) > UPDATE_TIMEOUT) {
-		// setError("No response from Node.js server. Is it running?")
-	}
-}
-
 //
 // Song time progress
 //========================================================================
@@ -504,8 +557,6 @@ function handleServerCommands(data) {
 	for (var i in commands) {
 		handleServerCommand(commands[i]);
 	}
-
-	lastUpdateTimeNodejs = Date.now();
 }
 
 // Handles single command
@@ -519,6 +570,11 @@ function handleServerCommand(command) {
 	var subCommand = parsedWords[1];
 
 	switch (primaryCommand) {
+		case "version":
+		case "update":
+			// status is pushed by the server, fields missing from a delta are unchanged
+			break;
+
 		case "play":
 			setPlayPauseDisplay(subCommand == '1');
 			break;
@@ -538,16 +594,20 @@ function handleServerCommand(command) {
 			setSongProgress(subCommand);
 			break;
 
+		case "download":
+			handleDownloadProgress(subCommand);
+			break;
+
 		case "mode":
 			setDeviceMode(subCommand);
 			break;
 
-		case "queue":
-			handleSongQueueData(subCommand);
+		case "queueinfo":
+			handleQueueInfo(subCommand);
 			break;
 
-		case "queuemore":
-			handleSongQueueData(subCommand, true);
+		case "queuepage":
+			handleQueuePage(subCommand);
 			break;
 
 		default:
@@ -0,0 +1,73 @@
+#include "plc.h"
+
+#include "audio.h"
+
+#include <string.h>
+
+/*
+ * Helper functions
+ */
+
+// Frame k of the concealment, before fading: the history played backwards
+// from the gap, then forwards again, so there is no jump at the turns
+static const short *concealFrame(const short *hist, int hist_frames, int k)
+{
+        int m = k % (2 * hist_frames);
+
+        if (m < hist_frames)
+                return hist + (hist_frames - 1 - m) * AUDIO_NUM_CHANNELS;
+
+        return hist + (m - hist_frames) * AUDIO_NUM_CHANNELS;
+}
+
+// Gain of frame k of the concealment in Q15
+static int concealGain(int k)
+{
+        if (k >= PLC_FADE_FRAMES)
+                return 0;
+
+        return (PLC_FADE_FRAMES - k) * 32768 / PLC_FADE_FRAMES;
+}
+
+/*
+ * Public functions
+ */
+void plc_conceal(const short *hist, int hist_frames, int offset, short *out, int frames)
+{
+        const short *src;
+        int i, ch, gain;
+
+        if (hist_frames <= 0) {
+                (void)memset(out, 0, frames * AUDIO_NUM_CHANNELS * sizeof(*out));
+                return;
+        }
+
+        for (i = 0; i < frames; ++i) {
+                gain = concealGain(offset + i);
+                src = concealFrame(hist, hist_frames, offset + i);
+
+                for (ch = 0; ch < AUDIO_NUM_CHANNELS; ++ch)
+                        *out++ = gain ? (src[ch] * gain) >> 15 : 0;
+        }
+}
+
+void plc_crossfade(const short *hist, int hist_frames, int gap_frames, short *buf, int frames)
+{
+        short conceal[PLC_XFADE_FRAMES * AUDIO_NUM_CHANNELS];
+        int i, ch, w;
+
+        if (frames > PLC_XFADE_FRAMES)
+                frames = PLC_XFADE_FRAMES;
+
+        plc_conceal(hist, hist_frames, gap_frames, conceal, frames);
+
+        for (i = 0; i < frames; ++i) {
+                w = (i + 1) * 32768 / (PLC_XFADE_FRAMES + 1);
+
+                for (ch = 0; ch < AUDIO_NUM_CHANNELS; ++ch) {
+                        int idx = i * AUDIO_NUM_CHANNELS + ch;
+
+                        buf[idx] = (buf[idx] * w + conceal[idx] * (32768 - w)) >> 15;
+                }
+        }
+}
@@ -0,0 +1,35 @@
+#ifndef _PLC_H_
+#define _PLC_H_
+
+/**
+ * Packet loss concealment module - Fills gaps left by lost audio packets
+ * with the audio that preceded them, played backwards and forwards and
+ * faded out, so a single lost packet is not heard as a click.
+ * Works on interleaved S16 frames.
+ */
+
+#define PLC_HISTORY_FRAMES      256     // ~6 ms of audio preceding the gap is reused
+#define PLC_FADE_FRAMES         441     // concealment fades to silence over 10 ms
+#define PLC_XFADE_FRAMES        32      // blend back into the real audio after the gap
+
+/**
+ * Generate concealment for part of a gap
+ * @param hist Frames preceding the gap, oldest first
+ * @param hist_frames Number of frames in hist, at most PLC_HISTORY_FRAMES
+ * @param offset Index of the first frame to generate, counted from the start of the gap
+ * @param out Output buffer
+ * @param frames Number of frames to generate
+ */
+void plc_conceal(const short *hist, int hist_frames, int offset, short *out, int frames);
+
+/**
+ * Blend the audio following a gap with the continued concealment
+ * @param hist Frames preceding the gap, oldest first
+ * @param hist_frames Number of frames in hist, at most PLC_HISTORY_FRAMES
+ * @param gap_frames Length of the gap that was concealed
+ * @param buf Audio following the gap, modified in place
+ * @param frames Number of frames in buf
+ */
+void plc_crossfade(const short *hist, int hist_frames, int gap_frames, short *buf, int frames);
+
+#endif
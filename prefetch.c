@@ -0,0 +1,147 @@
+#include "prefetch.h"
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define PRINTF_MODULE           "[prefetch] "
+
+// estimates until the first download is measured: a song takes a while
+// to start and then downloads at twice the rate it plays, compressed to
+// a little over half of its raw size
+#define DEFAULT_STARTUP_US      5000000
+#define DEFAULT_SPEED           2000
+#define DEFAULT_SONG_US         210000000
+#define DEFAULT_BYTES_PER_S     96000
+#define MIN_SPEED               10
+
+// every measurement moves the estimates a quarter of the way
+#define EWMA_DIV                4
+
+// songs are fetched when half again the estimated download time, and some
+// margin for the link getting slower, is left until they are due to play
+#define SAFETY_NUM              3
+#define SAFETY_DEN              2
+#define MARGIN_US               30000000
+
+static struct prefetch_stats stats = {
+        .startup_us = DEFAULT_STARTUP_US,
+        .speed = DEFAULT_SPEED,
+        .song_us = DEFAULT_SONG_US,
+        .bytes_per_s = DEFAULT_BYTES_PER_S,
+};
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Helper functions
+ */
+
+static long long average(long long estimate, long long sample)
+{
+        if (!stats.downloads)
+                return sample;
+
+        return estimate + (sample - estimate) / EWMA_DIV;
+}
+
+// Time to download the rest of a song, if it was started now
+// NOTE: mtx must be held
+static long long downloadTime(long long duration_us, long long downloaded_us)
+{
+        long long time_us = 0;
+
+        if (downloaded_us >= duration_us)
+                return 0;
+
+        if (downloaded_us <= 0)
+                time_us = stats.startup_us;
+
+        return time_us + (duration_us - downloaded_us) * 1000 / stats.speed;
+}
+
+/*
+ * Public functions
+ */
+
+void prefetch_recordDownload(long long audio_us, long long startup_us, long long elapsed_us, long long bytes)
+{
+        long long transfer_us = elapsed_us - startup_us;
+        long long speed;
+
+        if (audio_us <= 0 || startup_us < 0 || transfer_us < 0)
+                return;
+
+        // a song can arrive all at once, e.g. from a fast mirror
+        if (transfer_us < 1000)
+                transfer_us = 1000;
+
+        speed = audio_us * 1000 / transfer_us;
+        if (speed < MIN_SPEED)
+                speed = MIN_SPEED;
+
+        pthread_mutex_lock(&mtx);
+        stats.startup_us = average(stats.startup_us, startup_us);
+        stats.speed = (int)average(stats.speed, speed);
+        stats.song_us = average(stats.song_us, audio_us);
+        stats.bytes_per_s = average(stats.bytes_per_s, bytes * 1000000 / audio_us);
+        ++stats.downloads;
+        pthread_mutex_unlock(&mtx);
+}
+
+void prefetch_recordStarvation(const char *vid, long long wait_us)
+{
+        pthread_mutex_lock(&mtx);
+        ++stats.starvations;
+        stats.starved_us += wait_us;
+        stats.last_starved_us = wait_us;
+        pthread_mutex_unlock(&mtx);
+
+        printf(PRINTF_MODULE "Warning: %s was not downloaded when it was due, playback waited %lld ms\n",
+                vid, wait_us / 1000);
+        (void)fflush(stdout);
+}
+
+int prefetch_plan(long long played_us, const struct prefetch_song *songs, int num,
+        int workers, long long budget)
+{
+        long long start_us = -played_us;        // time until a song is due to play
+        long long backlog_us = 0;               // downloads before it that are not done
+        long long bytes = 0;
+        long long duration_us, need_us;
+        int depth;
+
+        if (workers < 1)
+                workers = 1;
+
+        pthread_mutex_lock(&mtx);
+        for (depth = 0; depth < num; ++depth) {
+                duration_us = songs[depth].duration_us;
+                if (duration_us < 0)
+                        duration_us = songs[depth].downloaded_us > stats.song_us ?
+                                songs[depth].downloaded_us : stats.song_us;
+
+                // downloads share the workers with the ones before them
+                need_us = downloadTime(duration_us, songs[depth].downloaded_us);
+                bytes += duration_us / 1000 * stats.bytes_per_s / 1000;
+
+                if (depth >= PREFETCH_MIN_DEPTH &&
+                    (start_us > (backlog_us / workers + need_us) * SAFETY_NUM / SAFETY_DEN + MARGIN_US ||
+                     bytes > budget))
+                        break;
+
+                backlog_us += need_us;
+                start_us += duration_us;
+                if (start_us < 0)
+                        start_us = 0;
+        }
+        stats.depth = depth;
+        pthread_mutex_unlock(&mtx);
+
+        return depth;
+}
+
+void prefetch_getStats(struct prefetch_stats *s)
+{
+        pthread_mutex_lock(&mtx);
+        *s = stats;
+        pthread_mutex_unlock(&mtx);
+}
@@ -0,0 +1,68 @@
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+/**
+ * Prefetch module - Plans how far ahead of playback songs are downloaded.
+ * Every download is timed, to learn how long the link takes to start one
+ * and how fast it then fetches audio. A song is fetched once waiting any
+ * longer could leave it unfinished by the time it is due to play, as long
+ * as the songs fetched ahead of playback fit in the cache. Songs that were
+ * not downloaded by the time they were due are counted as queue starvation.
+ */
+
+// the first song of the queue and the one after it are always fetched
+#define PREFETCH_MIN_DEPTH      2
+#define PREFETCH_MAX_DEPTH      16
+
+struct prefetch_song {
+        long long duration_us;          // length of the song, -1 if unknown
+        long long downloaded_us;        // audio downloaded so far
+};
+
+struct prefetch_stats {
+        int depth;                      // songs fetched at the last plan, counted from the first
+        long long startup_us;           // estimated time until a download delivers audio
+        int speed;                      // estimated ms of audio a download fetches per second
+        long long song_us;              // average length of a song
+        long long bytes_per_s;          // average cached bytes per second of audio
+        unsigned int downloads;         // downloads measured
+        unsigned int starvations;       // songs that were not downloaded when they were due
+        long long starved_us;           // total time playback waited for them
+        long long last_starved_us;      // time playback waited at the last starvation
+};
+
+/**
+ * Learn from a completed download
+ * @param audio_us Length of the song
+ * @param startup_us Time from starting the download until the first audio arrived
+ * @param elapsed_us Time the whole download took
+ * @param bytes Size of the cached file
+ */
+void prefetch_recordDownload(long long audio_us, long long startup_us, long long elapsed_us, long long bytes);
+
+/**
+ * Record a song that was not downloaded when it was due to play
+ * @param vid YouTube video ID of the song, for the log
+ * @param wait_us Time playback waited for it, 0 if it could play while downloading
+ */
+void prefetch_recordStarvation(const char *vid, long long wait_us);
+
+/**
+ * Decide how many songs, counted from the first of the queue, to fetch now
+ * @param played_us Time the first song has played so far
+ * @param songs Songs from the first of the queue on
+ * @param num Number of songs, up to PREFETCH_MAX_DEPTH
+ * @param workers Number of songs downloaded at the same time
+ * @param budget Bytes the cache may use
+ * @return Number of songs to fetch, at least PREFETCH_MIN_DEPTH unless num is smaller
+ */
+int prefetch_plan(long long played_us, const struct prefetch_song *songs, int num,
+        int workers, long long budget);
+
+/**
+ * Get the estimates and the starvation counts
+ * @param stats Address to store the statistics
+ */
+void prefetch_getStats(struct prefetch_stats *stats);
+
+#endif
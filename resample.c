@@ -0,0 +1,80 @@
+#include "resample.h"
+
+#include "audio.h"
+
+#include <string.h>
+
+#define PHASE_ONE       (1LL << 32)
+#define WEIGHT_SHIFT    17              // Q32 phase fraction down to a Q15 weight
+
+// position of the next output frame in Q32 input frames, relative to the
+// last frame of the previous block (prev)
+static long long phase = PHASE_ONE;
+static long long step = PHASE_ONE;
+static int ratio_ppm = 0;
+static short prev[AUDIO_NUM_CHANNELS];
+
+/*
+ * Public functions
+ */
+void resample_reset(void)
+{
+        // the first output frame is exactly the first input frame
+        phase = PHASE_ONE;
+        (void)memset(prev, 0, sizeof(prev));
+}
+
+void resample_setRatio(int ppm)
+{
+        if (ppm > RESAMPLE_MAX_PPM)
+                ppm = RESAMPLE_MAX_PPM;
+        else if (ppm < -RESAMPLE_MAX_PPM)
+                ppm = -RESAMPLE_MAX_PPM;
+
+        ratio_ppm = ppm;
+        step = PHASE_ONE + (((long long)ppm << 32) / 1000000);
+}
+
+int resample_getRatio(void)
+{
+        return ratio_ppm;
+}
+
+int resample_process(const short *in, int in_frames,
+        short *out, int out_frames, int *consumed)
+{
+        const short *a, *b;
+        int produced = 0;
+        int i, ch, weight;
+
+        while (produced < out_frames) {
+                i = phase >> 32;
+                if (i >= in_frames)
+                        break;
+
+                // interpolate between input frames i-1 and i (prev when i is 0)
+                a = i ? in + (i - 1) * AUDIO_NUM_CHANNELS : prev;
+                b = in + i * AUDIO_NUM_CHANNELS;
+                weight = (phase & (PHASE_ONE - 1)) >> WEIGHT_SHIFT;
+
+                for (ch = 0; ch < AUDIO_NUM_CHANNELS; ++ch)
+                        *out++ = a[ch] + (((b[ch] - a[ch]) * weight) >> 15);
+
+                phase += step;
+                ++produced;
+        }
+
+        // every frame before the interpolation point has been used
+        i = phase >> 32;
+        if (i > in_frames)
+                i = in_frames;
+
+        if (i > 0) {
+                (void)memcpy(prev, in + (i - 1) * AUDIO_NUM_CHANNELS, sizeof(prev));
+                phase -= (long long)i << 32;
+        }
+
+        *consumed = i;
+
+        return produced;
+}
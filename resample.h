@@ -0,0 +1,43 @@
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+/**
+ * Resample module - Stretches or shrinks interleaved S16 audio by a few
+ * hundred ppm with fixed-point linear interpolation. Used by slaves to
+ * follow the master's sample clock.
+ */
+
+#define RESAMPLE_MAX_PPM        1000
+
+/**
+ * Reset the interpolation state, e.g. after a discontinuity in the audio.
+ * The ratio is kept.
+ */
+void resample_reset(void);
+
+/**
+ * Set how much faster than real time input audio is consumed
+ * @param ppm Ratio deviation in parts per million, clamped to
+ *            +/- RESAMPLE_MAX_PPM; >0 shrinks the audio, <0 stretches it
+ */
+void resample_setRatio(int ppm);
+
+/**
+ * Get the current ratio deviation
+ * @return Ratio deviation in parts per million
+ */
+int resample_getRatio(void);
+
+/**
+ * Resample a contiguous block of frames
+ * @param in Input samples
+ * @param in_frames Number of frames available in the input
+ * @param out Output samples
+ * @param out_frames Maximum number of frames to output
+ * @param consumed Address to store the number of input frames consumed
+ * @return Number of frames written to out
+ */
+int resample_process(const short *in, int in_frames,
+        short *out, int out_frames, int *consumed);
+
+#endif
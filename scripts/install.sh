@@ -54,6 +54,7 @@ systemctl enable musicWeb.service
 
 # set up routing table for multicasting (default multicasting IP, uses ethernet)
 # might need to have a command in C app if we're still allowing custom multicast IPs
+# slaves on networks that drop multicast can send "transport=unicast" instead
 route | grep "224.0.0.0" >/dev/null
 if [ $? -eq 1 ]; then
         ip route add 224.0.0.0/4 dev eth0
@@ -0,0 +1,315 @@
+#include "supervisor.h"
+
+#include "timesync.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#define PRINTF_MODULE   "[supervis] "
+
+extern char **environ;
+
+static struct supervisor_stats stats;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Helper functions
+ */
+
+// Keeps the end of what the job writes to stderr, for the log
+static void keepErr(struct supervisor_job *job, const char *text, int len)
+{
+        int keep = SUPERVISOR_MAXLEN_ERR - 1 - len;
+
+        if (keep < 0) {
+                text -= keep;
+                len += keep;
+                keep = 0;
+        }
+        if (job->err_len > keep) {
+                (void)memmove(job->err, job->err + job->err_len - keep, keep);
+                job->err_len = keep;
+        }
+        (void)memcpy(job->err + job->err_len, text, len);
+        job->err_len += len;
+        job->err[job->err_len] = '\0';
+}
+
+// Lines the handler does not understand are kept for the log
+static void endLine(struct supervisor_job *job)
+{
+        if (!job->line_len)
+                return;
+
+        job->line[job->line_len] = '\0';
+        if (!job->on_line || !job->on_line(job->arg, job->line)) {
+                job->line[job->line_len++] = '\n';
+                keepErr(job, job->line, job->line_len);
+        }
+        job->line_len = 0;
+}
+
+// Progress meters end their lines with \r, so it ends a line too
+static void collectErr(struct supervisor_job *job)
+{
+        char buf[SUPERVISOR_MAXLEN_ERR];
+        ssize_t len, i;
+
+        len = read(job->err_fd, buf, sizeof(buf));
+        if (len <= 0) {
+                if (len == 0 || errno != EINTR) {
+                        endLine(job);
+                        close(job->err_fd);
+                        job->err_fd = -1;
+                }
+                return;
+        }
+
+        for (i = 0; i < len; ++i) {
+                if (buf[i] == '\n' || buf[i] == '\r') {
+                        endLine(job);
+                        continue;
+                }
+
+                if (job->line_len == SUPERVISOR_MAXLEN_LINE - 1)
+                        endLine(job);
+                job->line[job->line_len++] = buf[i];
+        }
+}
+
+// Kills the whole process group, with anything the tools started themselves
+static void killJob(struct supervisor_job *job)
+{
+        if (job->num_procs > 0)
+                (void)kill(-job->pids[0], SIGKILL);
+}
+
+static int reapJob(struct supervisor_job *job)
+{
+        int i, status, result = 0;
+
+        for (i = 0; i < job->num_procs; ++i) {
+                while (waitpid(job->pids[i], &status, 0) < 0 && errno == EINTR)
+                        ;
+
+                if (result)
+                        continue;
+                if (WIFEXITED(status))
+                        result = WEXITSTATUS(status);
+                else if (WIFSIGNALED(status))
+                        result = 128 + WTERMSIG(status);
+        }
+
+        return result;
+}
+
+/*
+ * Public functions
+ */
+int supervisor_start(struct supervisor_job *job, const char *name,
+        char *const *argvs[], int num, long long timeout_ms)
+{
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t mask;
+        int err_pipe[2];
+        int out_pipe[2];
+        int in_fd = -1;
+        int err = 0;
+        int i;
+
+        (void)memset(job, 0, sizeof(*job));
+        job->name = name;
+        job->out_fd = -1;
+        job->err_fd = -1;
+
+        if (num < 1 || num > SUPERVISOR_MAX_PROCS)
+                return EINVAL;
+
+        // only the ends given to the children survive the exec
+        if (pipe2(err_pipe, O_CLOEXEC))
+                return errno;
+
+        // the tools get default signal handling, whatever this program changed
+        (void)posix_spawnattr_init(&attr);
+        (void)sigemptyset(&mask);
+        (void)posix_spawnattr_setsigmask(&attr, &mask);
+        (void)sigaddset(&mask, SIGPIPE);
+        (void)sigaddset(&mask, SIGINT);
+        (void)sigaddset(&mask, SIGTERM);
+        (void)posix_spawnattr_setsigdefault(&attr, &mask);
+        (void)posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+                POSIX_SPAWN_SETPGROUP);
+
+        for (i = 0; i < num && !err; ++i) {
+                if (pipe2(out_pipe, O_CLOEXEC)) {
+                        err = errno;
+                        break;
+                }
+
+                (void)posix_spawn_file_actions_init(&actions);
+                if (in_fd < 0)
+                        (void)posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+                else
+                        (void)posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+                (void)posix_spawn_file_actions_adddup2(&actions, out_pipe[1], 1);
+                (void)posix_spawn_file_actions_adddup2(&actions, err_pipe[1], 2);
+
+                // the job gets a process group of its own, led by the first process
+                (void)posix_spawnattr_setpgroup(&attr, i ? job->pids[0] : 0);
+
+                err = posix_spawnp(&job->pids[i], argvs[i][0], &actions, &attr, argvs[i], environ);
+                (void)posix_spawn_file_actions_destroy(&actions);
+
+                // the next process reads what this one writes
+                close(out_pipe[1]);
+                if (in_fd >= 0)
+                        close(in_fd);
+                in_fd = out_pipe[0];
+
+                if (!err)
+                        ++job->num_procs;
+        }
+
+        (void)posix_spawnattr_destroy(&attr);
+        close(err_pipe[1]);
+
+        if (err) {
+                printf(PRINTF_MODULE "Warning: unable to start %s (%s)\n", name, strerror(err));
+                (void)fflush(stdout);
+
+                if (in_fd >= 0)
+                        close(in_fd);
+                close(err_pipe[0]);
+                killJob(job);
+                (void)reapJob(job);
+                return err;
+        }
+
+        job->out_fd = in_fd;
+        job->err_fd = err_pipe[0];
+        job->started_us = timesync_getTimeUs();
+        job->deadline_us = job->started_us + timeout_ms * 1000;
+
+        return 0;
+}
+
+void supervisor_setLineHandler(struct supervisor_job *job, supervisor_line_handler on_line, void *arg)
+{
+        job->on_line = on_line;
+        job->arg = arg;
+}
+
+ssize_t supervisor_read(struct supervisor_job *job, void *buf, size_t len, int wait_ms)
+{
+        struct pollfd fds[2];
+        long long now, end, timeout;
+        ssize_t ret;
+
+        now = timesync_getTimeUs();
+        end = now + wait_ms * 1000LL;
+        if (end > job->deadline_us)
+                end = job->deadline_us;
+
+        for (;;) {
+                if (now >= job->deadline_us) {
+                        errno = ETIMEDOUT;
+                        return -1;
+                }
+
+                timeout = (end - now + 999) / 1000;
+                if (timeout <= 0) {
+                        errno = EAGAIN;
+                        return -1;
+                }
+
+                fds[0].fd = job->out_fd;
+                fds[0].events = POLLIN;
+                fds[1].fd = job->err_fd;
+                fds[1].events = POLLIN;
+                if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+                        return -1;
+
+                if (job->err_fd >= 0 && fds[1].revents)
+                        collectErr(job);
+
+                if (fds[0].revents) {
+                        ret = read(job->out_fd, buf, len);
+                        if (ret >= 0 || errno != EINTR)
+                                return ret;
+                }
+
+                now = timesync_getTimeUs();
+        }
+}
+
+int supervisor_finish(struct supervisor_job *job, int cancel)
+{
+        struct pollfd fd;
+        long long now, duration;
+        int status;
+
+        if (cancel)
+                killJob(job);
+
+        // upstream processes still writing get EPIPE
+        if (job->out_fd >= 0)
+                close(job->out_fd);
+
+        // stderr is closed once all processes exit, or they are killed at the deadline
+        while (job->err_fd >= 0) {
+                now = timesync_getTimeUs();
+                if (!cancel && now >= job->deadline_us) {
+                        killJob(job);
+                        cancel = 1;
+                }
+
+                fd.fd = job->err_fd;
+                fd.events = POLLIN;
+                if (poll(&fd, 1, cancel ? -1 : (int)((job->deadline_us - now + 999) / 1000)) > 0)
+                        collectErr(job);
+        }
+
+        status = reapJob(job);
+        duration = timesync_getTimeUs() - job->started_us;
+
+        while (job->err_len > 0 && (job->err[job->err_len - 1] == '\n' || job->err[job->err_len - 1] == '\r'))
+                job->err[--job->err_len] = '\0';
+
+        pthread_mutex_lock(&mtx);
+        ++stats.jobs;
+        if (cancel)
+                ++stats.killed;
+        else if (status)
+                ++stats.failed;
+        stats.total_us += duration;
+        stats.last_us = duration;
+        stats.last_status = status;
+        pthread_mutex_unlock(&mtx);
+
+        if (cancel)
+                printf(PRINTF_MODULE "Notice: %s killed after %lld ms\n", job->name, duration / 1000);
+        else if (status)
+                printf(PRINTF_MODULE "Warning: %s failed (%d) after %lld ms: %s\n",
+                        job->name, status, duration / 1000, job->err);
+        else
+                printf(PRINTF_MODULE "Info: %s finished after %lld ms\n", job->name, duration / 1000);
+        (void)fflush(stdout);
+
+        return status;
+}
+
+void supervisor_getStats(struct supervisor_stats *s)
+{
+        pthread_mutex_lock(&mtx);
+        *s = stats;
+        pthread_mutex_unlock(&mtx);
+}
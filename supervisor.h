@@ -0,0 +1,97 @@
+#ifndef _SUPERVISOR_H_
+#define _SUPERVISOR_H_
+
+#include <sys/types.h>
+
+/**
+ * Supervisor module - Runs external tools without a shell. A job is a
+ * pipeline of processes started with posix_spawn, whose output is read by
+ * the caller. Jobs have a deadline and can be cancelled, which kills them.
+ */
+
+#define SUPERVISOR_MAX_PROCS    4
+#define SUPERVISOR_MAXLEN_ERR   256
+#define SUPERVISOR_MAXLEN_LINE  256
+
+/**
+ * Handler of the lines a job writes to stderr, e.g. to follow its progress
+ * @param arg Argument given to supervisor_setLineHandler()
+ * @param line Line without its end of line
+ * @return Nonzero, if the line was understood and need not be logged
+ */
+typedef int (*supervisor_line_handler)(void *arg, const char *line);
+
+struct supervisor_job {
+        const char *name;                       // for the log
+        pid_t pids[SUPERVISOR_MAX_PROCS];
+        int num_procs;
+        int out_fd;                             // stdout of the last process
+        int err_fd;                             // stderr of all processes
+        long long started_us;
+        long long deadline_us;
+        char err[SUPERVISOR_MAXLEN_ERR];        // last lines written to stderr
+        int err_len;
+        char line[SUPERVISOR_MAXLEN_LINE + 1];  // stderr line being read
+        int line_len;
+        supervisor_line_handler on_line;
+        void *arg;
+};
+
+struct supervisor_stats {
+        unsigned int jobs;                      // finished jobs
+        unsigned int failed;                    // exited with an error
+        unsigned int killed;                    // cancelled or timed out
+        long long total_us;                     // time taken by all jobs
+        long long last_us;                      // time taken by the last job
+        int last_status;                        // exit status of the last job
+};
+
+/**
+ * Start a pipeline, each process reading the output of the one before
+ * @param job Job to start
+ * @param name Name of the job for the log
+ * @param argvs NULL terminated argument vectors, the program is searched in PATH
+ * @param num Number of processes, up to SUPERVISOR_MAX_PROCS
+ * @param timeout_ms Time the job may take in milliseconds
+ * @return 0 if successful, otherwise error
+ */
+int supervisor_start(struct supervisor_job *job, const char *name,
+        char *const *argvs[], int num, long long timeout_ms);
+
+/**
+ * Pass the lines the job writes to stderr to a handler. They are handled
+ * while the job is read from or finished, by the caller's thread.
+ * @param job Started job
+ * @param on_line Handler of the lines
+ * @param arg Argument to the handler
+ */
+void supervisor_setLineHandler(struct supervisor_job *job, supervisor_line_handler on_line, void *arg);
+
+/**
+ * Read the output of a job, collecting what it writes to stderr meanwhile
+ * @param job Running job
+ * @param buf Buffer to store the output
+ * @param len Size of the buffer
+ * @param wait_ms Time to wait for output in milliseconds
+ * @return Number of bytes read; 0, at the end of the output; -1 with errno
+ *         EAGAIN, if there was no output in time; -1 with errno ETIMEDOUT,
+ *         if the job is past its deadline
+ */
+ssize_t supervisor_read(struct supervisor_job *job, void *buf, size_t len, int wait_ms);
+
+/**
+ * Wait for a job to exit and release it
+ * @param job Started job
+ * @param cancel Kill the processes first, e.g. when the job is no longer needed
+ * @return 0, if every process exited successfully; otherwise the exit code of
+ *         the first process that failed, or 128 + the signal that ended it
+ */
+int supervisor_finish(struct supervisor_job *job, int cancel);
+
+/**
+ * Get statistics of the finished jobs
+ * @param stats Address to store the statistics
+ */
+void supervisor_getStats(struct supervisor_stats *stats);
+
+#endif
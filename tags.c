@@ -0,0 +1,466 @@
+#include "tags.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define ID3_HDR_SIZE            10
+#define ID3_MAX_TEXT            512
+// the first MP3 frame is looked for this far after the tag
+#define MP3_SCAN_BYTES          4096
+// Ogg headers are looked for at the start, the last page at the end
+#define OGG_SCAN_BYTES          65536
+#define OPUS_RATE               48000
+#define MAX_COMMENT_BYTES       65536
+
+static const char *const formats[] = {
+        "aac", "aif", "aiff", "flac", "m4a", "mp3", "oga", "ogg", "opus", "wav", "wma",
+};
+
+static const unsigned short mp3_bitrates[2][16] = {
+        { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },       // MPEG 1
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },           // MPEG 2 and 2.5
+};
+static const unsigned int mp3_rates[3] = { 44100, 48000, 32000 };
+
+/*
+ * Helper functions
+ */
+
+static uint32_t be32(const unsigned char *p)
+{
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t be24(const unsigned char *p)
+{
+        return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+        return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+static uint64_t le64(const unsigned char *p)
+{
+        return (uint64_t)le32(p + 4) << 32 | le32(p);
+}
+
+// ID3v2 sizes use 7 bits of every byte
+static uint32_t synchsafe(const unsigned char *p)
+{
+        return (uint32_t)(p[0] & 0x7f) << 21 | (uint32_t)(p[1] & 0x7f) << 14 |
+                (uint32_t)(p[2] & 0x7f) << 7 | (p[3] & 0x7f);
+}
+
+// Stores a UTF-8 string, cut at a character boundary if too long, with
+// control characters turned into spaces and surrounding spaces removed
+static void setString(char *dst, const char *src, int len)
+{
+        int start = 0;
+        int n = 0;
+        int i;
+
+        for (i = 0; i < len && src[i]; ++i)
+                ;
+        len = i;
+
+        while (start < len && (unsigned char)src[start] <= ' ')
+                ++start;
+        while (len > start && (unsigned char)src[len - 1] <= ' ')
+                --len;
+
+        if (len - start > TAGS_MAXLEN - 1) {
+                len = start + TAGS_MAXLEN - 1;
+                while (len > start && ((unsigned char)src[len] & 0xc0) == 0x80)
+                        --len;
+        }
+
+        for (i = start; i < len; ++i)
+                dst[n++] = (unsigned char)src[i] < ' ' ? ' ' : src[i];
+        dst[n] = '\0';
+}
+
+static void putUtf8(char *out, int *n, int cap, uint32_t c)
+{
+        if (c < 0x80 && *n + 1 <= cap) {
+                out[(*n)++] = c;
+        } else if (c < 0x800 && *n + 2 <= cap) {
+                out[(*n)++] = 0xc0 | c >> 6;
+                out[(*n)++] = 0x80 | (c & 0x3f);
+        } else if (c >= 0x800 && *n + 3 <= cap) {
+                out[(*n)++] = 0xe0 | c >> 12;
+                out[(*n)++] = 0x80 | (c >> 6 & 0x3f);
+                out[(*n)++] = 0x80 | (c & 0x3f);
+        }
+}
+
+// Converts the text of an ID3v2 frame, which starts with its encoding
+static void id3Text(char *dst, const unsigned char *buf, int len)
+{
+        char out[TAGS_MAXLEN * 3];
+        int be = 1;
+        int n = 0;
+        uint32_t c;
+        int enc;
+        int i;
+
+        if (len < 1)
+                return;
+        enc = buf[0];
+        ++buf;
+        --len;
+
+        switch (enc) {
+        case 0:         // ISO-8859-1
+                for (i = 0; i < len && buf[i]; ++i)
+                        putUtf8(out, &n, sizeof(out), buf[i]);
+                break;
+        case 1:         // UTF-16 with a byte order mark
+        case 2:         // UTF-16BE
+                if (enc == 1 && len >= 2 && buf[0] == 0xff && buf[1] == 0xfe) {
+                        be = 0;
+                        buf += 2;
+                        len -= 2;
+                } else if (enc == 1 && len >= 2 && buf[0] == 0xfe && buf[1] == 0xff) {
+                        buf += 2;
+                        len -= 2;
+                }
+                for (i = 0; i + 1 < len; i += 2) {
+                        c = be ? (uint32_t)buf[i] << 8 | buf[i + 1] : (uint32_t)buf[i + 1] << 8 | buf[i];
+                        if (!c)
+                                break;
+                        // characters outside the BMP are rare in tags
+                        putUtf8(out, &n, sizeof(out), c >= 0xd800 && c < 0xe000 ? '?' : c);
+                }
+                break;
+        case 3:         // UTF-8
+                n = len < (int)sizeof(out) ? len : (int)sizeof(out);
+                (void)memcpy(out, buf, n);
+                break;
+        default:
+                return;
+        }
+
+        setString(dst, out, n);
+}
+
+// Reads the title, artist and length of an ID3v2 tag
+// @return Offset of the audio after the tag, 0 if there is none
+static uint32_t readId3(int fd, struct tags_info *info)
+{
+        unsigned char hdr[ID3_HDR_SIZE];
+        unsigned char frame[ID3_HDR_SIZE];
+        unsigned char text[ID3_MAX_TEXT];
+        char len[TAGS_MAXLEN];
+        uint32_t off, end, size;
+        uint64_t skip;
+        int ver, id_len, hdr_len, n;
+
+        if (pread(fd, hdr, ID3_HDR_SIZE, 0) != ID3_HDR_SIZE || memcmp(hdr, "ID3", 3) ||
+            hdr[3] < 2 || hdr[3] > 4)
+                return 0;
+
+        ver = hdr[3];
+        end = ID3_HDR_SIZE + synchsafe(hdr + 6);
+        id_len = ver == 2 ? 3 : 4;
+        hdr_len = ver == 2 ? 6 : 10;
+
+        // the size of the extended header leaves out its own field in v2.3
+        off = ID3_HDR_SIZE;
+        if (ver > 2 && (hdr[5] & 0x40) && pread(fd, frame, 4, off) == 4) {
+                skip = ver == 3 ? 4 + (uint64_t)be32(frame) : synchsafe(frame);
+                off = skip < end - off ? off + skip : end;
+        }
+
+        while (off + hdr_len <= end) {
+                if (pread(fd, frame, hdr_len, off) != hdr_len || !frame[0])
+                        break;
+
+                size = ver == 2 ? be24(frame + 3) : ver == 4 ? synchsafe(frame + 4) : be32(frame + 4);
+                if (!size || size > end - off - hdr_len)
+                        break;
+
+                n = size < sizeof(text) ? size : sizeof(text);
+                if (!memcmp(frame, ver == 2 ? "TT2" : "TIT2", id_len)) {
+                        if (pread(fd, text, n, off + hdr_len) == n)
+                                id3Text(info->title, text, n);
+                } else if (!memcmp(frame, ver == 2 ? "TP1" : "TPE1", id_len)) {
+                        if (pread(fd, text, n, off + hdr_len) == n)
+                                id3Text(info->artist, text, n);
+                } else if (!memcmp(frame, ver == 2 ? "TLE" : "TLEN", id_len)) {
+                        if (pread(fd, text, n, off + hdr_len) == n) {
+                                id3Text(len, text, n);
+                                info->duration_ms = strtoul(len, NULL, 10);
+                        }
+                }
+
+                off += hdr_len + size;
+        }
+
+        // a footer repeats the header
+        return end + (ver == 4 && (hdr[5] & 0x10) ? ID3_HDR_SIZE : 0);
+}
+
+// Finds the length of MP3 audio from the Xing or VBRI header of its first
+// frame, or from its bit rate if it has neither
+static unsigned int mp3Duration(int fd, uint32_t start, off_t file_size)
+{
+        unsigned char buf[MP3_SCAN_BYTES];
+        unsigned int kbps, rate, spf, side;
+        int len, i, version, mono;
+        const unsigned char *x;
+
+        len = pread(fd, buf, sizeof(buf), start);
+        for (i = 0; i + 4 <= len; ++i) {
+                // frame sync, not MPEG version 'reserved', layer III
+                if (buf[i] != 0xff || (buf[i + 1] & 0xe0) != 0xe0 ||
+                    (buf[i + 1] >> 3 & 3) == 1 || (buf[i + 1] >> 1 & 3) != 1)
+                        continue;
+                if ((buf[i + 2] >> 4) == 0 || (buf[i + 2] >> 4) == 15 || (buf[i + 2] >> 2 & 3) == 3)
+                        continue;
+                break;
+        }
+        if (i + 4 > len)
+                return 0;
+
+        version = buf[i + 1] >> 3 & 3;          // 3: MPEG 1, 2: MPEG 2, 0: MPEG 2.5
+        kbps = mp3_bitrates[version != 3][buf[i + 2] >> 4];
+        rate = mp3_rates[buf[i + 2] >> 2 & 3] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+        mono = (buf[i + 3] >> 6) == 3;
+        spf = version == 3 ? 1152 : 576;
+        side = version == 3 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+
+        // variable bit rate files count their frames
+        x = buf + i + 4 + side;
+        if (x + 12 <= buf + len && (!memcmp(x, "Xing", 4) || !memcmp(x, "Info", 4)) && (be32(x + 4) & 1))
+                return (unsigned long long)be32(x + 8) * spf * 1000 / rate;
+
+        x = buf + i + 4 + 32;
+        if (x + 18 <= buf + len && !memcmp(x, "VBRI", 4))
+                return (unsigned long long)be32(x + 14) * spf * 1000 / rate;
+
+        // bits per kbit/s are ms
+        return (unsigned long long)(file_size - start - i) * 8 / kbps;
+}
+
+// Reads TITLE and ARTIST of Vorbis comments, as in FLAC and Ogg files
+static void readComments(const unsigned char *buf, uint32_t len, struct tags_info *info)
+{
+        uint32_t off, count, n;
+
+        if (len < 8 || le32(buf) > len - 8)
+                return;
+        off = 4 + le32(buf);
+        count = le32(buf + off);
+        off += 4;
+
+        while (count-- && off + 4 <= len) {
+                n = le32(buf + off);
+                off += 4;
+                if (n > len - off)
+                        break;
+
+                if (n > 6 && !strncasecmp((const char *)buf + off, "TITLE=", 6) && !*info->title)
+                        setString(info->title, (const char *)buf + off + 6, n - 6);
+                else if (n > 7 && !strncasecmp((const char *)buf + off, "ARTIST=", 7) && !*info->artist)
+                        setString(info->artist, (const char *)buf + off + 7, n - 7);
+                off += n;
+        }
+}
+
+static void readFlac(int fd, struct tags_info *info)
+{
+        unsigned char hdr[4];
+        unsigned char si[18];
+        unsigned char *buf;
+        uint64_t total;
+        uint32_t off = 4, len, rate;
+
+        if (pread(fd, hdr, 4, 0) != 4 || memcmp(hdr, "fLaC", 4))
+                return;
+
+        while (pread(fd, hdr, 4, off) == 4) {
+                len = be24(hdr + 1);
+
+                if ((hdr[0] & 0x7f) == 0 && len >= sizeof(si) && pread(fd, si, sizeof(si), off + 4) == sizeof(si)) {
+                        // STREAMINFO: 20 bits of rate, 36 bits of samples
+                        rate = (uint32_t)si[10] << 12 | (uint32_t)si[11] << 4 | si[12] >> 4;
+                        total = (uint64_t)(si[13] & 0x0f) << 32 | be32(si + 14);
+                        if (rate)
+                                info->duration_ms = total * 1000 / rate;
+                } else if ((hdr[0] & 0x7f) == 4 && len <= MAX_COMMENT_BYTES && (buf = malloc(len))) {
+                        if (pread(fd, buf, len, off + 4) == (ssize_t)len)
+                                readComments(buf, len, info);
+                        free(buf);
+                }
+
+                if (hdr[0] & 0x80)
+                        break;
+                off += 4 + len;
+        }
+}
+
+// Finds a packet in the first pages of an Ogg file
+static const unsigned char *findPacket(const unsigned char *buf, int len, const char *magic, int magic_len)
+{
+        int i;
+
+        for (i = 0; i + magic_len <= len; ++i)
+                if (!memcmp(buf + i, magic, magic_len))
+                        return buf + i;
+
+        return NULL;
+}
+
+static void readOgg(int fd, off_t file_size, struct tags_info *info)
+{
+        unsigned char *buf;
+        const unsigned char *p;
+        uint64_t granule;
+        unsigned int rate = 0, skip = 0;
+        off_t off;
+        int len, i;
+
+        buf = malloc(OGG_SCAN_BYTES);
+        if (!buf)
+                return;
+
+        len = pread(fd, buf, OGG_SCAN_BYTES, 0);
+        if (len < 4 || memcmp(buf, "OggS", 4)) {
+                free(buf);
+                return;
+        }
+
+        if ((p = findPacket(buf, len, "\x01vorbis", 7)) && p + 16 <= buf + len)
+                rate = le32(p + 12);
+        else if ((p = findPacket(buf, len, "OpusHead", 8)) && p + 12 <= buf + len) {
+                rate = OPUS_RATE;
+                skip = p[10] | p[11] << 8;
+        }
+
+        // comments can span pages, the page headers in between only spoil a comment
+        if ((p = findPacket(buf, len, "\x03vorbis", 7)))
+                readComments(p + 7, buf + len - p - 7, info);
+        else if ((p = findPacket(buf, len, "OpusTags", 8)))
+                readComments(p + 8, buf + len - p - 8, info);
+
+        // the granule position of the last page counts the samples
+        off = file_size > OGG_SCAN_BYTES ? file_size - OGG_SCAN_BYTES : 0;
+        len = pread(fd, buf, OGG_SCAN_BYTES, off);
+        for (i = len - 14; rate && i >= 0; --i) {
+                if (memcmp(buf + i, "OggS", 4) || buf[i + 4])
+                        continue;
+
+                granule = le64(buf + i + 6);
+                if (granule > skip && granule != UINT64_MAX)
+                        info->duration_ms = (granule - skip) * 1000 / rate;
+                break;
+        }
+
+        free(buf);
+}
+
+static void readWav(int fd, struct tags_info *info)
+{
+        unsigned char hdr[12];
+        unsigned char text[ID3_MAX_TEXT];
+        uint32_t off = 12, size, sub_size, byte_rate = 0, data = 0;
+        uint64_t sub, list_end;
+        int n;
+
+        if (pread(fd, hdr, 12, 0) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4))
+                return;
+
+        while (pread(fd, hdr, 12, off) >= 8) {
+                size = le32(hdr + 4);
+
+                if (!memcmp(hdr, "fmt ", 4) && size >= 12 && pread(fd, text, 12, off + 8) == 12) {
+                        byte_rate = le32(text + 8);
+                } else if (!memcmp(hdr, "data", 4)) {
+                        data = size;
+                } else if (!memcmp(hdr, "LIST", 4) && !memcmp(hdr + 8, "INFO", 4)) {
+                        // INFO holds text chunks, INAM is the title
+                        list_end = (uint64_t)off + 8 + size;
+                        for (sub = (uint64_t)off + 12; sub + 8 <= list_end;
+                             sub += 8 + (uint64_t)sub_size + (sub_size & 1)) {
+                                if (pread(fd, hdr, 8, sub) != 8)
+                                        break;
+                                sub_size = le32(hdr + 4);
+                                if (sub_size > list_end - sub - 8)
+                                        break;
+                                n = sub_size < sizeof(text) ? sub_size : sizeof(text);
+                                if ((!memcmp(hdr, "INAM", 4) || !memcmp(hdr, "IART", 4)) &&
+                                    pread(fd, text, n, sub + 8) == n)
+                                        setString(hdr[1] == 'N' ? info->title : info->artist, (char *)text, n);
+                        }
+                }
+
+                // chunks are padded to an even size
+                if (off + 8 + size + (size & 1) <= off)
+                        break;
+                off += 8 + size + (size & 1);
+        }
+
+        if (byte_rate)
+                info->duration_ms = (unsigned long long)data * 1000 / byte_rate;
+}
+
+/*
+ * Public functions
+ */
+
+int tags_isAudioFormat(const char *format)
+{
+        size_t i;
+
+        for (i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+                if (!strcmp(format, formats[i]))
+                        return 1;
+
+        return 0;
+}
+
+int tags_read(const char *path, const char *format, struct tags_info *info)
+{
+        struct stat st;
+        uint32_t start;
+        int fd;
+
+        (void)memset(info, 0, sizeof(*info));
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return errno;
+        if (fstat(fd, &st)) {
+                (void)close(fd);
+                return errno;
+        }
+
+        if (!strcmp(format, "mp3")) {
+                start = readId3(fd, info);
+                if (!info->duration_ms)
+                        info->duration_ms = mp3Duration(fd, start, st.st_size);
+        } else if (!strcmp(format, "flac")) {
+                readFlac(fd, info);
+        } else if (!strcmp(format, "ogg") || !strcmp(format, "oga") || !strcmp(format, "opus")) {
+                readOgg(fd, st.st_size, info);
+        } else if (!strcmp(format, "wav")) {
+                readWav(fd, info);
+        }
+
+        (void)close(fd);
+        return 0;
+}
+
+void tags_setString(char *dst, const char *src, int len)
+{
+        setString(dst, src, len);
+}
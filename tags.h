@@ -0,0 +1,46 @@
+#ifndef _TAGS_H_
+#define _TAGS_H_
+
+/**
+ * Tags module - Reads the title, artist and length of audio files without
+ * decoding them: ID3v2 tags and frame headers of MP3 files, FLAC and Ogg
+ * (Vorbis, Opus) comments and stream headers, and RIFF chunks of WAV files.
+ * Strings are converted to UTF-8.
+ */
+
+#define TAGS_MAXLEN             128
+
+struct tags_info {
+        char title[TAGS_MAXLEN];        // empty, if unknown
+        char artist[TAGS_MAXLEN];       // empty, if unknown
+        unsigned int duration_ms;       // 0, if unknown
+};
+
+/**
+ * Check if files of a format can be played
+ * @param format File extension in lower case, e.g. "mp3"
+ * @return Nonzero, if it is an audio format
+ */
+int tags_isAudioFormat(const char *format);
+
+/**
+ * Read the tags of a file. Formats without tags the module can read
+ * leave the info empty.
+ * @param path Path of the file
+ * @param format File extension in lower case
+ * @param info Address to store the tags
+ * @return 0 if successful; otherwise error opening the file
+ */
+int tags_read(const char *path, const char *format, struct tags_info *info);
+
+/**
+ * Store a string in a field of tags_info the way tags are stored: cut at a
+ * UTF-8 character boundary if too long, with control characters turned into
+ * spaces and surrounding spaces removed
+ * @param dst Field of TAGS_MAXLEN bytes
+ * @param src String, not necessarily terminated
+ * @param len Length of the string at most
+ */
+void tags_setString(char *dst, const char *src, int len);
+
+#endif
@@ -0,0 +1,133 @@
+#include "timesync.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define PRINTF_MODULE           "[timesync] "
+
+// number of recent exchanges considered when picking the offset
+// the exchange with the smallest round trip has the least queueing error
+#define NUM_SAMPLES             8
+
+struct sample {
+        long long offset;
+        long long rtt;
+};
+
+static struct sample samples[NUM_SAMPLES];
+static int num_samples = 0;
+static int next_sample = 0;
+
+static long long offset_us = 0;
+static long long rtt_us = 0;
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Helper functions
+ */
+
+// NOTE: mtx must be held
+static void updateEstimate(void)
+{
+        int i, best = 0;
+
+        for (i = 1; i < num_samples; ++i) {
+                if (samples[i].rtt < samples[best].rtt)
+                        best = i;
+        }
+
+        offset_us = samples[best].offset;
+        rtt_us = samples[best].rtt;
+}
+
+/*
+ * Public functions
+ */
+int timesync_init(void)
+{
+        timesync_reset();
+
+        return 0;
+}
+
+void timesync_cleanup(void)
+{
+}
+
+long long timesync_getTimeUs(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void timesync_reset(void)
+{
+        pthread_mutex_lock(&mtx);
+        memset(samples, 0, sizeof(samples));
+        num_samples = 0;
+        next_sample = 0;
+        offset_us = 0;
+        rtt_us = 0;
+        pthread_mutex_unlock(&mtx);
+}
+
+void timesync_addSample(long long t1, long long t2, long long t3, long long t4)
+{
+        long long rtt;
+
+        // time spent on the network, excluding processing on the master
+        rtt = (t4 - t1) - (t3 - t2);
+        if (rtt < 0) {
+                printf(PRINTF_MODULE "Warning: discarding time sample with negative round trip\n");
+                (void)fflush(stdout);
+                return;
+        }
+
+        pthread_mutex_lock(&mtx);
+        samples[next_sample].offset = ((t2 - t1) + (t3 - t4)) / 2;
+        samples[next_sample].rtt = rtt;
+        next_sample = (next_sample + 1) % NUM_SAMPLES;
+        if (num_samples < NUM_SAMPLES)
+                ++num_samples;
+
+        updateEstimate();
+        pthread_mutex_unlock(&mtx);
+}
+
+int timesync_isSynced(void)
+{
+        return num_samples > 0;
+}
+
+long long timesync_getOffsetUs(void)
+{
+        long long ret;
+
+        pthread_mutex_lock(&mtx);
+        ret = offset_us;
+        pthread_mutex_unlock(&mtx);
+
+        return ret;
+}
+
+long long timesync_getRoundTripUs(void)
+{
+        long long ret;
+
+        pthread_mutex_lock(&mtx);
+        ret = rtt_us;
+        pthread_mutex_unlock(&mtx);
+
+        return ret;
+}
+
+long long timesync_toMasterTime(long long local_us)
+{
+        return local_us + timesync_getOffsetUs();
+}
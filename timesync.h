@@ -0,0 +1,66 @@
+#ifndef _TIMESYNC_H_
+#define _TIMESYNC_H_
+
+/**
+ * Time synchronization module - estimates the offset between this device's
+ * clock and the master's clock using NTP-style request/response exchanges.
+ * All timestamps are in microseconds of CLOCK_MONOTONIC.
+ */
+
+/**
+ * Initializes this module
+ * @return 0 if successful, otherwise error
+ */
+int timesync_init(void);
+
+/**
+ * Cleans up this module
+ */
+void timesync_cleanup(void);
+
+/**
+ * Get the current time of this device
+ * @return Local monotonic time in microseconds
+ */
+long long timesync_getTimeUs(void);
+
+/**
+ * Discard all offset samples, e.g. when following a different master
+ */
+void timesync_reset(void);
+
+/**
+ * Add the result of a time exchange with the master
+ * @param t1 Local time the request was sent
+ * @param t2 Master time the request was received
+ * @param t3 Master time the response was sent
+ * @param t4 Local time the response was received
+ */
+void timesync_addSample(long long t1, long long t2, long long t3, long long t4);
+
+/**
+ * Gets whether an offset to the master clock has been estimated
+ * @return 1, if synchronized; 0, otherwise
+ */
+int timesync_isSynced(void);
+
+/**
+ * Get the estimated offset of the master clock (master - local)
+ * @return Offset in microseconds
+ */
+long long timesync_getOffsetUs(void);
+
+/**
+ * Get the round trip delay of the sample the offset was taken from
+ * @return Round trip delay in microseconds
+ */
+long long timesync_getRoundTripUs(void);
+
+/**
+ * Convert a local timestamp to the master's clock
+ * @param local_us Local time in microseconds
+ * @return Equivalent master time in microseconds
+ */
+long long timesync_toMasterTime(long long local_us);
+
+#endif